@@ -0,0 +1,106 @@
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Header placed in front of every tracked block. The union members pad it so
+// the returned pointer keeps malloc's alignment guarantees (C99 has no
+// max_align_t).
+typedef union {
+  struct {
+    size_t size;
+    MemTag tag;
+  } h;
+  long double align_ld;
+  long long align_ll;
+  void *align_ptr;
+} MemHeader;
+
+static const char *mem_tag_names[MEM_TAG_COUNT] = {
+    "scrollback",
+    "strings",
+    "libvterm",
+    "metadata",
+    "tokens",
+    "lines",
+};
+
+const char *mem_tag_name(MemTag tag) {
+  return tag < MEM_TAG_COUNT ? mem_tag_names[tag] : "unknown";
+}
+
+static void account_alloc(MemStats *stats, MemTag tag, size_t size) {
+  MemTagStats *t = &stats->tags[tag];
+  t->live_bytes += size;
+  t->live_objects++;
+  t->total_allocs++;
+  if (t->live_bytes > t->peak_bytes)
+    t->peak_bytes = t->live_bytes;
+
+  stats->live_bytes += size;
+  if (stats->live_bytes > stats->peak_bytes)
+    stats->peak_bytes = stats->live_bytes;
+}
+
+static void account_free(MemStats *stats, MemTag tag, size_t size) {
+  MemTagStats *t = &stats->tags[tag];
+  t->live_bytes -= size;
+  t->live_objects--;
+  stats->live_bytes -= size;
+}
+
+void *tracked_malloc(MemStats *stats, MemTag tag, size_t size) {
+  MemHeader *hdr = malloc(sizeof(MemHeader) + size);
+  if (!hdr)
+    return NULL;
+  hdr->h.size = size;
+  hdr->h.tag = tag;
+  account_alloc(stats, tag, size);
+  return hdr + 1;
+}
+
+void *tracked_calloc(MemStats *stats, MemTag tag, size_t count,
+                     size_t elem_size) {
+  // Like calloc, refuse sizes that overflow
+  if (elem_size && count > SIZE_MAX / elem_size)
+    return NULL;
+  size_t size = count * elem_size;
+  void *ptr = tracked_malloc(stats, tag, size);
+  if (ptr)
+    memset(ptr, 0, size);
+  return ptr;
+}
+
+void *tracked_realloc(MemStats *stats, MemTag tag, void *ptr, size_t size) {
+  if (!ptr)
+    return tracked_malloc(stats, tag, size);
+
+  MemHeader *hdr = (MemHeader *)ptr - 1;
+  size_t old_size = hdr->h.size;
+  MemTag old_tag = hdr->h.tag;
+  MemHeader *grown = realloc(hdr, sizeof(MemHeader) + size);
+  if (!grown)
+    return NULL;
+
+  account_free(stats, old_tag, old_size);
+  account_alloc(stats, old_tag, size);
+  grown->h.size = size;
+  return grown + 1;
+}
+
+char *tracked_strndup(MemStats *stats, MemTag tag, const char *str,
+                      size_t len) {
+  char *dup = tracked_malloc(stats, tag, len + 1);
+  if (dup) {
+    memcpy(dup, str, len);
+    dup[len] = '\0';
+  }
+  return dup;
+}
+
+void tracked_free(MemStats *stats, void *ptr) {
+  if (!ptr)
+    return;
+  MemHeader *hdr = (MemHeader *)ptr - 1;
+  account_free(stats, hdr->h.tag, hdr->h.size);
+  free(hdr);
+}
@@ -0,0 +1,61 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Tagged allocation accounting
+//
+// Every heap allocation owned by a terminal goes through these wrappers so we
+// can tell how much memory each subsystem holds. A small header in front of
+// each block remembers its size and tag, so frees need neither.
+//
+// Usage:
+//   MemStats stats = {0};
+//   char *s = tracked_malloc(&stats, MEM_TAG_STRINGS, 64);
+//   tracked_free(&stats, s);
+//   stats.tags[MEM_TAG_STRINGS].peak_bytes;  // high-water mark
+
+typedef enum {
+  MEM_TAG_SCROLLBACK = 0, /* ScrollbackLine rows */
+  MEM_TAG_STRINGS,        /* title, OSC command buffer, selection data */
+  MEM_TAG_LIBVTERM,       /* allocations made by libvterm itself */
+  MEM_TAG_METADATA,       /* directory and prompt spans (linemeta.c) */
+  MEM_TAG_TOKENS,         /* completion token index (tokidx.c) */
+  MEM_TAG_LINES,          /* completed lines for subscribers */
+  MEM_TAG_COUNT
+} MemTag;
+
+typedef struct {
+  size_t live_bytes;
+  size_t live_objects;
+  size_t peak_bytes;
+  uint64_t total_allocs; /* cumulative, never decreases */
+} MemTagStats;
+
+typedef struct {
+  MemTagStats tags[MEM_TAG_COUNT];
+  size_t live_bytes; /* sum over all tags */
+  size_t peak_bytes;
+} MemStats;
+
+// Human readable name of TAG (e.g. "scrollback")
+const char *mem_tag_name(MemTag tag);
+
+void *tracked_malloc(MemStats *stats, MemTag tag, size_t size);
+
+// Allocate zeroed memory
+void *tracked_calloc(MemStats *stats, MemTag tag, size_t count,
+                     size_t elem_size);
+
+// Resize PTR (may be NULL) keeping its original tag
+void *tracked_realloc(MemStats *stats, MemTag tag, void *ptr, size_t size);
+
+// Duplicate LEN bytes of STR and NUL-terminate the copy
+char *tracked_strndup(MemStats *stats, MemTag tag, const char *str,
+                      size_t len);
+
+// Free PTR (may be NULL)
+void tracked_free(MemStats *stats, void *ptr);
+
+#endif // ALLOC_H
@@ -1,4 +1,6 @@
 #include "arena.h"
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -20,6 +22,44 @@
 #define vm_free(ptr, size) free(ptr)
 #endif
 
+#define HUGE_PAGE ((size_t)2 << 20)
+#define LARGE_BLOCK_MAX ((size_t)64 << 20)
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+
+// Map SIZE bytes (a multiple of HUGE_PAGE) aligned to HUGE_PAGE. The huge
+// page advice comes before the prefault, so the faults get huge pages.
+static void *vm_alloc_large(size_t size, int flags) {
+  char *p = vm_alloc(size + HUGE_PAGE);
+  if (!p)
+    return NULL;
+  char *start = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+  if (start > p)
+    munmap(p, start - p);
+  munmap(start + size, p + HUGE_PAGE - start);
+
+#ifdef MADV_HUGEPAGE
+  if (flags & ARENA_HUGE_PAGES)
+    madvise(start, size, MADV_HUGEPAGE);
+#endif
+  if (flags & ARENA_PREFAULT) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, size, MADV_POPULATE_WRITE) == 0)
+      return start;
+#endif
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < size; off += page)
+      ((volatile char *)start)[off] = 0;
+  }
+  return start;
+}
+#else
+// No huge page or prefault support: Windows needs a privilege for large
+// pages, and malloc knows nothing of pages
+#define vm_alloc_large(size, flags) vm_alloc(size)
+#endif
+
 // Allocate a new arena block and prepend it to the allocator's chain.
 // Returns the new block, or NULL on failure.
 static arena_t *arena_new_block(arena_allocator_t *allocator, size_t min_size) {
@@ -28,7 +68,15 @@ static arena_t *arena_new_block(arena_allocator_t *allocator, size_t min_size) {
     block_size = min_size;
 
   size_t total_size = sizeof(arena_t) + block_size;
-  arena_t *block = (arena_t *)vm_alloc(total_size);
+  arena_t *block;
+  if (allocator->flags) {
+    // Whole huge pages, the header included
+    total_size = (total_size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    block_size = total_size - sizeof(arena_t);
+    block = (arena_t *)vm_alloc_large(total_size, allocator->flags);
+  } else {
+    block = (arena_t *)vm_alloc(total_size);
+  }
   if (!block)
     return NULL;
 
@@ -38,14 +86,18 @@ static arena_t *arena_new_block(arena_allocator_t *allocator, size_t min_size) {
   block->next = allocator->current;
 
   allocator->current = block;
+  allocator->reserved_bytes += block_size;
+  allocator->block_count++;
 
   // Exponential growth: double for next allocation
   allocator->next_block_size = block_size * 2;
+  if (allocator->flags && allocator->next_block_size > LARGE_BLOCK_MAX)
+    allocator->next_block_size = LARGE_BLOCK_MAX - sizeof(arena_t);
 
   return block;
 }
 
-arena_allocator_t *arena_create(size_t default_block_size) {
+arena_allocator_t *arena_create_large(size_t default_block_size, int flags) {
   // Allocate the allocator struct itself via vm_alloc
   arena_allocator_t *allocator =
       (arena_allocator_t *)vm_alloc(sizeof(arena_allocator_t));
@@ -55,6 +107,10 @@ arena_allocator_t *arena_create(size_t default_block_size) {
   allocator->current = NULL;
   allocator->default_block_size = default_block_size;
   allocator->next_block_size = default_block_size;
+  allocator->reserved_bytes = 0;
+  allocator->block_count = 0;
+  allocator->peak_used = 0;
+  allocator->flags = flags;
 
   // Pre-allocate first block for cold-start optimization
   if (!arena_new_block(allocator, default_block_size)) {
@@ -65,6 +121,10 @@ arena_allocator_t *arena_create(size_t default_block_size) {
   return allocator;
 }
 
+arena_allocator_t *arena_create(size_t default_block_size) {
+  return arena_create_large(default_block_size, 0);
+}
+
 void *arena_alloc(arena_allocator_t *allocator, size_t size) {
   // Align to 8 bytes
   size = (size + 7) & ~(size_t)7;
@@ -110,7 +170,81 @@ void *arena_realloc(arena_allocator_t *allocator, void *old_ptr,
   return new_ptr;
 }
 
+size_t arena_used(const arena_allocator_t *allocator) {
+  size_t used = 0;
+  for (arena_t *arena = allocator->current; arena; arena = arena->next)
+    used += arena->used;
+  return used;
+}
+
+#ifdef __linux__
+// Bytes of huge pages in the blocks, prorated from the AnonHugePages of the
+// mappings that overlap them, which may be merged with their neighbours
+static size_t smaps_huge_bytes(const arena_allocator_t *allocator) {
+  FILE *f = fopen("/proc/self/smaps", "r");
+  if (!f)
+    return 0;
+  char line[256];
+  uintptr_t vma_start = 0, vma_end = 0;
+  size_t overlap = 0, huge = 0;
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long lo, hi, kb;
+    if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+      vma_start = lo;
+      vma_end = hi;
+      overlap = 0;
+      for (arena_t *a = allocator->current; a; a = a->next) {
+        uintptr_t s = (uintptr_t)a, e = s + sizeof(arena_t) + a->size;
+        s = s > vma_start ? s : vma_start;
+        e = e < vma_end ? e : vma_end;
+        if (s < e)
+          overlap += e - s;
+      }
+    } else if (overlap && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+      huge += (size_t)((double)kb * 1024 * overlap / (vma_end - vma_start));
+    }
+  }
+  fclose(f);
+  return huge;
+}
+#endif
+
+void arena_pages(const arena_allocator_t *allocator, ArenaPages *pages) {
+  pages->reserved = 0;
+  pages->resident = 0;
+  pages->huge = 0;
+  for (arena_t *a = allocator->current; a; a = a->next) {
+    size_t size = sizeof(arena_t) + a->size;
+    pages->reserved += size;
+#if defined(__unix__) || defined(__APPLE__)
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t count = (size + page - 1) / page;
+    unsigned char *vec = malloc(count);
+    // mincore wants char * on macOS and the BSDs, unsigned char * on Linux
+    if (vec && mincore((void *)a, size, (void *)vec) == 0) {
+      for (size_t i = 0; i < count; i++)
+        pages->resident += (vec[i] & 1) ? page : 0;
+    } else {
+      pages->resident += size;
+    }
+    free(vec);
+#else
+    pages->resident += size;
+#endif
+  }
+#ifdef __linux__
+  if (allocator->flags & ARENA_HUGE_PAGES)
+    pages->huge = smaps_huge_bytes(allocator);
+#endif
+  if (pages->resident > pages->reserved)
+    pages->resident = pages->reserved;
+}
+
 void arena_reset(arena_allocator_t *allocator) {
+  size_t used = arena_used(allocator);
+  if (used > allocator->peak_used)
+    allocator->peak_used = used;
+
   // Reset all blocks for reuse (keep memory allocated)
   arena_t *arena = allocator->current;
   while (arena) {
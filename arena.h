@@ -31,11 +31,30 @@ typedef struct {
   arena_t *current;
   size_t default_block_size;
   size_t next_block_size; // Exponential growth: doubles each time
+  size_t reserved_bytes;  // Sum of all block sizes (memory held from the OS)
+  size_t block_count;
+  size_t peak_used;       // Highest arena_used() seen at arena_reset
+  int flags;              // ARENA_* of arena_create_large, 0 otherwise
 } arena_allocator_t;
 
+// Large-block mode, for pools of hundreds of MB such as the scrollback.
+// Blocks are multiples of 2 MB, aligned to 2 MB and capped at 64 MB each.
+#define ARENA_HUGE_PAGES 1 // advise transparent huge pages (Linux)
+#define ARENA_PREFAULT 2   // fault every page in when the block is mapped
+
+// Page usage of an arena's blocks
+typedef struct {
+  size_t reserved; // bytes mapped
+  size_t resident; // of which in memory
+  size_t huge;     // of which backed by huge pages (estimated, Linux only)
+} ArenaPages;
+
 // Create a new arena allocator with specified initial block size
 arena_allocator_t *arena_create(size_t initial_block_size);
 
+// Create an arena in large-block mode with ARENA_* FLAGS
+arena_allocator_t *arena_create_large(size_t initial_block_size, int flags);
+
 // Allocate memory from arena (O(1), 8-byte aligned)
 void *arena_alloc(arena_allocator_t *allocator, size_t size);
 
@@ -51,6 +70,12 @@ char *arena_strdup(arena_allocator_t *arena, const char *str);
 void *arena_realloc(arena_allocator_t *allocator, void *old_ptr,
                     size_t old_size, size_t new_size);
 
+// Bytes handed out since creation or the last reset (O(blocks))
+size_t arena_used(const arena_allocator_t *allocator);
+
+// Page usage of the blocks (O(pages) for resident, reads /proc for huge)
+void arena_pages(const arena_allocator_t *allocator, ArenaPages *pages);
+
 // Reset arena for reuse (keeps memory allocated, resets pointers)
 void arena_reset(arena_allocator_t *allocator);
 
@@ -0,0 +1,217 @@
+;;; bench-latency.el --- Keystroke-to-screen latency for vterm -*- lexical-binding: t -*-
+
+;;; Commentary:
+
+;; Measures what users feel when typing: the delay between a key event
+;; being sent the way `vterm--self-insert' does and its echo appearing
+;; in the buffer.
+;;
+;; The terminal runs `cat -u' on a raw, non-echoing tty, so every byte
+;; we send comes straight back as output.  We take a timestamp just
+;; before `vterm--send-event' and another one in an :after advice on
+;; `vterm--redraw' as soon as the character before the cursor is the
+;; key we sent, i.e. the moment `term_redraw' has put the echoed cell
+;; into the buffer.  Everything in between (key translation, pty round
+;; trip, process filter, libvterm, invalidate/timer logic, redraw) is
+;; included.
+;;
+;; Two conditions are measured: idle, and with
+;; `vterm-bench-latency-load-terminals' hidden terminals running
+;; `vterm-bench-latency-load-command' at the same time.
+;;
+;; Usage (POSIX only, from the repository root):
+;;
+;;   emacs -Q --batch -L . -l benchmark/bench-latency.el \
+;;         -f vterm-bench-latency-batch [OUTPUT.json]
+
+;;; Code:
+
+(require 'vterm)
+(require 'vterm-benchmark
+         (expand-file-name "benchmark"
+                           (file-name-directory
+                            (or load-file-name buffer-file-name))))
+
+(defvar vterm-bench-latency-samples 200
+  "Number of keystrokes measured per condition.")
+
+(defvar vterm-bench-latency-interval 0.01
+  "Seconds to wait between keystrokes, like a fast typist.")
+
+(defvar vterm-bench-latency-timeout 2.0
+  "Seconds after which a keystroke counts as lost.")
+
+(defvar vterm-bench-latency-echo-command
+  "sh -c 'stty raw -echo; exec cat -u'"
+  "Program that echoes every byte it reads.")
+
+(defvar vterm-bench-latency-load-terminals 3
+  "Number of background terminals producing output under load.")
+
+(defvar vterm-bench-latency-load-command
+  "sh -c 'while :; do seq 1 2000; done'"
+  "Program run in each background terminal under load.")
+
+(defconst vterm-bench-latency--keys
+  "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+  "Keys sent in turn, so consecutive echoes are distinguishable.")
+
+(defconst vterm-bench-latency--line-length 40
+  "Keys typed before returning to column 0.")
+
+(defvar vterm-bench-latency--buffer nil
+  "Terminal whose redraws are being watched.")
+
+(defvar vterm-bench-latency--expected nil
+  "Character whose echo we are waiting for.")
+
+(defvar vterm-bench-latency--rendered nil
+  "Time at which the expected character was rendered.")
+
+(defun vterm-bench-latency--after-redraw (&rest _)
+  "Record the time once the expected echo is in the buffer."
+  (when (and vterm-bench-latency--expected
+             (eq (current-buffer) vterm-bench-latency--buffer)
+             (eq (char-before (point)) vterm-bench-latency--expected))
+    (setq vterm-bench-latency--rendered (float-time)
+          vterm-bench-latency--expected nil)))
+
+(defun vterm-bench-latency--spawn (command &optional visible)
+  "Return a new vterm buffer running COMMAND.
+Show it in the selected window if VISIBLE."
+  (let ((buf (generate-new-buffer " *vterm-latency*")))
+    (when visible
+      (set-window-buffer (selected-window) buf))
+    (with-current-buffer buf
+      (let ((vterm-shell command))
+        (vterm-mode)))
+    buf))
+
+(defun vterm-bench-latency--kill (buf)
+  "Kill terminal BUF without asking."
+  (when (buffer-live-p buf)
+    (let ((proc (get-buffer-process buf)))
+      (when proc
+        (set-process-query-on-exit-flag proc nil)
+        (delete-process proc)))
+    (kill-buffer buf)))
+
+(defun vterm-bench-latency--wait (seconds)
+  "Serve all processes and timers for SECONDS."
+  (let ((end (+ (float-time) seconds)))
+    (while (< (float-time) end)
+      (accept-process-output nil (max 0.001 (- end (float-time)))))))
+
+(defun vterm-bench-latency--sample (buf key)
+  "Send KEY (a character) to BUF and return its echo latency in seconds.
+Return nil if the echo was not rendered within the timeout."
+  (with-current-buffer buf
+    (setq vterm-bench-latency--buffer buf
+          vterm-bench-latency--rendered nil
+          vterm-bench-latency--expected key)
+    (let ((start (float-time)))
+      (vterm--send-event key)
+      (while (and (not vterm-bench-latency--rendered)
+                  (< (- (float-time) start) vterm-bench-latency-timeout))
+        (accept-process-output nil 0.001))
+      (setq vterm-bench-latency--expected nil)
+      (when vterm-bench-latency--rendered
+        (- vterm-bench-latency--rendered start)))))
+
+(defun vterm-bench-latency-keystroke (buf i)
+  "Type the I-th key of a run into echo terminal BUF.
+Return its latency in milliseconds, or nil if it was lost."
+  (when (and (> i 0) (zerop (% i vterm-bench-latency--line-length)))
+    ;; Back to column 0 so the echo never lands in a pending wrap.
+    (with-current-buffer buf
+      (vterm-send-string "\r"))
+    (vterm-bench-latency--wait 0.05))
+  (let ((latency (vterm-bench-latency--sample
+                  buf (aref vterm-bench-latency--keys
+                            (% i (length vterm-bench-latency--keys))))))
+    (when latency
+      (* 1000 latency))))
+
+(defun vterm-bench-latency-summarize (latencies lost)
+  "Return a plist summarizing LATENCIES (ms) with LOST keystrokes."
+  (if (null latencies)
+      (list :samples 0 :lost lost)
+    (list :samples (length latencies)
+          :lost lost
+          :min (apply #'min latencies)
+          :p50 (vterm-benchmark-percentile latencies 50)
+          :p95 (vterm-benchmark-percentile latencies 95)
+          :p99 (vterm-benchmark-percentile latencies 99)
+          :max (apply #'max latencies))))
+
+(defun vterm-bench-latency-measure (buf n)
+  "Measure N keystroke latencies in terminal BUF.
+Return a plist with :samples, :lost and percentiles in milliseconds."
+  (let ((latencies nil)
+        (lost 0))
+    (dotimes (i n)
+      (let ((latency (vterm-bench-latency-keystroke buf i)))
+        (if latency
+            (push latency latencies)
+          (setq lost (1+ lost))))
+      (vterm-bench-latency--wait vterm-bench-latency-interval))
+    (vterm-bench-latency-summarize latencies lost)))
+
+(defun vterm-bench-latency--print (name result)
+  "Print a summary line for condition NAME with RESULT."
+  (if (zerop (plist-get result :samples))
+      (message "%-6s all %d keystrokes lost" name (plist-get result :lost))
+    (message "%-6s p50 %6.2f ms  p95 %6.2f ms  p99 %6.2f ms  max %6.2f ms  lost %d"
+             name
+             (plist-get result :p50) (plist-get result :p95)
+             (plist-get result :p99) (plist-get result :max)
+             (plist-get result :lost))))
+
+;;;###autoload
+(defun vterm-bench-latency-run (&optional file)
+  "Measure keystroke latency idle and under load.
+Write the JSON report to FILE if non-nil and return it."
+  (interactive)
+  (let ((echo (vterm-bench-latency--spawn vterm-bench-latency-echo-command t))
+        (vterm-follow-terminal-cursor t)
+        load idle busy)
+    (advice-add 'vterm--redraw :after #'vterm-bench-latency--after-redraw)
+    (unwind-protect
+        (progn
+          ;; Let the shell start and the stty settings take effect.
+          (vterm-bench-latency--wait 0.5)
+          (setq idle (vterm-bench-latency-measure
+                      echo vterm-bench-latency-samples))
+          (vterm-bench-latency--print "idle" idle)
+          (dotimes (_ vterm-bench-latency-load-terminals)
+            (push (vterm-bench-latency--spawn
+                   vterm-bench-latency-load-command)
+                  load))
+          (vterm-bench-latency--wait 0.5)
+          (setq busy (vterm-bench-latency-measure
+                      echo vterm-bench-latency-samples))
+          (vterm-bench-latency--print "load" busy))
+      (advice-remove 'vterm--redraw #'vterm-bench-latency--after-redraw)
+      (mapc #'vterm-bench-latency--kill load)
+      (vterm-bench-latency--kill echo))
+    (let ((report (list :emacs-version emacs-version
+                        :system system-configuration
+                        :timer-delay vterm-timer-delay
+                        :interval vterm-bench-latency-interval
+                        :load-terminals vterm-bench-latency-load-terminals
+                        :load-command vterm-bench-latency-load-command
+                        :idle idle
+                        :load busy)))
+      (when file
+        (vterm-benchmark-write-json report file)
+        (message "Results written to %s" file))
+      report)))
+
+(defun vterm-bench-latency-batch ()
+  "Run `vterm-bench-latency-run' from `emacs --batch'.
+An optional file name in `command-line-args-left' receives the report."
+  (vterm-bench-latency-run (or (pop command-line-args-left)
+                               "latency-results.json")))
+
+(provide 'vterm-bench-latency)
+;;; bench-latency.el ends here
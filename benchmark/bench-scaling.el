@@ -0,0 +1,207 @@
+;;; bench-scaling.el --- Many-terminal scaling benchmark for vterm -*- lexical-binding: t -*-
+
+;;; Commentary:
+
+;; Real sessions keep dozens of terminals open, most of them hidden.
+;; This benchmark spawns N terminals (N in `vterm-bench-scaling-counts')
+;; that each replay the same recorded stream through a real pty with
+;; cat, shows a few of them and keeps the rest hidden, and meanwhile
+;; types into a focused echo terminal (see bench-latency.el).
+;;
+;; For every N it reports:
+;;   - aggregate throughput: bytes delivered to the replaying terminals
+;;     divided by the time until the last replay finished;
+;;   - main-thread busy %: time spent in `vterm--filter',
+;;     `vterm--delayed-redraw' and garbage collection over wall time;
+;;   - RSS growth per terminal (from /proc, Linux only) and the bytes
+;;     held by the module per terminal (`vterm-memory-stats');
+;;   - keystroke latency percentiles in the focused terminal.
+;;
+;; The stream defaults to a corpus generated by
+;; `vterm-benchmark-write-corpus'; set VTERM_BENCHMARK_CORPUS to replay
+;; a recording instead (e.g. one captured with script(1)).
+;;
+;; Usage (POSIX only, from the repository root):
+;;
+;;   emacs -Q --batch -L . -l benchmark/bench-scaling.el \
+;;         -f vterm-bench-scaling-batch [OUTPUT.json]
+
+;;; Code:
+
+(require 'vterm)
+(require 'seq)
+(require 'vterm-bench-latency
+         (expand-file-name "bench-latency"
+                           (file-name-directory
+                            (or load-file-name buffer-file-name))))
+
+(defvar vterm-bench-scaling-counts '(1 10 50 100)
+  "Numbers of replaying terminals to measure.")
+
+(defvar vterm-bench-scaling-visible 2
+  "Number of replaying terminals shown in a window.")
+
+(defvar vterm-bench-scaling-repeat 4
+  "Times each terminal replays the corpus.")
+
+(defvar vterm-bench-scaling-timeout 600
+  "Seconds after which a run is abandoned.")
+
+(defvar vterm-bench-scaling-corpus (getenv "VTERM_BENCHMARK_CORPUS")
+  "Recorded stream to replay, or nil to generate one.")
+
+(defvar vterm-bench-scaling--busy 0.0
+  "Seconds spent in instrumented functions during the current run.")
+
+(defvar vterm-bench-scaling--depth 0
+  "Nesting depth of instrumented calls, so time is counted once.")
+
+(defvar vterm-bench-scaling--bytes 0
+  "Bytes delivered to process filters during the current run.")
+
+(defun vterm-bench-scaling--time (fn &rest args)
+  "Call FN with ARGS, adding its run time to the busy counter."
+  (if (> vterm-bench-scaling--depth 0)
+      (apply fn args)
+    (let ((start (float-time))
+          (vterm-bench-scaling--depth 1))
+      (unwind-protect (apply fn args)
+        (setq vterm-bench-scaling--busy
+              (+ vterm-bench-scaling--busy (- (float-time) start)))))))
+
+(defun vterm-bench-scaling--count (_process input)
+  "Count the bytes of INPUT."
+  (setq vterm-bench-scaling--bytes
+        (+ vterm-bench-scaling--bytes (string-bytes input))))
+
+(defun vterm-bench-scaling--replay-command (corpus)
+  "Return the shell command replaying CORPUS."
+  (format "sh -c 'i=0; while [ $i -lt %d ]; do cat \"%s\"; i=$((i+1)); done'"
+          vterm-bench-scaling-repeat (expand-file-name corpus)))
+
+(defun vterm-bench-scaling--show (bufs)
+  "Show the first buffers of BUFS in windows below the selected one.
+Return the number actually shown; small frames may fit fewer."
+  (let ((shown 0))
+    (dolist (buf (seq-take bufs vterm-bench-scaling-visible))
+      (let ((win (ignore-errors (split-window (selected-window) nil 'below))))
+        (when win
+          (set-window-buffer win buf)
+          (setq shown (1+ shown)))))
+    shown))
+
+(defun vterm-bench-scaling-run-n (n corpus)
+  "Replay CORPUS in N terminals and return the measurements."
+  (garbage-collect)
+  (let* ((rss-before (vterm-benchmark-rss))
+         (echo (vterm-bench-latency--spawn vterm-bench-latency-echo-command t))
+         (command (vterm-bench-scaling--replay-command corpus))
+         (vterm-kill-buffer-on-exit nil)
+         (vterm-follow-terminal-cursor t)
+         replays shown latencies (lost 0) start elapsed busy gc-time
+         rss-after module-bytes)
+    (advice-add 'vterm--redraw :after #'vterm-bench-latency--after-redraw)
+    (advice-add 'vterm--filter :around #'vterm-bench-scaling--time)
+    (advice-add 'vterm--filter :before #'vterm-bench-scaling--count)
+    (advice-add 'vterm--delayed-redraw :around #'vterm-bench-scaling--time)
+    (unwind-protect
+        (progn
+          (vterm-bench-latency--wait 0.5)
+          (dotimes (_ n)
+            (push (vterm-bench-latency--spawn command) replays))
+          (setq replays (nreverse replays))
+          (setq shown (vterm-bench-scaling--show replays))
+          (setq vterm-bench-scaling--busy 0.0
+                vterm-bench-scaling--bytes 0
+                gc-time gc-elapsed
+                start (float-time))
+          (let ((i 0))
+            (while (and (cl-some (lambda (b)
+                                   (process-live-p (get-buffer-process b)))
+                                 replays)
+                        (< (- (float-time) start) vterm-bench-scaling-timeout))
+              (let ((latency (vterm-bench-latency-keystroke echo i)))
+                (if latency
+                    (push latency latencies)
+                  (setq lost (1+ lost))))
+              (setq i (1+ i))
+              (vterm-bench-latency--wait vterm-bench-latency-interval)))
+          ;; Flush redraws still pending on a timer.
+          (vterm-bench-latency--wait (* 2 (or vterm-timer-delay-bulk 0.1)))
+          (setq elapsed (- (float-time) start)
+                busy vterm-bench-scaling--busy
+                gc-time (- gc-elapsed gc-time))
+          (garbage-collect)
+          (setq rss-after (vterm-benchmark-rss)
+                module-bytes (apply #'+ (mapcar #'vterm-benchmark-module-bytes
+                                                replays))))
+      (advice-remove 'vterm--redraw #'vterm-bench-latency--after-redraw)
+      (advice-remove 'vterm--filter #'vterm-bench-scaling--time)
+      (advice-remove 'vterm--filter #'vterm-bench-scaling--count)
+      (advice-remove 'vterm--delayed-redraw #'vterm-bench-scaling--time)
+      (mapc #'vterm-bench-latency--kill replays)
+      (vterm-bench-latency--kill echo)
+      (delete-other-windows))
+    (list :terminals n
+          :visible shown
+          :bytes vterm-bench-scaling--bytes
+          :seconds elapsed
+          :mb-per-sec (/ vterm-bench-scaling--bytes elapsed 1048576.0)
+          :busy-percent (* 100 (/ (+ busy gc-time) elapsed))
+          :rss-per-terminal (when (and rss-before rss-after)
+                              (/ (- rss-after rss-before) n))
+          :module-bytes-per-terminal (/ module-bytes n)
+          :latency (vterm-bench-latency-summarize latencies lost))))
+
+(defun vterm-bench-scaling--print (result)
+  "Print a summary line for RESULT."
+  (let ((latency (plist-get result :latency)))
+    (message "N=%-3d %7.2f MB/s  busy %5.1f%%  rss/term %8s  module/term %8s  p50 %6.2f ms  p99 %6.2f ms"
+             (plist-get result :terminals)
+             (plist-get result :mb-per-sec)
+             (plist-get result :busy-percent)
+             (let ((rss (plist-get result :rss-per-terminal)))
+               (if rss (file-size-human-readable rss) "n/a"))
+             (file-size-human-readable
+              (plist-get result :module-bytes-per-terminal))
+             (or (plist-get latency :p50) 0)
+             (or (plist-get latency :p99) 0))))
+
+;;;###autoload
+(defun vterm-bench-scaling-run (&optional file)
+  "Run the scaling benchmark for every count in `vterm-bench-scaling-counts'.
+Write the JSON report to FILE if non-nil and return it."
+  (interactive)
+  (let* ((corpus (or vterm-bench-scaling-corpus
+                     (make-temp-file "vterm-corpus")))
+         (generated (not vterm-bench-scaling-corpus))
+         results)
+    (unwind-protect
+        (progn
+          (when generated
+            (vterm-benchmark-write-corpus corpus))
+          (dolist (n vterm-bench-scaling-counts)
+            (let ((result (vterm-bench-scaling-run-n n corpus)))
+              (vterm-bench-scaling--print result)
+              (push result results))))
+      (when generated
+        (delete-file corpus)))
+    (let ((report (list :emacs-version emacs-version
+                        :system system-configuration
+                        :corpus (if generated "generated" corpus)
+                        :repeat vterm-bench-scaling-repeat
+                        :timer-delay vterm-timer-delay
+                        :runs (vconcat (nreverse results)))))
+      (when file
+        (vterm-benchmark-write-json report file)
+        (message "Results written to %s" file))
+      report)))
+
+(defun vterm-bench-scaling-batch ()
+  "Run `vterm-bench-scaling-run' from `emacs --batch'.
+An optional file name in `command-line-args-left' receives the report."
+  (vterm-bench-scaling-run (or (pop command-line-args-left)
+                               "scaling-results.json")))
+
+(provide 'vterm-bench-scaling)
+;;; bench-scaling.el ends here
@@ -0,0 +1,473 @@
+;;; benchmark.el --- Batch-mode rendering benchmarks for vterm -*- lexical-binding: t -*-
+
+;;; Commentary:
+
+;; Deterministic rendering benchmarks that run without a shell.
+;;
+;; Every scenario builds a byte stream up front, then feeds it in
+;; pty-sized chunks through `vterm--write-input' and `vterm--redraw' on
+;; a terminal whose buffer owns a dummy pipe process.  Nothing depends
+;; on timers, `sit-for' or the speed of a subprocess, so two builds can
+;; be compared run against run.
+;;
+;; For each scenario we record wall time, number of garbage
+;; collections, time spent in GC and the objects consed (as reported
+;; by `memory-use-counts').  Results are written as JSON.
+;;
+;; Usage (from the repository root, with the module built):
+;;
+;;   emacs -Q --batch -L . -l benchmark/benchmark.el \
+;;         -f vterm-benchmark-batch [OUTPUT.json]
+;;
+;;   emacs -Q --batch -L . -l benchmark/benchmark.el \
+;;         -f vterm-benchmark-compare-batch OLD.json NEW.json
+;;
+;; Interactively, `vterm-benchmark-run-all' does the same and writes
+;; `vterm-benchmark-output-file'.
+
+;;; Code:
+
+(require 'vterm)
+(require 'json)
+(require 'cl-lib)
+
+(defvar vterm-benchmark-iterations
+  (let ((env (getenv "VTERM_BENCHMARK_ITERATIONS")))
+    (if env (string-to-number env) 5))
+  "Number of timed runs per scenario.
+The first run is preceded by an untimed warm-up run.")
+
+(defvar vterm-benchmark-output-file "benchmark-results.json"
+  "File that `vterm-benchmark-run-all' writes its JSON report to.")
+
+(defvar vterm-benchmark-rows 24
+  "Height of the benchmark terminal.")
+
+(defvar vterm-benchmark-cols 80
+  "Width of the benchmark terminal.")
+
+(defvar vterm-benchmark-chunk-size 4096
+  "Size of a simulated pty read, in characters.")
+
+;;; Deterministic input
+
+(defvar vterm-benchmark--seed 1
+  "State of the linear congruential generator.")
+
+(defun vterm-benchmark--reset-random ()
+  "Reset the pseudo random generator so streams are reproducible."
+  (setq vterm-benchmark--seed 1))
+
+(defun vterm-benchmark--random (n)
+  "Return a pseudo random integer in [0, N).
+Independent of `random' so streams are identical across Emacs builds."
+  (setq vterm-benchmark--seed
+        (logand (+ (* vterm-benchmark--seed 1103515245) 12345) #x7fffffff))
+  (% (ash vterm-benchmark--seed -16) n))
+
+(defconst vterm-benchmark--alphabet
+  "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 _-./")
+
+(defun vterm-benchmark--text (len)
+  "Return LEN pseudo random printable characters."
+  (let ((s (make-string len ?\s))
+        (n (length vterm-benchmark--alphabet)))
+    (dotimes (i len)
+      (aset s i (aref vterm-benchmark--alphabet (vterm-benchmark--random n))))
+    s))
+
+(defun vterm-benchmark--sgr (&rest params)
+  "Return an SGR escape sequence with PARAMS."
+  (format "\e[%sm" (mapconcat #'number-to-string params ";")))
+
+(defun vterm-benchmark-stream-plain (lines cols)
+  "Return LINES lines of COLS plain characters."
+  (mapconcat (lambda (_) (vterm-benchmark--text cols))
+             (number-sequence 1 lines) "\r\n"))
+
+(defun vterm-benchmark-stream-ansi (lines cols)
+  "Return LINES lines of COLS characters, recolored every 8 columns."
+  (mapconcat
+   (lambda (_)
+     (let (parts)
+       (dotimes (i (/ cols 8))
+         (push (vterm-benchmark--sgr
+                (if (zerop (% i 3)) 1 0)
+                (+ 30 (vterm-benchmark--random 8))
+                (+ 40 (vterm-benchmark--random 8)))
+               parts)
+         (push (vterm-benchmark--text 8) parts))
+       (push (vterm-benchmark--sgr 0) parts)
+       (apply #'concat (nreverse parts))))
+   (number-sequence 1 lines) "\r\n"))
+
+(defun vterm-benchmark-stream-progress (steps)
+  "Return STEPS progress bar updates, each as a separate chunk."
+  (mapcar
+   (lambda (i)
+     (let ((filled (/ (* i 50) steps)))
+       (format "\r\e[K[%s%s] %3d%% %s"
+               (make-string filled ?#)
+               (make-string (- 50 filled) ?\s)
+               (/ (* i 100) steps)
+               (vterm-benchmark--text 12))))
+   (number-sequence 1 steps)))
+
+(defun vterm-benchmark-stream-mixed (blocks)
+  "Return BLOCKS rounds of typical interactive shell output.
+Each round has a prompt with directory tracking, a colored listing,
+a log with wide characters, tabs and a compiler style diagnostic."
+  (let (parts)
+    (dotimes (b blocks)
+      (push (format "\e]51;A%s@%s:/home/%s/src/project%d\e\\"
+                    "user" "host" "user" (% b 7))
+            parts)
+      (push (format "%suser@host%s:%s~/src/project%d%s$ ls -l\r\n"
+                    (vterm-benchmark--sgr 1 32) (vterm-benchmark--sgr 0)
+                    (vterm-benchmark--sgr 1 34) (% b 7)
+                    (vterm-benchmark--sgr 0))
+            parts)
+      (dotimes (_ 12)
+        (push (format "-rw-r--r-- 1 user user %8d Jan %2d 12:%02d %s%s%s\r\n"
+                      (vterm-benchmark--random 1000000)
+                      (1+ (vterm-benchmark--random 28))
+                      (vterm-benchmark--random 60)
+                      (vterm-benchmark--sgr (+ 31 (vterm-benchmark--random 6)))
+                      (vterm-benchmark--text 14)
+                      (vterm-benchmark--sgr 0))
+              parts))
+      (dotimes (_ 6)
+        (push (format "%s%07x%s\t%s 変更 %s ✓\r\n"
+                      (vterm-benchmark--sgr 33)
+                      (vterm-benchmark--random #xfffffff)
+                      (vterm-benchmark--sgr 0)
+                      (vterm-benchmark--text 20)
+                      (vterm-benchmark--text 10))
+              parts))
+      (push (format "src/%s.c:%d:%d: %swarning:%s unused variable\r\n"
+                    (vterm-benchmark--text 6)
+                    (vterm-benchmark--random 2000)
+                    (vterm-benchmark--random 80)
+                    (vterm-benchmark--sgr 1 35) (vterm-benchmark--sgr 0))
+            parts))
+    (apply #'concat (nreverse parts))))
+
+(defun vterm-benchmark-chunks (stream &optional size)
+  "Split STREAM into chunks of at most SIZE characters.
+SIZE defaults to `vterm-benchmark-chunk-size'.  If STREAM is
+already a list it is returned unchanged."
+  (if (listp stream)
+      stream
+    (let ((size (or size vterm-benchmark-chunk-size))
+          (len (length stream))
+          (pos 0)
+          chunks)
+      (while (< pos len)
+        (push (substring stream pos (min len (+ pos size))) chunks)
+        (setq pos (+ pos size)))
+      (nreverse chunks))))
+
+(defun vterm-benchmark-write-corpus (file &optional blocks)
+  "Write BLOCKS rounds of `vterm-benchmark-stream-mixed' to FILE.
+The file is UTF-8 encoded and can be replayed through a real pty,
+e.g. with cat.  Return the number of bytes written."
+  (vterm-benchmark--reset-random)
+  (let ((coding-system-for-write 'utf-8-unix))
+    (with-temp-file file
+      (insert (vterm-benchmark-stream-mixed (or blocks 200)))))
+  (file-attribute-size (file-attributes file)))
+
+;;; Scenarios
+
+(defvar vterm-benchmark-scenarios
+  `((large-output
+     :description "Large text output (1000 lines x 80 cols)"
+     :stream ,(lambda () (vterm-benchmark-stream-plain 1000 80)))
+    (ansi-color
+     :description "Large output with ANSI colors (1000 lines)"
+     :stream ,(lambda () (vterm-benchmark-stream-ansi 1000 80)))
+    (rapid-updates
+     :description "Rapid small updates (100 iterations)"
+     :stream ,(lambda () (vterm-benchmark-stream-progress 100)))
+    (scrolling
+     :description "Scrolling (500 lines, one line per read)"
+     :stream ,(lambda ()
+                (vterm-benchmark-chunks
+                 (vterm-benchmark-stream-plain 500 60) 62)))
+    (wide-lines
+     :description "Wide lines (100 lines x 200 cols)"
+     :stream ,(lambda () (vterm-benchmark-stream-plain 100 200)))
+    (mixed-content
+     :description "Mixed content (prompts, listings, wide chars)"
+     :stream ,(lambda () (vterm-benchmark-stream-mixed 40))))
+  "Alist of (NAME . PLIST) benchmark scenarios.
+PLIST keys:
+  :description  human readable summary
+  :stream       function returning a string or a list of chunks
+  :redraw-every redraw after this many chunks (default 1)")
+
+;;; Terminal harness
+
+(defun vterm-benchmark-make-terminal (&optional rows cols)
+  "Return a buffer holding a ROWS x COLS terminal fed by no shell.
+The buffer is shown in the selected window so redraw behaves as it
+does for a visible terminal.  A pipe process stands in for the pty."
+  (let ((rows (or rows vterm-benchmark-rows))
+        (cols (or cols vterm-benchmark-cols))
+        (buf (generate-new-buffer " *vterm-benchmark*")))
+    (with-current-buffer buf
+      (buffer-disable-undo)
+      (setq vterm--term (vterm--new rows cols vterm-max-scrollback
+                                    nil nil nil nil nil nil
+                                    vterm-lazy-faces))
+      (setq vterm--process (make-pipe-process :name "vterm-benchmark"
+                                              :buffer buf
+                                              :noquery t
+                                              :filter #'ignore
+                                              :sentinel #'ignore))
+      (setq buffer-read-only t)
+      (setq-local truncate-lines t))
+    (set-window-buffer (selected-window) buf)
+    buf))
+
+(defun vterm-benchmark-kill-terminal (buf)
+  "Kill benchmark terminal BUF and its dummy process."
+  (when (buffer-live-p buf)
+    (with-current-buffer buf
+      (when (process-live-p vterm--process)
+        (delete-process vterm--process))
+      (when vterm--redraw-timer
+        (cancel-timer vterm--redraw-timer)))
+    (kill-buffer buf)))
+
+(defmacro vterm-benchmark-with-terminal (var &rest body)
+  "Bind VAR to a fresh benchmark terminal buffer while running BODY."
+  (declare (indent 1))
+  `(let ((,var (vterm-benchmark-make-terminal)))
+     (unwind-protect (progn ,@body)
+       (vterm-benchmark-kill-terminal ,var))))
+
+(defun vterm-benchmark-feed (buf chunks &optional redraw-every)
+  "Feed CHUNKS to the terminal in BUF, redrawing every REDRAW-EVERY chunks.
+Any redraw timer scheduled by the module is cancelled; the explicit
+redraw stands in for it."
+  (with-current-buffer buf
+    (let ((inhibit-read-only t)
+          (every (or redraw-every 1))
+          (n 0))
+      (dolist (chunk chunks)
+        (vterm--write-input vterm--term chunk)
+        (setq n (1+ n))
+        (when (zerop (% n every))
+          (vterm--redraw vterm--term)))
+      (unless (zerop (% n every))
+        (vterm--redraw vterm--term))
+      (when vterm--redraw-timer
+        (cancel-timer vterm--redraw-timer)
+        (setq vterm--redraw-timer nil)))))
+
+;;; Measurement
+
+(defun vterm-benchmark-rss ()
+  "Return the resident set size of this Emacs in bytes, or nil.
+Only available where /proc/self/status exists."
+  (when (file-readable-p "/proc/self/status")
+    (with-temp-buffer
+      (insert-file-contents "/proc/self/status")
+      (when (re-search-forward "^VmRSS:[ \t]+\\([0-9]+\\) kB" nil t)
+        (* 1024 (string-to-number (match-string 1)))))))
+
+(defun vterm-benchmark-module-bytes (buf)
+  "Return the bytes held by the module for the terminal in BUF.
+This is the live heap of the terminal plus the memory reserved by
+its arenas, see `vterm-memory-stats'."
+  (let ((stats (vterm-memory-stats buf)))
+    (+ (car (plist-get stats :total))
+       (cadr (plist-get stats :persistent-arena))
+       (cadr (plist-get stats :temp-arena)))))
+
+(defun vterm-benchmark-measure (fn)
+  "Call FN and return a plist of its cost.
+Keys are :time and :gc-time in seconds, :gc (collections) and the
+deltas of `memory-use-counts' as :conses, :floats, :vector-cells,
+:symbols, :string-chars, :intervals and :strings."
+  (garbage-collect)
+  (let ((gcs gcs-done)
+        (gc-time gc-elapsed)
+        (counts (memory-use-counts))
+        (start (current-time)))
+    (funcall fn)
+    (let ((elapsed (float-time (time-since start)))
+          (delta (cl-mapcar #'- (memory-use-counts) counts)))
+      (list :time elapsed
+            :gc (- gcs-done gcs)
+            :gc-time (- gc-elapsed gc-time)
+            :conses (nth 0 delta)
+            :floats (nth 1 delta)
+            :vector-cells (nth 2 delta)
+            :symbols (nth 3 delta)
+            :string-chars (nth 4 delta)
+            :intervals (nth 5 delta)
+            :strings (nth 6 delta)))))
+
+(defun vterm-benchmark--median (values)
+  "Return the median of the numbers in VALUES."
+  (let* ((sorted (sort (copy-sequence values) #'<))
+         (n (length sorted)))
+    (if (cl-oddp n)
+        (nth (/ n 2) sorted)
+      (/ (+ (nth (1- (/ n 2)) sorted) (nth (/ n 2) sorted)) 2.0))))
+
+(defun vterm-benchmark-percentile (values p)
+  "Return the P-th percentile (0-100) of VALUES by nearest rank."
+  (let* ((sorted (sort (copy-sequence values) #'<))
+         (rank (max 1 (ceiling (* (/ p 100.0) (length sorted))))))
+    (nth (1- rank) sorted)))
+
+(defun vterm-benchmark-run-scenario (name &optional iterations)
+  "Run the scenario NAME ITERATIONS times and return its result plist."
+  (let* ((spec (cdr (assq name vterm-benchmark-scenarios)))
+         (iterations (or iterations vterm-benchmark-iterations))
+         (chunks (progn (vterm-benchmark--reset-random)
+                        (vterm-benchmark-chunks
+                         (funcall (plist-get spec :stream)))))
+         (bytes (apply #'+ (mapcar #'string-bytes chunks)))
+         (every (plist-get spec :redraw-every))
+         runs)
+    ;; Warm up: faces, color lookups and the arenas settle on first use.
+    (vterm-benchmark-with-terminal buf
+      (vterm-benchmark-feed buf chunks every))
+    (dotimes (_ iterations)
+      (vterm-benchmark-with-terminal buf
+        (push (vterm-benchmark-measure
+               (lambda () (vterm-benchmark-feed buf chunks every)))
+              runs)))
+    (setq runs (nreverse runs))
+    (let* ((times (mapcar (lambda (r) (plist-get r :time)) runs))
+           (median (vterm-benchmark--median times)))
+      (list :name (symbol-name name)
+            :description (plist-get spec :description)
+            :bytes bytes
+            :chunks (length chunks)
+            :iterations iterations
+            :median-time median
+            :min-time (apply #'min times)
+            :max-time (apply #'max times)
+            :mb-per-sec (if (> median 0) (/ bytes median 1048576.0) 0)
+            :gc (apply #'+ (mapcar (lambda (r) (plist-get r :gc)) runs))
+            :gc-time (apply #'+ (mapcar (lambda (r) (plist-get r :gc-time)) runs))
+            :conses (vterm-benchmark--median
+                     (mapcar (lambda (r) (plist-get r :conses)) runs))
+            :string-chars (vterm-benchmark--median
+                           (mapcar (lambda (r) (plist-get r :string-chars)) runs))
+            :vector-cells (vterm-benchmark--median
+                           (mapcar (lambda (r) (plist-get r :vector-cells)) runs))
+            :intervals (vterm-benchmark--median
+                        (mapcar (lambda (r) (plist-get r :intervals)) runs))
+            :runs (vconcat runs)))))
+
+(defun vterm-benchmark--git-revision ()
+  "Return the current git revision of the vterm sources, or nil."
+  (let ((default-directory (file-name-directory (locate-library "vterm"))))
+    (ignore-errors
+      (with-temp-buffer
+        (when (zerop (call-process "git" nil t nil "rev-parse" "--short" "HEAD"))
+          (string-trim (buffer-string)))))))
+
+(defun vterm-benchmark-report (results)
+  "Return the JSON report object for the scenario RESULTS."
+  (list :emacs-version emacs-version
+        :system system-configuration
+        :revision (or (vterm-benchmark--git-revision) "unknown")
+        :timestamp (format-time-string "%FT%T%z")
+        :rows vterm-benchmark-rows
+        :cols vterm-benchmark-cols
+        :scenarios (vconcat results)))
+
+(defun vterm-benchmark-write-json (object file)
+  "Write OBJECT as pretty printed JSON to FILE."
+  (with-temp-file file
+    (insert (json-encode object))
+    (json-pretty-print-buffer)
+    (insert "\n")))
+
+(defun vterm-benchmark--print (result)
+  "Print a one-line summary of scenario RESULT."
+  (message "%-14s %8.2f ms  %7.2f MB/s  %3d GC  %9d conses  %s"
+           (plist-get result :name)
+           (* 1000 (plist-get result :median-time))
+           (plist-get result :mb-per-sec)
+           (plist-get result :gc)
+           (plist-get result :conses)
+           (plist-get result :description)))
+
+;;;###autoload
+(defun vterm-benchmark-run-all (&optional file)
+  "Run every scenario in `vterm-benchmark-scenarios'.
+Write the JSON report to FILE (default `vterm-benchmark-output-file')
+and return it."
+  (interactive)
+  (let ((file (or file vterm-benchmark-output-file))
+        results)
+    (message "vterm benchmarks: %d iterations, %dx%d, Emacs %s"
+             vterm-benchmark-iterations vterm-benchmark-cols
+             vterm-benchmark-rows emacs-version)
+    (dolist (scenario vterm-benchmark-scenarios)
+      (let ((result (vterm-benchmark-run-scenario (car scenario))))
+        (vterm-benchmark--print result)
+        (push result results)))
+    (let ((report (vterm-benchmark-report (nreverse results))))
+      (vterm-benchmark-write-json report file)
+      (message "Results written to %s" file)
+      report)))
+
+;;; Comparison
+
+(defun vterm-benchmark--read (file)
+  "Read a JSON report from FILE."
+  (let ((json-object-type 'plist)
+        (json-array-type 'list)
+        (json-key-type 'keyword))
+    (json-read-file file)))
+
+(defun vterm-benchmark-compare (old new)
+  "Print per-scenario ratios between reports in files OLD and NEW.
+Ratios below 1.0 mean NEW is cheaper."
+  (interactive "fOld report: \nfNew report: ")
+  (let ((old-scenarios (plist-get (vterm-benchmark--read old) :scenarios))
+        (new-scenarios (plist-get (vterm-benchmark--read new) :scenarios)))
+    (message "%-14s %10s %10s %7s %9s" "scenario" "old ms" "new ms"
+             "time" "conses")
+    (dolist (n new-scenarios)
+      (let ((o (cl-find (plist-get n :name) old-scenarios
+                        :key (lambda (s) (plist-get s :name))
+                        :test #'equal)))
+        (when o
+          (message "%-14s %10.2f %10.2f %6.2fx %8.2fx"
+                   (plist-get n :name)
+                   (* 1000 (plist-get o :median-time))
+                   (* 1000 (plist-get n :median-time))
+                   (/ (plist-get n :median-time)
+                      (max (plist-get o :median-time) 1e-9))
+                   (/ (float (plist-get n :conses))
+                      (max (plist-get o :conses) 1))))))))
+
+;;; Batch entry points
+
+(defun vterm-benchmark-batch ()
+  "Run all scenarios from `emacs --batch'.
+An optional file name in `command-line-args-left' overrides
+`vterm-benchmark-output-file'."
+  (let ((file (pop command-line-args-left)))
+    (vterm-benchmark-run-all file)))
+
+(defun vterm-benchmark-compare-batch ()
+  "Compare two reports named in `command-line-args-left'."
+  (let ((old (pop command-line-args-left))
+        (new (pop command-line-args-left)))
+    (unless (and old new)
+      (error "Usage: -f vterm-benchmark-compare-batch OLD.json NEW.json"))
+    (vterm-benchmark-compare old new)))
+
+(provide 'vterm-benchmark)
+;;; benchmark.el ends here
@@ -0,0 +1,309 @@
+/* budget.c --- Check deterministic cost budgets of canonical scenarios
+ *
+ * Wall time is noisy, but what the module costs is dominated by counts that
+ * are exactly reproducible. Each scenario is replayed through a fresh 24x80
+ * terminal and the headless env of stub-env.c, and four counts are taken over
+ * its measured part only (setup output, such as a screen to scroll, is free):
+ *
+ *   funcalls  calls from the module into Lisp
+ *   strings   Lisp strings made by the module
+ *   mallocs   tracked heap allocations (alloc.h), including libvterm's
+ *   arena     bytes handed out by the temp and persistent arenas
+ *
+ * The counts are compared with the budgets in benchmark/budgets.txt and
+ * printed as a table. Any count above its budget, or without one, fails the
+ * run, so a change that makes a scenario more expensive shows up in review as
+ * a failing check and, once accepted, as a diff of budgets.txt. -u rewrites
+ * the file with the current counts, which is also how budgets are first
+ * recorded.
+ *
+ * Usage:
+ *   vterm-budget [-u] [-v] [BUDGETS]    (BUDGETS: benchmark/budgets.txt)
+ *   cmake --build build --target check-budget
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vterm-module.h"
+
+static uint64_t budget_arena_bytes;
+
+static void *count_arena_alloc(arena_allocator_t *arena, size_t size) {
+  budget_arena_bytes += size;
+  return arena_alloc(arena, size);
+}
+
+static void *count_arena_calloc(arena_allocator_t *arena, size_t count,
+                                size_t elem_size) {
+  budget_arena_bytes += count * elem_size;
+  return arena_calloc(arena, count, elem_size);
+}
+
+static void *count_arena_realloc(arena_allocator_t *arena, void *ptr,
+                                 size_t old_size, size_t new_size) {
+  budget_arena_bytes += new_size;
+  return arena_realloc(arena, ptr, old_size, new_size);
+}
+
+// Count the arena traffic of vterm-module.c
+#define arena_alloc count_arena_alloc
+#define arena_calloc count_arena_calloc
+#define arena_realloc count_arena_realloc
+
+#include "vterm-module.c"
+
+#include "stub-env.h"
+
+/* ---------------------------------------------------------------------------
+ * Scenarios
+ * ------------------------------------------------------------------------- */
+
+typedef struct {
+  char *bytes;
+  size_t len, cap;
+} Buf;
+
+static void buf_printf(Buf *buf, const char *format, ...) {
+  va_list ap;
+  for (;;) {
+    va_start(ap, format);
+    int n = vsnprintf(buf->bytes + buf->len, buf->cap - buf->len, format, ap);
+    va_end(ap);
+    if (n >= 0 && buf->len + n < buf->cap) {
+      buf->len += n;
+      return;
+    }
+    buf->cap = buf->cap ? buf->cap * 2 : 4096;
+    buf->bytes = realloc(buf->bytes, buf->cap);
+  }
+}
+
+#define PROMPT                                                                 \
+  "\033]51;Auser@host:/home/user/project\033\\"                                \
+  "\033[32muser@host\033[0m:~/project$ "
+
+// Typing one character at the prompt and its echo
+static void echo_setup(Buf *buf) { buf_printf(buf, PROMPT); }
+static void echo_run(Buf *buf) { buf_printf(buf, "l"); }
+
+// A screen of ls --color output
+static void colored_run(Buf *buf) {
+  static const char *colors[] = {"0", "1;34", "32", "38;5;208",
+                                 "38;2;90;160;255"};
+  for (int i = 0; i < 24; i++)
+    buf_printf(buf, "-rw-r--r-- 1 user user %6d Oct 18 12:%02d \033[%smfile-%d"
+                    "\033[0m\r\n",
+               i * 7919 % 100000, i, colors[i % 5], i);
+}
+
+// Ten lines of Ctrl-E in vim: scroll region, insert line, status line
+static void vim_setup(Buf *buf) {
+  buf_printf(buf, "\033[?1049h\033[H\033[2J");
+  for (int i = 1; i <= 23; i++)
+    buf_printf(buf, "\033[%d;1H\033[33m%3d \033[0mstatic int line_%d;", i, i,
+               i);
+  buf_printf(buf, "\033[24;1H\033[7m vterm-module.c  1,1  Top \033[0m");
+}
+
+static void vim_run(Buf *buf) {
+  for (int i = 24; i < 34; i++) {
+    buf_printf(buf, "\033[1;23r\033[23;1H\n\033[33m%3d \033[0mstatic int "
+                    "line_%d;\033[r",
+               i, i);
+    buf_printf(buf, "\033[24;1H\033[7m vterm-module.c  %d,1  %d%% \033[0m",
+               i - 22, i * 3);
+  }
+}
+
+// cat of a 10k-line file
+static void flood_run(Buf *buf) {
+  for (int i = 0; i < 10000; i++)
+    buf_printf(buf, "line %d of the flood, some text to wrap the row\r\n", i);
+}
+
+// cd at the prompt and the new prompt with directory tracking
+static void cd_setup(Buf *buf) { buf_printf(buf, PROMPT); }
+static void cd_run(Buf *buf) {
+  buf_printf(buf, "cd /tmp\r\n\033]51;Auser@host:/tmp\033\\"
+                  "\033[32muser@host\033[0m:/tmp$ ");
+}
+
+typedef struct {
+  const char *name;
+  void (*setup)(Buf *buf);
+  void (*run)(Buf *buf);
+} Scenario;
+
+static const Scenario scenarios[] = {
+    {"echo", echo_setup, echo_run},  {"colored-screen", NULL, colored_run},
+    {"vim-scroll", vim_setup, vim_run}, {"flood-10k", NULL, flood_run},
+    {"cd-prompt", cd_setup, cd_run},
+};
+
+enum { METRIC_FUNCALLS, METRIC_STRINGS, METRIC_MALLOCS, METRIC_ARENA,
+       METRIC_COUNT };
+
+static const char *metric_names[METRIC_COUNT] = {"funcalls", "strings",
+                                                 "mallocs", "arena"};
+
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* ---------------------------------------------------------------------------
+ * Replay
+ * ------------------------------------------------------------------------- */
+
+static uint64_t tracked_allocs(const Term *term) {
+  uint64_t allocs = 0;
+  for (int i = 0; i < MEM_TAG_COUNT; i++)
+    allocs += term->mem.tags[i].total_allocs;
+  return allocs;
+}
+
+static void measure(emacs_env *env, const Scenario *scenario,
+                    uint64_t counts[METRIC_COUNT]) {
+  Buf setup = {0}, run = {0};
+  if (scenario->setup)
+    scenario->setup(&setup);
+  scenario->run(&run);
+
+  emacs_value term_value = stub_env_new_term(env, 24, 80);
+  Term *term = env->get_user_ptr(env, term_value);
+  stub_env_feed(env, term_value, setup.bytes, setup.len);
+
+  uint64_t funcalls = stub_env_funcalls, strings = stub_env_strings;
+  uint64_t mallocs = tracked_allocs(term), arena = budget_arena_bytes;
+  // The input strings are made by the driver, not the module
+  uint64_t input_strings =
+      stub_env_feed(env, term_value, run.bytes, run.len);
+  counts[METRIC_FUNCALLS] = stub_env_funcalls - funcalls;
+  counts[METRIC_STRINGS] = stub_env_strings - strings - input_strings;
+  counts[METRIC_MALLOCS] = tracked_allocs(term) - mallocs;
+  counts[METRIC_ARENA] = budget_arena_bytes - arena;
+
+  term_finalize(term);
+  stub_env_release();
+  free(setup.bytes);
+  free(run.bytes);
+}
+
+/* ---------------------------------------------------------------------------
+ * Budgets
+ * ------------------------------------------------------------------------- */
+
+#define NO_BUDGET UINT64_MAX
+
+// Read "SCENARIO METRIC BUDGET" lines; '#' starts a comment
+static void read_budgets(const char *path,
+                         uint64_t budgets[][METRIC_COUNT]) {
+  for (size_t s = 0; s < SCENARIO_COUNT; s++)
+    for (int m = 0; m < METRIC_COUNT; m++)
+      budgets[s][m] = NO_BUDGET;
+
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+  char line[256], scenario[64], metric[64];
+  unsigned long long budget;
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#' ||
+        sscanf(line, "%63s %63s %llu", scenario, metric, &budget) != 3)
+      continue;
+    for (size_t s = 0; s < SCENARIO_COUNT; s++)
+      for (int m = 0; m < METRIC_COUNT; m++)
+        if (!strcmp(scenario, scenarios[s].name) &&
+            !strcmp(metric, metric_names[m]))
+          budgets[s][m] = budget;
+  }
+  fclose(f);
+}
+
+static bool write_budgets(const char *path, uint64_t counts[][METRIC_COUNT]) {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  fprintf(f, "# Cost budgets of benchmark/budget.c: SCENARIO METRIC BUDGET\n"
+             "# Regenerate with vterm-budget -u after an accepted change.\n");
+  for (size_t s = 0; s < SCENARIO_COUNT; s++)
+    for (int m = 0; m < METRIC_COUNT; m++)
+      fprintf(f, "%s %s %llu\n", scenarios[s].name, metric_names[m],
+              (unsigned long long)counts[s][m]);
+  return fclose(f) == 0;
+}
+
+int main(int argc, char **argv) {
+  const char *path = "benchmark/budgets.txt";
+  bool update = false, verbose = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-u")) {
+      update = true;
+    } else if (!strcmp(argv[i], "-v")) {
+      verbose = true;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-u] [-v] [BUDGETS]\n", argv[0]);
+      return 2;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  emacs_env *env = stub_env_init();
+  uint64_t counts[SCENARIO_COUNT][METRIC_COUNT];
+  uint64_t budgets[SCENARIO_COUNT][METRIC_COUNT];
+  read_budgets(path, budgets);
+  for (size_t s = 0; s < SCENARIO_COUNT; s++)
+    measure(env, &scenarios[s], counts[s]);
+
+  if (update) {
+    if (!write_budgets(path, counts)) {
+      perror(path);
+      return 1;
+    }
+    printf("Budgets written to %s\n", path);
+    return 0;
+  }
+
+  // Only changed counts are shown unless -v; '+' marks those over budget
+  int over = 0, missing = 0;
+  printf("  %-16s %-9s %10s %10s %8s\n", "scenario", "metric", "count",
+         "budget", "delta");
+  for (size_t s = 0; s < SCENARIO_COUNT; s++) {
+    for (int m = 0; m < METRIC_COUNT; m++) {
+      uint64_t count = counts[s][m], budget = budgets[s][m];
+      char mark = ' ';
+      if (budget == NO_BUDGET) {
+        missing++;
+        printf("? %-16s %-9s %10llu %10s\n", scenarios[s].name,
+               metric_names[m], (unsigned long long)count, "-");
+        continue;
+      }
+      if (count > budget) {
+        mark = '+';
+        over++;
+      } else if (count < budget) {
+        mark = '-';
+      } else if (!verbose) {
+        continue;
+      }
+      printf("%c %-16s %-9s %10llu %10llu %+8lld\n", mark, scenarios[s].name,
+             metric_names[m], (unsigned long long)count,
+             (unsigned long long)budget, (long long)(count - budget));
+    }
+  }
+
+  if (over)
+    printf("%d count(s) over budget; if intended, run vterm-budget -u and "
+           "commit %s\n",
+           over, path);
+  // A count without a budget could grow unnoticed
+  if (missing)
+    printf("%d count(s) have no budget; record them with vterm-budget -u and "
+           "commit %s\n",
+           missing, path);
+  if (over || missing)
+    return 1;
+  printf("All counts within budget\n");
+  return 0;
+}
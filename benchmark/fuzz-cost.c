@@ -0,0 +1,169 @@
+/* fuzz-cost.c --- Fuzz the render path for inputs that cost too much
+ *
+ * The objective is cost, not crashes. Each input is fed to a fresh 24x80
+ * terminal through Fvterm_write_input, Fvterm_update and Fvterm_redraw, in
+ * 4 KiB reads like a pty would deliver them, and three costs are counted:
+ *
+ *   funcalls  calls from the module into Lisp (insert, delete-lines, ...)
+ *   cells     vterm_screen_get_cell and vterm_screen_is_eol calls
+ *   ns        wall time, only checked when a budget is given
+ *
+ * An input whose cost exceeds BASE + PER-BYTE * length for any of them is
+ * reported on stderr and aborts, so the fuzzer saves it as a crash and
+ * -minimize_crash shrinks it. Under libFuzzer the log2 of each cost per byte
+ * is also fed back as an extra coverage feature, which steers the search
+ * toward ever more expensive inputs.
+ *
+ * Emacs is replaced by the headless emacs_env of stub-env.c. The module is
+ * included below, so its screen reads are counted in place.
+ *
+ * Budgets (environment, defaults in parentheses):
+ *   VTERM_FUZZ_FUNCALLS  BASE,PER-BYTE  (400,2)
+ *   VTERM_FUZZ_CELLS     BASE,PER-BYTE  (20000,64)
+ *   VTERM_FUZZ_NS        BASE,PER-BYTE  (off)
+ *
+ * Usage:
+ *   cmake -S . -B build-fuzz -DCMAKE_C_COMPILER=clang -DVTERM_FUZZ_LIBFUZZER=ON
+ *   cmake --build build-fuzz --target vterm-fuzz-cost
+ *   ./build-fuzz/vterm-fuzz-cost corpus/ -max_len=4096
+ *   ./build-fuzz/vterm-fuzz-cost -minimize_crash=1 -runs=10000 crash-...
+ *
+ * Without libFuzzer the target reads the files given as arguments, or stdin,
+ * which is what AFL expects: afl-fuzz -i seeds -o out -- vterm-fuzz-cost @@
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vterm.h>
+
+static uint64_t fuzz_cells;
+
+// Count the screen reads of vterm-module.c
+#define vterm_screen_get_cell(...)                                             \
+  (fuzz_cells++, vterm_screen_get_cell(__VA_ARGS__))
+#define vterm_screen_is_eol(...)                                               \
+  (fuzz_cells++, vterm_screen_is_eol(__VA_ARGS__))
+
+#include "vterm-module.c"
+
+#include "stub-env.h"
+
+/* ---------------------------------------------------------------------------
+ * Cost budget
+ * ------------------------------------------------------------------------- */
+
+typedef struct {
+  const char *name;
+  double base, per_byte; // per_byte < 0: not checked
+} Budget;
+
+enum { COST_FUNCALLS, COST_CELLS, COST_NS, COST_COUNT };
+
+static Budget budgets[COST_COUNT] = {
+    {"funcalls", 400, 2}, {"cells", 20000, 64}, {"ns", 0, -1}};
+
+static void read_budget(Budget *budget, const char *var) {
+  const char *value = getenv(var);
+  if (value)
+    sscanf(value, "%lf,%lf", &budget->base, &budget->per_byte);
+}
+
+#ifdef __linux__
+// libFuzzer treats each non-zero byte as a feature: one per metric and
+// power-of-two bucket of cost per byte
+__attribute__((section("__libfuzzer_extra_counters"))) static uint8_t
+    cost_features[COST_COUNT * 32];
+#endif
+
+static void record_feature(int metric, double per_byte) {
+#ifdef __linux__
+  int bucket = 0;
+  for (double v = per_byte * 16; v >= 2 && bucket < 31; v /= 2)
+    bucket++;
+  cost_features[metric * 32 + bucket] = 1;
+#else
+  (void)metric, (void)per_byte;
+#endif
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static bool initialized;
+  emacs_env *env = stub_env_init();
+  if (!initialized) {
+    read_budget(&budgets[COST_FUNCALLS], "VTERM_FUZZ_FUNCALLS");
+    read_budget(&budgets[COST_CELLS], "VTERM_FUZZ_CELLS");
+    read_budget(&budgets[COST_NS], "VTERM_FUZZ_NS");
+    initialized = true;
+  }
+  if (size == 0)
+    return 0;
+
+  emacs_value term_value = stub_env_new_term(env, 24, 80);
+  Term *term = env->get_user_ptr(env, term_value);
+
+  uint64_t funcalls = stub_env_funcalls;
+  fuzz_cells = 0;
+  uint64_t start = now_ns();
+  stub_env_feed(env, term_value, (const char *)data, size);
+  double cost[COST_COUNT] = {(double)(stub_env_funcalls - funcalls),
+                             (double)fuzz_cells,
+                             (double)(now_ns() - start)};
+
+  term_finalize(term);
+  stub_env_release();
+
+  for (int i = 0; i < COST_COUNT; i++) {
+    if (i != COST_NS || budgets[i].per_byte >= 0)
+      record_feature(i, cost[i] / size);
+  }
+  for (int i = 0; i < COST_COUNT; i++) {
+    Budget *b = &budgets[i];
+    if (b->per_byte < 0 || cost[i] <= b->base + b->per_byte * size)
+      continue;
+    fprintf(stderr,
+            "vterm-fuzz-cost: %zu bytes cost %.0f %s (%.1f per byte), "
+            "budget %.0f + %.1f per byte\n",
+            size, cost[i], b->name, cost[i] / size, b->base, b->per_byte);
+    abort();
+  }
+  return 0;
+}
+
+#ifdef VTERM_FUZZ_MAIN
+static int run_file(FILE *f) {
+  size_t cap = 1 << 16, len = 0, n;
+  uint8_t *buf = malloc(cap);
+  while ((n = fread(buf + len, 1, cap - len, f)) > 0) {
+    len += n;
+    if (len == cap)
+      buf = realloc(buf, cap *= 2);
+  }
+  LLVMFuzzerTestOneInput(buf, len);
+  free(buf);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2)
+    return run_file(stdin);
+  for (int i = 1; i < argc; i++) {
+    FILE *f = fopen(argv[i], "rb");
+    if (!f) {
+      perror(argv[i]);
+      return 1;
+    }
+    run_file(f);
+    fclose(f);
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,491 @@
+/* microbench.c --- Micro-benchmarks for the hot kernels of vterm-module
+ *
+ * Times the helpers that run per byte, per cell or per row in isolation:
+ * arena_alloc/arena_reset, codepoint_to_utf8/utf8_to_codepoint, lookup_key,
+ * fast_compare_cells and the scrollback ring (sb_push/sb_get). vterm-module.c
+ * is compiled into this executable so its static helpers are reachable.
+ *
+ * sb_search and sb_reflow visit the rows of a scrollback of LINES 80-column
+ * rows (100000, the most the module keeps, unless -l says otherwise) in a
+ * scattered order, so that most rows are on a different page, once
+ * with malloc'd rows and once with rows from the huge page pool of
+ * vterm-scrollback-huge-pages: searching a row for a character, and copying
+ * it to a 132-column row as a reflow would. Each variant needs about
+ * LINES * 3 KiB and is only built when selected.
+ *
+ * Inputs come from a corpus: the file named on the command line or by
+ * VTERM_BENCHMARK_CORPUS (e.g. one written by `vterm-benchmark-write-corpus'),
+ * else 1 MiB of generated colored text with 2, 3 and 4 byte characters. Cells
+ * are taken from a libvterm screen fed with that corpus.
+ *
+ * Each benchmark runs WARMUP operations untimed, then REPEATS timed batches of
+ * ITERS operations; the median batch gives ns/op. bytes/op is the input or
+ * output size one operation handles, 0 where it means nothing.
+ *
+ * Usage:
+ *   cmake --build build --target vterm-microbench
+ *   ./build/vterm-microbench [-n ITERS] [-w WARMUP] [-r REPEATS]
+ *                            [-l LINES] [-f SUBSTRING] [CORPUS]
+ *   ./build/vterm-microbench -f sb_ -l 1000000     # huge pages vs malloc
+ */
+
+#include "vterm-module.c"
+
+#include <stdlib.h>
+
+static volatile uint64_t sink; // keeps results alive
+
+static uint64_t now_ns(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (!freq.QuadPart)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000000 +
+                    now.QuadPart % freq.QuadPart * 1000000000 /
+                        freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * Inputs
+ * ------------------------------------------------------------------------- */
+
+static unsigned char *corpus;
+static size_t corpus_len;
+
+static uint32_t *codepoints; // corpus decoded, invalid bytes skipped
+static size_t codepoint_count;
+
+typedef struct {
+  unsigned char bytes[4];
+  size_t len;
+} Utf8Seq;
+static Utf8Seq *sequences; // the same characters, encoded
+static size_t sequence_count;
+
+static VTermScreenCell *cells; // snapshots of the screen fed with the corpus
+static size_t cell_count;
+
+typedef struct {
+  const unsigned char *name;
+  size_t len;
+} KeyName;
+static KeyName *key_names; // every key_table name plus typed characters
+static size_t key_name_count;
+
+static uint32_t rng_state = 0x9e3779b9;
+
+static uint32_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static void generate_corpus(void) {
+  static const char *words[] = {
+      "build", "src/vterm-module.c", "ok", "error:", "0x7ffd", "café",
+      "naïve", "→", "✓", "漢字", "日本語", "😀", "λ", "---", "[100%]"};
+  static const char *sgr[] = {"\033[0m", "\033[1;31m", "\033[32m",
+                              "\033[38;5;208m", "\033[38;2;90;160;255m",
+                              "\033[7m"};
+  size_t cap = 1 << 20;
+  corpus = malloc(cap + 64);
+  corpus_len = 0;
+  int col = 0;
+  while (corpus_len < cap) {
+    const char *s;
+    if (rng() % 5 == 0)
+      s = sgr[rng() % (sizeof(sgr) / sizeof(sgr[0]))];
+    else
+      s = words[rng() % (sizeof(words) / sizeof(words[0]))];
+    size_t len = strlen(s);
+    memcpy(corpus + corpus_len, s, len);
+    corpus_len += len;
+    col += (int)len;
+    if (col > 70) {
+      memcpy(corpus + corpus_len, "\r\n", 2);
+      corpus_len += 2;
+      col = 0;
+    } else {
+      corpus[corpus_len++] = ' ';
+    }
+  }
+}
+
+static bool read_corpus(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  corpus = malloc(size > 0 ? size : 1);
+  corpus_len = size > 0 ? fread(corpus, 1, size, f) : 0;
+  fclose(f);
+  return corpus_len > 0;
+}
+
+static void decode_corpus(void) {
+  codepoints = malloc(corpus_len * sizeof(*codepoints));
+  sequences = malloc(corpus_len * sizeof(*sequences));
+  for (size_t i = 0; i < corpus_len;) {
+    unsigned char b = corpus[i];
+    size_t len = b < 0x80 ? 1 : b < 0xE0 ? 2 : b < 0xF0 ? 3 : 4;
+    uint32_t cp;
+    if (i + len <= corpus_len && utf8_to_codepoint(corpus + i, len, &cp)) {
+      codepoints[codepoint_count++] = cp;
+      Utf8Seq *seq = &sequences[sequence_count++];
+      memcpy(seq->bytes, corpus + i, len);
+      seq->len = len;
+      i += len;
+    } else {
+      i++;
+    }
+  }
+}
+
+static void snapshot_cells(void) {
+  const int rows = 24, cols = 80;
+  size_t cap = 1 << 16;
+  VTerm *vt = vterm_new(rows, cols);
+  vterm_set_utf8(vt, 1);
+  VTermScreen *screen = vterm_obtain_screen(vt);
+  vterm_screen_reset(screen, 1);
+
+  cells = malloc(cap * sizeof(*cells));
+  size_t chunk = 4096;
+  for (size_t off = 0; off < corpus_len && cell_count < cap; off += chunk) {
+    size_t len = MIN(chunk, corpus_len - off);
+    vterm_input_write(vt, (const char *)corpus + off, len);
+    for (int row = 0; row < rows && cell_count < cap; row++) {
+      for (int col = 0; col < cols && cell_count < cap; col++) {
+        VTermPos pos = {.row = row, .col = col};
+        vterm_screen_get_cell(screen, pos, &cells[cell_count++]);
+      }
+    }
+  }
+  vterm_free(vt);
+}
+
+static void collect_key_names(void) {
+  size_t table = 0;
+  while (key_table[table].name)
+    table++;
+  key_name_count = table + 8;
+  key_names = malloc(key_name_count * sizeof(*key_names));
+  for (size_t i = 0; i < table; i++) {
+    key_names[i].name = (const unsigned char *)key_table[i].name;
+    key_names[i].len = strlen(key_table[i].name);
+  }
+  // Misses, which is what most typed characters are
+  for (size_t i = 0; i < 8 && sequence_count > 0; i++) {
+    Utf8Seq *seq = &sequences[rng() % sequence_count];
+    key_names[table + i].name = seq->bytes;
+    key_names[table + i].len = seq->len;
+  }
+}
+
+/* ---------------------------------------------------------------------------
+ * Benchmarks: each runs N operations and returns the bytes they handled
+ * ------------------------------------------------------------------------- */
+
+static arena_allocator_t *bench_arena;
+
+static uint64_t bench_arena_alloc(size_t n) {
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t size = 16 + (i * 40503u & 0xF0); // 16..256
+    char *p = arena_alloc(bench_arena, size);
+    p[0] = (char)i;
+    bytes += size;
+    if ((i & 1023) == 1023)
+      arena_reset(bench_arena);
+  }
+  return bytes;
+}
+
+static uint64_t bench_arena_reset(size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    sink += (uintptr_t)arena_alloc(bench_arena, 4096);
+    arena_reset(bench_arena);
+  }
+  return 0;
+}
+
+static uint64_t bench_codepoint_to_utf8(size_t n) {
+  unsigned char buf[4];
+  uint64_t bytes = 0;
+  for (size_t i = 0, j = 0; i < n; i++) {
+    bytes += codepoint_to_utf8(codepoints[j], buf);
+    sink += buf[0];
+    if (++j == codepoint_count)
+      j = 0;
+  }
+  return bytes;
+}
+
+static uint64_t bench_utf8_to_codepoint(size_t n) {
+  uint64_t bytes = 0;
+  uint32_t cp;
+  for (size_t i = 0, j = 0; i < n; i++) {
+    Utf8Seq *seq = &sequences[j];
+    if (utf8_to_codepoint(seq->bytes, seq->len, &cp))
+      sink += cp;
+    bytes += seq->len;
+    if (++j == sequence_count)
+      j = 0;
+  }
+  return bytes;
+}
+
+static uint64_t bench_lookup_key(size_t n) {
+  uint64_t bytes = 0;
+  for (size_t i = 0, j = 0; i < n; i++) {
+    KeyEntry *entry = lookup_key(key_names[j].name, key_names[j].len);
+    sink += (uintptr_t)entry;
+    bytes += key_names[j].len;
+    if (++j == key_name_count)
+      j = 0;
+  }
+  return bytes;
+}
+
+static uint64_t bench_fast_compare_cells(size_t n) {
+  for (size_t i = 0, j = 0; i < n; i++) {
+    sink += fast_compare_cells(&cells[j], &cells[j + 1]);
+    if (++j == cell_count - 1)
+      j = 0;
+  }
+  return 0;
+}
+
+static Term bench_term;
+
+static void setup_scrollback(void) {
+  bench_term.sb_size = 10000;
+  bench_term.sb_buffer =
+      calloc(bench_term.sb_size, sizeof(*bench_term.sb_buffer));
+  for (size_t i = 0; i < bench_term.sb_size; i++) {
+    ScrollbackLine *line =
+        tracked_malloc(&bench_term.mem, MEM_TAG_SCROLLBACK,
+                       sizeof(ScrollbackLine) + 80 * sizeof(VTermScreenCell));
+    line->cols = line->capacity = 80;
+    sb_push(&bench_term, line);
+  }
+}
+
+/* Steady state of a full ring: the oldest row is recycled as the newest */
+static uint64_t bench_sb_push(size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    ScrollbackLine *line = sb_pop_oldest(&bench_term);
+    sb_push(&bench_term, line);
+  }
+  return 0;
+}
+
+static uint64_t bench_sb_get(size_t n) {
+  size_t count = bench_term.sb_current;
+  for (size_t i = 0; i < n; i++) {
+    ScrollbackLine *line = sb_get(&bench_term, (i * 7919) % count);
+    sink += line->cols;
+  }
+  return 0;
+}
+
+/* Large scrollbacks for sb_search and sb_reflow, malloc'd or pooled */
+static size_t pool_lines = SB_MAX;
+static Term heap_term, pool_term;
+static size_t heap_next, pool_next;
+static ScrollbackLine *reflow_row;
+
+static void fill_scrollback(Term *term, int pool_flags) {
+  term->sb_size = pool_lines;
+  term->sb_buffer = calloc(term->sb_size, sizeof(*term->sb_buffer));
+  if (pool_flags)
+    term->sb_pool = arena_create_large(SB_POOL_BLOCK, pool_flags);
+  for (size_t i = 0; i < term->sb_size; i++) {
+    ScrollbackLine *line = sb_row_alloc(term, 80);
+    for (size_t col = 0; col < 80; col++)
+      line->cells[col] = cells[(i * 80 + col) % cell_count];
+    sb_push(term, line);
+  }
+  if (!reflow_row) {
+    reflow_row = malloc(sizeof(ScrollbackLine) + 132 * sizeof(VTermScreenCell));
+    reflow_row->cols = reflow_row->capacity = 132;
+  }
+}
+
+static void setup_heap_scrollback(void) {
+  if (!heap_term.sb_buffer)
+    fill_scrollback(&heap_term, 0);
+}
+
+static void setup_pool_scrollback(void) {
+  if (!pool_term.sb_buffer) {
+    fill_scrollback(&pool_term, ARENA_HUGE_PAGES | ARENA_PREFAULT);
+    ArenaPages pages;
+    arena_pages(pool_term.sb_pool, &pages);
+    printf("scrollback pool: %zu MiB reserved, %zu MiB resident, "
+           "%zu MiB in huge pages\n",
+           pages.reserved >> 20, pages.resident >> 20, pages.huge >> 20);
+  }
+}
+
+/* Look for a character the corpus does not print, as a failed search does */
+static uint64_t search_rows(Term *term, size_t *next, size_t n) {
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < n; i++) {
+    ScrollbackLine *line = sb_get(term, (*next)++ * 7919 % term->sb_current);
+    for (size_t col = 0; col < line->cols; col++)
+      sink += line->cells[col].chars[0] == 0x1f600;
+    bytes += line->cols * sizeof(VTermScreenCell);
+  }
+  return bytes;
+}
+
+/* Copy each row to a wider one and blank the rest, as a reflow would */
+static uint64_t reflow_rows(Term *term, size_t *next, size_t n) {
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < n; i++) {
+    ScrollbackLine *line = sb_get(term, (*next)++ * 7919 % term->sb_current);
+    memcpy(reflow_row->cells, line->cells,
+           line->cols * sizeof(VTermScreenCell));
+    for (size_t col = line->cols; col < reflow_row->cols; col++) {
+      reflow_row->cells[col].chars[0] = 0;
+      reflow_row->cells[col].width = 1;
+    }
+    sink += reflow_row->cells[i % line->cols].width;
+    bytes += line->cols * sizeof(VTermScreenCell);
+  }
+  return bytes;
+}
+
+static uint64_t bench_sb_search_heap(size_t n) {
+  return search_rows(&heap_term, &heap_next, n);
+}
+
+static uint64_t bench_sb_search_pool(size_t n) {
+  return search_rows(&pool_term, &pool_next, n);
+}
+
+static uint64_t bench_sb_reflow_heap(size_t n) {
+  return reflow_rows(&heap_term, &heap_next, n);
+}
+
+static uint64_t bench_sb_reflow_pool(size_t n) {
+  return reflow_rows(&pool_term, &pool_next, n);
+}
+
+typedef struct {
+  const char *name;
+  uint64_t (*run)(size_t n);
+  void (*setup)(void); // run once before the benchmark, may be NULL
+} Bench;
+
+static const Bench benches[] = {
+    {"arena_alloc", bench_arena_alloc},
+    {"arena_reset", bench_arena_reset},
+    {"codepoint_to_utf8", bench_codepoint_to_utf8},
+    {"utf8_to_codepoint", bench_utf8_to_codepoint},
+    {"lookup_key", bench_lookup_key},
+    {"fast_compare_cells", bench_fast_compare_cells},
+    {"sb_push", bench_sb_push},
+    {"sb_get", bench_sb_get},
+    {"sb_search_heap", bench_sb_search_heap, setup_heap_scrollback},
+    {"sb_search_pool", bench_sb_search_pool, setup_pool_scrollback},
+    {"sb_reflow_heap", bench_sb_reflow_heap, setup_heap_scrollback},
+    {"sb_reflow_pool", bench_sb_reflow_pool, setup_pool_scrollback},
+};
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+  size_t iters = 1000000, warmup = 100000;
+  int repeats = 7;
+  const char *filter = NULL;
+  const char *corpus_path = getenv("VTERM_BENCHMARK_CORPUS");
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      iters = strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+      warmup = strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      repeats = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+      filter = argv[++i];
+    else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+      pool_lines = strtoul(argv[++i], NULL, 10);
+    else if (argv[i][0] == '-') {
+      fprintf(stderr,
+              "usage: %s [-n ITERS] [-w WARMUP] [-r REPEATS] [-l LINES] "
+              "[-f SUBSTRING] [CORPUS]\n",
+              argv[0]);
+      return 2;
+    } else
+      corpus_path = argv[i];
+  }
+  if (iters == 0 || repeats < 1 || pool_lines == 0)
+    return 2;
+
+  if (corpus_path && *corpus_path) {
+    if (!read_corpus(corpus_path)) {
+      fprintf(stderr, "cannot read corpus %s\n", corpus_path);
+      return 1;
+    }
+  } else {
+    generate_corpus();
+  }
+  decode_corpus();
+  snapshot_cells();
+  collect_key_names();
+  bench_arena = arena_create(65536);
+  setup_scrollback();
+  if (codepoint_count == 0 || cell_count < 2) {
+    fprintf(stderr, "corpus has no text\n");
+    return 1;
+  }
+
+  printf("corpus: %zu bytes, %zu characters, %zu cells; %zu ops x %d\n",
+         corpus_len, codepoint_count, cell_count, iters, repeats);
+  printf("%-20s %10s %10s %10s\n", "benchmark", "ns/op", "bytes/op", "MB/s");
+
+  uint64_t *times = malloc(repeats * sizeof(*times));
+  for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+    const Bench *bench = &benches[b];
+    if (filter && !strstr(bench->name, filter))
+      continue;
+    if (bench->setup)
+      bench->setup();
+    if (warmup > 0)
+      bench->run(warmup);
+
+    uint64_t bytes = 0;
+    for (int r = 0; r < repeats; r++) {
+      uint64_t start = now_ns();
+      bytes = bench->run(iters);
+      times[r] = now_ns() - start;
+    }
+    qsort(times, repeats, sizeof(*times), compare_u64);
+
+    double ns_per_op = (double)times[repeats / 2] / iters;
+    double bytes_per_op = (double)bytes / iters;
+    printf("%-20s %10.2f %10.2f", bench->name, ns_per_op, bytes_per_op);
+    if (bytes > 0)
+      printf(" %10.1f\n", bytes_per_op / ns_per_op * 1000.0);
+    else
+      printf(" %10s\n", "-");
+  }
+  free(times);
+  return 0;
+}
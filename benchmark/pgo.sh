@@ -0,0 +1,46 @@
+#!/usr/bin/env bash
+# pgo.sh - Build vterm-module with profile-guided optimization and measure it
+#
+# Usage: benchmark/pgo.sh [SESSION...]
+#
+# Sessions are replayed by vterm-replay, both to train the profile and to
+# measure throughput; without any, VTERM_BENCHMARK_CORPUS or a generated
+# session is used. CC selects the compiler (GCC or Clang). The optimized
+# module is left in the source directory like a normal build.
+
+set -euo pipefail
+
+cd "$(dirname "$0")/.."
+JOBS=$(nproc 2>/dev/null || sysctl -n hw.ncpu 2>/dev/null || echo 4)
+PGO_DIR="$PWD/build-pgo/pgo"
+
+replay() {
+  "$1/vterm-replay" -r 5 "${@:2}" | sed -n 's/.*, \([0-9.]*\) MB\/s/\1/p'
+}
+
+echo "== Baseline"
+cmake -S . -B build-base -DCMAKE_BUILD_TYPE=RelWithDebInfo \
+      -DUSE_SYSTEM_LIBVTERM=OFF >/dev/null
+cmake --build build-base --target vterm-replay -j"$JOBS" >/dev/null
+base=$(replay build-base "$@")
+echo "$base MB/s"
+
+echo "== Training"
+rm -rf "$PGO_DIR"
+cmake -S . -B build-pgo -DCMAKE_BUILD_TYPE=RelWithDebInfo \
+      -DUSE_SYSTEM_LIBVTERM=OFF -DVTERM_PGO=GENERATE \
+      -DVTERM_PGO_DIR="$PGO_DIR" >/dev/null
+cmake --build build-pgo --target vterm-replay -j"$JOBS" >/dev/null
+"build-pgo/vterm-replay" -r 3 "$@" >/dev/null
+if ls "$PGO_DIR"/*.profraw >/dev/null 2>&1; then
+  llvm-profdata merge -o "$PGO_DIR/vterm.profdata" "$PGO_DIR"/*.profraw
+fi
+
+echo "== Optimized"
+cmake -S . -B build-pgo -DVTERM_PGO=USE >/dev/null
+cmake --build build-pgo --target vterm-module vterm-replay -j"$JOBS" >/dev/null
+pgo=$(replay build-pgo "$@")
+echo "$pgo MB/s"
+
+awk -v base="$base" -v pgo="$pgo" \
+    'BEGIN { printf "PGO speedup: %.2fx (%+.1f%%)\n", pgo / base, (pgo / base - 1) * 100 }'
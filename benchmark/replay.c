@@ -0,0 +1,161 @@
+/* replay.c --- Replay terminal sessions through vterm-module without Emacs
+ *
+ * Each session file is fed to a fresh terminal through the headless env of
+ * stub-env.c, in 4 KiB reads each followed by an update and a redraw, the way
+ * vterm--filter and the redraw timer drive the module. The module is linked
+ * from the same objects as vterm-module.so, so this is the training workload
+ * of the PGO build (benchmark/pgo.sh) as well as a throughput measurement.
+ *
+ * Sessions are the files given as arguments, else the one named by
+ * VTERM_BENCHMARK_CORPUS (e.g. written by `vterm-benchmark-write-corpus' or
+ * recorded with script(1)), else a generated one with prompts, directory
+ * tracking, colored listings and wide characters.
+ *
+ * Usage:
+ *   vterm-replay [-r PASSES] [-s ROWSxCOLS] [SESSION...]
+ *
+ * Prints the bytes replayed, the time taken and MB/s, best of PASSES.
+ */
+
+#include "../elisp.h"
+#include "../vterm-module.h"
+#include "stub-env.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  char *bytes;
+  size_t len;
+} Session;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static bool read_session(const char *path, Session *session) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+  size_t cap = 1 << 16, n;
+  session->bytes = malloc(cap);
+  session->len = 0;
+  while ((n = fread(session->bytes + session->len, 1, cap - session->len,
+                    f)) > 0) {
+    session->len += n;
+    if (session->len == cap)
+      session->bytes = realloc(session->bytes, cap *= 2);
+  }
+  fclose(f);
+  return true;
+}
+
+static void append(Session *session, size_t *cap, const char *s) {
+  size_t len = strlen(s);
+  if (session->len + len > *cap) {
+    *cap = (*cap + len) * 2;
+    session->bytes = realloc(session->bytes, *cap);
+  }
+  memcpy(session->bytes + session->len, s, len);
+  session->len += len;
+}
+
+static void generate_session(Session *session) {
+  static const char *names[] = {"vterm-module.c", "README.md", "日本語.txt",
+                                "build", "etc", "naïve café"};
+  static const char *colors[] = {"\033[0m", "\033[1;34m", "\033[32m",
+                                 "\033[38;5;208m", "\033[38;2;90;160;255m"};
+  size_t cap = 1 << 20;
+  char line[256];
+  session->bytes = malloc(cap);
+  session->len = 0;
+  for (int i = 0; session->len < (4 << 20); i++) {
+    // Prompt with directory tracking, as etc/emacs-vterm-bash.sh sends it
+    snprintf(line, sizeof(line),
+             "\033]51;Auser@host:/home/user/project/%d\033\\"
+             "\033[32muser@host\033[0m:~/project/%d$ ls -l\r\n",
+             i % 7, i % 7);
+    append(session, &cap, line);
+    for (int j = 0; j < 40; j++) {
+      snprintf(line, sizeof(line),
+               "-rw-r--r-- 1 user user %7d Oct 18 12:%02d %s%s\033[0m\r\n",
+               (i * 7919 + j * 104729) % 1000000, j % 60, colors[j % 5],
+               names[(i + j) % 6]);
+      append(session, &cap, line);
+    }
+    // A progress bar redrawn in place
+    for (int p = 0; p <= 100; p += 5) {
+      snprintf(line, sizeof(line), "\r[%-20.*s] %3d%%", p / 5,
+               "####################", p);
+      append(session, &cap, line);
+    }
+    append(session, &cap, "\r\n");
+  }
+}
+
+static void replay(emacs_env *env, const Session *session, int rows,
+                   int cols) {
+  emacs_value term = stub_env_new_term(env, rows, cols);
+  stub_env_feed(env, term, session->bytes, session->len);
+  term_finalize(env->get_user_ptr(env, term));
+  stub_env_release();
+}
+
+int main(int argc, char **argv) {
+  int passes = 5, rows = 24, cols = 80;
+  Session *sessions = calloc(argc + 1, sizeof(*sessions));
+  int count = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+      passes = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &rows, &cols) != 2)
+        rows = 0;
+    } else if (argv[i][0] == '-') {
+      rows = 0;
+      break;
+    } else if (!read_session(argv[i], &sessions[count++])) {
+      perror(argv[i]);
+      return 1;
+    }
+  }
+  if (passes < 1 || rows < 1 || cols < 1) {
+    fprintf(stderr, "usage: %s [-r PASSES] [-s ROWSxCOLS] [SESSION...]\n",
+            argv[0]);
+    return 2;
+  }
+
+  const char *corpus = getenv("VTERM_BENCHMARK_CORPUS");
+  if (count == 0 && corpus && *corpus) {
+    if (!read_session(corpus, &sessions[count++])) {
+      perror(corpus);
+      return 1;
+    }
+  }
+  if (count == 0)
+    generate_session(&sessions[count++]);
+
+  emacs_env *env = stub_env_init();
+  size_t bytes = 0;
+  for (int i = 0; i < count; i++)
+    bytes += sessions[i].len;
+
+  uint64_t best = UINT64_MAX;
+  for (int pass = 0; pass < passes; pass++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < count; i++)
+      replay(env, &sessions[i], rows, cols);
+    uint64_t elapsed = now_ns() - start;
+    if (elapsed < best)
+      best = elapsed;
+  }
+
+  printf("%zu bytes in %.3f s, %.2f MB/s\n", bytes, best / 1e9,
+         bytes / (best / 1e3));
+  return 0;
+}
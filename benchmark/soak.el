@@ -0,0 +1,217 @@
+;;; soak.el --- Long-running memory soak test for vterm -*- lexical-binding: t -*-
+
+;;; Commentary:
+
+;; Terminals stay open for weeks, so memory that grows a little on
+;; every prompt adds up.  This harness drives a headless terminal (see
+;; `vterm-benchmark-make-terminal') through the operations that touch
+;; long-lived allocations, as fast as it can:
+;;
+;;   - prompts announcing a new directory with OSC 51;A;
+;;   - floods of mixed output that keep scrollback full;
+;;   - full-screen applications on the alternate screen;
+;;   - resizes, which pop and push scrollback lines;
+;;   - clears of screen and scrollback.
+;;
+;; Hours of use are compressed into `vterm-soak-duration' seconds.
+;; Every `vterm-soak-sample-every' cycles we sample RSS (Linux), the
+;; terminal's live heap, the reserved bytes of both arenas and the live
+;; bytes of scrollback and of directory/prompt metadata.  Once the
+;; warm-up fraction is over, each metric may grow by at most
+;; `vterm-soak-max-growth' of its warm-up peak plus an absolute slack;
+;; otherwise the run fails.
+;;
+;; Usage (from the repository root):
+;;
+;;   VTERM_SOAK_SECONDS=600 emacs -Q --batch -L . -l benchmark/soak.el \
+;;         -f vterm-soak-batch [OUTPUT.json]
+;;
+;; The exit status is non-zero when a bound is exceeded.
+
+;;; Code:
+
+(require 'vterm)
+(require 'vterm-benchmark
+         (expand-file-name "benchmark"
+                           (file-name-directory
+                            (or load-file-name buffer-file-name))))
+
+(defvar vterm-soak-duration
+  (let ((env (getenv "VTERM_SOAK_SECONDS")))
+    (if env (string-to-number env) 120))
+  "Seconds to run the soak for.")
+
+(defvar vterm-soak-warmup 0.2
+  "Fraction of the run treated as warm-up.")
+
+(defvar vterm-soak-sample-every 50
+  "Number of cycles between two samples.")
+
+(defvar vterm-soak-scrollback 1000
+  "Scrollback size of the soaked terminal.
+Kept small so scrollback saturates during warm-up.")
+
+(defvar vterm-soak-max-growth 0.10
+  "Allowed growth after warm-up, as a fraction of the warm-up peak.")
+
+(defvar vterm-soak-slack
+  '((:rss . 8388608)
+    (:heap . 1048576)
+    (:persistent-arena . 1048576)
+    (:temp-arena . 1048576)
+    (:scrollback . 1048576)
+    (:metadata . 262144))
+  "Absolute growth in bytes tolerated per metric on top of the ratio.")
+
+(defun vterm-soak--sample (buf cycle)
+  "Return a sample of memory use of terminal BUF after CYCLE cycles."
+  (garbage-collect)
+  (let ((stats (vterm-memory-stats buf)))
+    (list :cycle cycle
+          :rss (vterm-benchmark-rss)
+          :heap (car (plist-get stats :total))
+          :persistent-arena (cadr (plist-get stats :persistent-arena))
+          :temp-arena (cadr (plist-get stats :temp-arena))
+          :scrollback (car (plist-get stats :scrollback))
+          :metadata (car (plist-get stats :metadata)))))
+
+(defun vterm-soak--write (buf string)
+  "Feed STRING to the terminal in BUF and redraw."
+  (vterm-benchmark-feed buf (list string)))
+
+(defun vterm-soak--prompt (cycle)
+  "Return a prompt for CYCLE that reports a fresh directory."
+  ;; A foreign host keeps `vterm--get-directory' off the filesystem.
+  (format "\e]51;Asoak@soakhost:/srv/project%d/src/module%d\e\\soak$ make\r\n"
+          (% cycle 997) cycle))
+
+(defun vterm-soak--altscreen (rows cols)
+  "Return a full-screen application frame for a ROWS x COLS terminal."
+  (let (parts)
+    (push "\e[?1049h\e[H\e[2J" parts)
+    (dotimes (r rows)
+      (push (format "\e[%d;1H%s%s\e[0m" (1+ r)
+                    (vterm-benchmark--sgr (+ 30 (% r 8)) (+ 40 (% (1+ r) 8)))
+                    (vterm-benchmark--text (1- cols)))
+            parts))
+    (push "\e[?1049l" parts)
+    (apply #'concat (nreverse parts))))
+
+(defun vterm-soak-cycle (buf cycle)
+  "Run one soak CYCLE on the terminal in BUF."
+  (vterm-soak--write buf (vterm-soak--prompt cycle))
+  (vterm-soak--write buf (vterm-benchmark-stream-mixed 1))
+  (when (zerop (% cycle 7))
+    (vterm-soak--write buf (vterm-soak--altscreen vterm-benchmark-rows
+                                                  vterm-benchmark-cols)))
+  (when (zerop (% cycle 11))
+    (with-current-buffer buf
+      (let ((inhibit-read-only t))
+        (vterm--set-size vterm--term
+                         (+ 10 (vterm-benchmark--random 40))
+                         (+ 40 (vterm-benchmark--random 120)))
+        (vterm--set-size vterm--term
+                         vterm-benchmark-rows vterm-benchmark-cols))))
+  (when (zerop (% cycle 13))
+    (vterm-soak--write buf "\e[H\e[2J\e[3J")))
+
+(defun vterm-soak--check (samples warmup-cycles)
+  "Check SAMPLES against the growth bounds.
+Samples taken before WARMUP-CYCLES set the baseline.  Return a list
+of (METRIC BASELINE PEAK LIMIT) for every metric over its limit."
+  (let ((warm (cl-remove-if-not
+               (lambda (s) (<= (plist-get s :cycle) warmup-cycles))
+               samples))
+        (steady (cl-remove-if
+                 (lambda (s) (<= (plist-get s :cycle) warmup-cycles))
+                 samples))
+        failures)
+    (when (and warm steady)
+      (dolist (slack vterm-soak-slack)
+        (let* ((metric (car slack))
+               (values-of (lambda (list)
+                            (delq nil (mapcar (lambda (s) (plist-get s metric))
+                                              list))))
+               (warm-values (funcall values-of warm))
+               (steady-values (funcall values-of steady)))
+          (when (and warm-values steady-values)
+            (let* ((baseline (apply #'max warm-values))
+                   (peak (apply #'max steady-values))
+                   (limit (+ baseline (cdr slack)
+                             (round (* baseline vterm-soak-max-growth)))))
+              (when (> peak limit)
+                (push (list metric baseline peak limit) failures)))))))
+    (nreverse failures)))
+
+;;;###autoload
+(defun vterm-soak-run (&optional file)
+  "Run the soak test for `vterm-soak-duration' seconds.
+Write the JSON report to FILE if non-nil.  Return the report; its
+:failures entry is empty when all bounds held."
+  (interactive)
+  (vterm-benchmark--reset-random)
+  (let* ((vterm-max-scrollback vterm-soak-scrollback)
+         (start (float-time))
+         (warmup-end (+ start (* vterm-soak-duration vterm-soak-warmup)))
+         (cycle 0)
+         (warmup-cycles nil)
+         samples failures)
+    (vterm-benchmark-with-terminal buf
+      (push (vterm-soak--sample buf 0) samples)
+      (while (< (- (float-time) start) vterm-soak-duration)
+        (setq cycle (1+ cycle))
+        (vterm-soak-cycle buf cycle)
+        (when (and (not warmup-cycles) (> (float-time) warmup-end))
+          (setq warmup-cycles cycle))
+        (when (zerop (% cycle vterm-soak-sample-every))
+          (let ((sample (vterm-soak--sample buf cycle)))
+            (push sample samples)
+            (message "cycle %6d  rss %8s  heap %8s  arena %8s  scrollback %8s"
+                     cycle
+                     (let ((rss (plist-get sample :rss)))
+                       (if rss (file-size-human-readable rss) "n/a"))
+                     (file-size-human-readable (plist-get sample :heap))
+                     (file-size-human-readable
+                      (plist-get sample :persistent-arena))
+                     (file-size-human-readable
+                      (plist-get sample :scrollback))))))
+      (push (vterm-soak--sample buf cycle) samples))
+    (setq samples (nreverse samples))
+    (setq failures (vterm-soak--check samples (or warmup-cycles cycle)))
+    (dolist (f failures)
+      (message "FAIL %s grew from %s to %s (limit %s)"
+               (substring (symbol-name (nth 0 f)) 1)
+               (file-size-human-readable (nth 1 f))
+               (file-size-human-readable (nth 2 f))
+               (file-size-human-readable (nth 3 f))))
+    (message "%d cycles in %.0f s: %s" cycle (- (float-time) start)
+             (if failures "FAILED" "passed"))
+    (let ((report (list :emacs-version emacs-version
+                        :system system-configuration
+                        :duration vterm-soak-duration
+                        :cycles cycle
+                        :warmup-cycles (or warmup-cycles cycle)
+                        :failures (vconcat
+                                   (mapcar (lambda (f)
+                                             (list :metric (substring
+                                                            (symbol-name (nth 0 f))
+                                                            1)
+                                                   :baseline (nth 1 f)
+                                                   :peak (nth 2 f)
+                                                   :limit (nth 3 f)))
+                                           failures))
+                        :samples (vconcat samples))))
+      (when file
+        (vterm-benchmark-write-json report file)
+        (message "Results written to %s" file))
+      report)))
+
+(defun vterm-soak-batch ()
+  "Run `vterm-soak-run' from `emacs --batch' and exit non-zero on failure.
+An optional file name in `command-line-args-left' receives the report."
+  (let ((report (vterm-soak-run (or (pop command-line-args-left)
+                                    "soak-results.json"))))
+    (kill-emacs (if (zerop (length (plist-get report :failures))) 0 1))))
+
+(provide 'vterm-soak)
+;;; soak.el ends here
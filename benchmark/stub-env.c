@@ -0,0 +1,229 @@
+#include "stub-env.h"
+#include "../elisp.h"
+#include "../vterm-module.h"
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t stub_env_funcalls;
+uint64_t stub_env_strings;
+
+enum { V_NIL, V_SYMBOL, V_INTEGER, V_STRING, V_USER_PTR, V_FUNCTION };
+
+struct emacs_value_tag {
+  int kind;
+  intmax_t integer;
+  char *bytes; // symbol name or string contents
+  ptrdiff_t len;
+  void *ptr;
+  void (*fin)(void *);
+};
+
+static struct emacs_value_tag nil_value = {.kind = V_NIL};
+
+// Symbols and global references live until exit
+static emacs_value *symbols;
+static size_t symbol_count;
+
+// Everything else lives until stub_env_release
+static emacs_value *locals;
+static size_t local_count, local_cap;
+
+static emacs_value new_value(int kind) {
+  if (local_count == local_cap) {
+    local_cap = local_cap ? local_cap * 2 : 1024;
+    locals = realloc(locals, local_cap * sizeof(*locals));
+  }
+  emacs_value v = calloc(1, sizeof(*v));
+  v->kind = kind;
+  locals[local_count++] = v;
+  return v;
+}
+
+void stub_env_release(void) {
+  for (size_t i = 0; i < local_count; i++) {
+    free(locals[i]->bytes);
+    free(locals[i]);
+  }
+  local_count = 0;
+}
+
+static emacs_value stub_intern(emacs_env *env, const char *name) {
+  (void)env;
+  if (!strcmp(name, "nil"))
+    return &nil_value;
+  for (size_t i = 0; i < symbol_count; i++) {
+    if (!strcmp(symbols[i]->bytes, name))
+      return symbols[i];
+  }
+  emacs_value v = calloc(1, sizeof(*v));
+  v->kind = V_SYMBOL;
+  v->bytes = strdup(name);
+  v->len = strlen(name);
+  symbols = realloc(symbols, (symbol_count + 1) * sizeof(*symbols));
+  symbols[symbol_count++] = v;
+  return v;
+}
+
+static emacs_value stub_make_global_ref(emacs_env *env, emacs_value value) {
+  (void)env;
+  if (value->kind == V_NIL || value->kind == V_SYMBOL)
+    return value;
+  emacs_value v = malloc(sizeof(*v));
+  *v = *value;
+  if (value->bytes) {
+    v->bytes = malloc(value->len + 1);
+    memcpy(v->bytes, value->bytes, value->len + 1);
+  }
+  return v;
+}
+
+static enum emacs_funcall_exit stub_non_local_exit_check(emacs_env *env) {
+  (void)env;
+  return emacs_funcall_exit_return;
+}
+
+static void stub_non_local_exit_clear(emacs_env *env) { (void)env; }
+
+static emacs_value
+stub_make_function(emacs_env *env, ptrdiff_t min_arity, ptrdiff_t max_arity,
+                   emacs_value (*func)(emacs_env *, ptrdiff_t, emacs_value *,
+                                       void *),
+                   const char *docstring, void *data) {
+  (void)env, (void)min_arity, (void)max_arity, (void)func, (void)docstring,
+      (void)data;
+  return new_value(V_FUNCTION);
+}
+
+static emacs_value stub_funcall(emacs_env *env, emacs_value func,
+                                ptrdiff_t nargs, emacs_value *args) {
+  (void)env, (void)func, (void)nargs, (void)args;
+  stub_env_funcalls++;
+  return &nil_value;
+}
+
+static emacs_value stub_type_of(emacs_env *env, emacs_value arg) {
+  static const char *names[] = {"symbol", "symbol", "integer",
+                                "string", "user-ptr", "module-function"};
+  return stub_intern(env, names[arg->kind]);
+}
+
+static bool stub_is_not_nil(emacs_env *env, emacs_value arg) {
+  (void)env;
+  return arg->kind != V_NIL;
+}
+
+static bool stub_eq(emacs_env *env, emacs_value a, emacs_value b) {
+  (void)env;
+  if (a->kind == V_INTEGER && b->kind == V_INTEGER)
+    return a->integer == b->integer;
+  return a == b;
+}
+
+static intmax_t stub_extract_integer(emacs_env *env, emacs_value arg) {
+  (void)env;
+  return arg->kind == V_INTEGER ? arg->integer : 0;
+}
+
+static emacs_value stub_make_integer(emacs_env *env, intmax_t n) {
+  (void)env;
+  emacs_value v = new_value(V_INTEGER);
+  v->integer = n;
+  return v;
+}
+
+static bool stub_copy_string_contents(emacs_env *env, emacs_value value,
+                                      char *buf, ptrdiff_t *len) {
+  (void)env;
+  const char *bytes = value->kind == V_STRING ? value->bytes : "";
+  ptrdiff_t size = value->kind == V_STRING ? value->len + 1 : 1;
+  if (!buf || *len < size) {
+    *len = size;
+    return buf == NULL;
+  }
+  memcpy(buf, bytes, size);
+  *len = size;
+  return true;
+}
+
+static emacs_value stub_make_string(emacs_env *env, const char *str,
+                                    ptrdiff_t len) {
+  (void)env;
+  stub_env_strings++;
+  emacs_value v = new_value(V_STRING);
+  v->bytes = malloc(len + 1);
+  memcpy(v->bytes, str, len);
+  v->bytes[len] = '\0';
+  v->len = len;
+  return v;
+}
+
+static emacs_value stub_make_user_ptr(emacs_env *env, void (*fin)(void *),
+                                      void *ptr) {
+  (void)env;
+  emacs_value v = new_value(V_USER_PTR);
+  v->ptr = ptr;
+  v->fin = fin;
+  return v;
+}
+
+static void *stub_get_user_ptr(emacs_env *env, emacs_value arg) {
+  (void)env;
+  return arg->kind == V_USER_PTR ? arg->ptr : NULL;
+}
+
+static emacs_env stub_env = {
+    .size = sizeof(emacs_env),
+    .make_global_ref = stub_make_global_ref,
+    .non_local_exit_check = stub_non_local_exit_check,
+    .non_local_exit_clear = stub_non_local_exit_clear,
+    .make_function = stub_make_function,
+    .funcall = stub_funcall,
+    .intern = stub_intern,
+    .type_of = stub_type_of,
+    .is_not_nil = stub_is_not_nil,
+    .eq = stub_eq,
+    .extract_integer = stub_extract_integer,
+    .make_integer = stub_make_integer,
+    .copy_string_contents = stub_copy_string_contents,
+    .make_string = stub_make_string,
+    .make_unibyte_string = stub_make_string,
+    .make_user_ptr = stub_make_user_ptr,
+    .get_user_ptr = stub_get_user_ptr,
+};
+
+static emacs_env *stub_get_environment(struct emacs_runtime *runtime) {
+  (void)runtime;
+  return &stub_env;
+}
+
+emacs_env *stub_env_init(void) {
+  static bool initialized;
+  if (!initialized) {
+    struct emacs_runtime runtime = {.size = sizeof(runtime),
+                                    .get_environment = stub_get_environment};
+    emacs_module_init(&runtime);
+    initialized = true;
+  }
+  return &stub_env;
+}
+
+emacs_value stub_env_new_term(emacs_env *env, int rows, int cols) {
+  emacs_value args[10] = {
+      env->make_integer(env, rows), env->make_integer(env, cols),
+      env->make_integer(env, 1000), Qnil, Qnil, Qnil, Qnil, Qnil, Qnil, Qnil};
+  return Fvterm_new(env, 10, args, NULL);
+}
+
+size_t stub_env_feed(emacs_env *env, emacs_value term, const char *bytes,
+                     size_t len) {
+  size_t reads = 0;
+  for (size_t off = 0; off < len; off += 4096, reads++) {
+    emacs_value input[2] = {
+        term, env->make_string(env, bytes + off, MIN(4096, len - off))};
+    Fvterm_write_input(env, 2, input, NULL);
+    Fvterm_update(env, 1, input, NULL);
+    emacs_value redraw[2] = {term, Qt};
+    Fvterm_redraw(env, 2, redraw, NULL);
+  }
+  return reads;
+}
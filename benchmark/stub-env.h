@@ -0,0 +1,41 @@
+#ifndef STUB_ENV_H
+#define STUB_ENV_H
+
+#include "../emacs-module.h"
+#include <stdint.h>
+
+// Headless emacs_env for driving vterm-module without Emacs
+//
+// Symbols are interned, strings and integers are real values, user pointers
+// hold their pointer, and every funcall returns nil. Only the env functions
+// the module calls are provided.
+//
+// Usage:
+//   emacs_env *env = stub_env_init();  // runs emacs_module_init once
+//   emacs_value term = stub_env_new_term(env, 24, 80);
+//   stub_env_feed(env, term, bytes, len);
+//   ...
+//   stub_env_funcalls;                 // calls into Lisp so far
+//   stub_env_strings;                  // Lisp strings made so far
+//   stub_env_release();                // frees the values made since
+
+emacs_env *stub_env_init(void);
+
+// Free every value made since the last release, except symbols and global
+// references
+void stub_env_release(void);
+
+// A ROWS x COLS terminal with 1000 lines of scrollback and the other
+// options of Fvterm_new left nil
+emacs_value stub_env_new_term(emacs_env *env, int rows, int cols);
+
+// Feed LEN BYTES to TERM in 4 KiB reads, each followed by an update and a
+// redraw as after a read of the process filter. Returns the number of
+// reads, which is also the number of input strings made.
+size_t stub_env_feed(emacs_env *env, emacs_value term, const char *bytes,
+                     size_t len);
+
+extern uint64_t stub_env_funcalls;
+extern uint64_t stub_env_strings;
+
+#endif // STUB_ENV_H
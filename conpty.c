@@ -663,8 +663,8 @@ emacs_value Fvterm_conpty_read_pending(emacs_env *env, ptrdiff_t nargs,
 
   EnterCriticalSection(&state->pending_lock);
   if (state->pending_output_len > 0) {
-    result = env->make_string(env, state->pending_output,
-                              (ptrdiff_t)state->pending_output_len);
+    result = unibyte_string(env, state->pending_output,
+                            (ptrdiff_t)state->pending_output_len);
     state->pending_output_len = 0;
   }
   LeaveCriticalSection(&state->pending_lock);
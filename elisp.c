@@ -19,22 +19,34 @@ emacs_value Qface;
 emacs_value Qbox;
 emacs_value Qbar;
 emacs_value Qhbar;
-emacs_value Qcursor_type;
 emacs_value Qemacs_major_version;
 emacs_value Qvterm_line_wrap;
 emacs_value Qrear_nonsticky;
 emacs_value Qvterm_prompt;
 emacs_value Qdefault_directory;
+emacs_value Qk_title;
+emacs_value Qk_directory;
+emacs_value Qk_cursor_type;
+emacs_value Qk_cursor_blink;
+emacs_value Qk_bell;
+emacs_value Qk_eval;
+emacs_value Qk_selection;
+emacs_value Qk_expect;
+emacs_value Qk_lines;
+emacs_value Qinteger;
+emacs_value Qsymbol;
 
 // Emacs functions
-emacs_value Fblink_cursor_mode;
 emacs_value Fsymbol_value;
 emacs_value Flength;
 emacs_value Flist;
+emacs_value Fvector;
+emacs_value Fsymbol_name;
+emacs_value Fdowncase;
+emacs_value Fupcase;
 emacs_value Fnth;
 emacs_value Ferase_buffer;
 emacs_value Finsert;
-emacs_value Fding;
 emacs_value Fgoto_char;
 emacs_value Fforward_char;
 emacs_value Fforward_line;
@@ -52,13 +64,10 @@ emacs_value Fset;
 emacs_value Fvterm_flush_output;
 emacs_value Fget_buffer_window_list;
 emacs_value Fselected_window;
-emacs_value Fvterm_set_title;
-emacs_value Fvterm_set_directory;
 emacs_value Fvterm_invalidate;
 emacs_value Feq;
 emacs_value Fvterm_get_color;
-emacs_value Fvterm_eval;
-emacs_value Fvterm_set_selection;
+emacs_value Fvterm_apply_events;
 
 /* Set the function cell of the symbol named NAME to SFUN using
    the 'fset' function.  */
@@ -87,6 +96,14 @@ ptrdiff_t string_bytes(emacs_env *env, emacs_value string) {
   return size;
 }
 
+// Before Emacs 28 there is no make_unibyte_string; the multibyte string made
+// instead holds the same UTF-8 bytes, which `binary' sends out unchanged.
+emacs_value unibyte_string(emacs_env *env, const char *bytes, ptrdiff_t len) {
+  if (env->size >= (ptrdiff_t)sizeof(struct emacs_env_28))
+    return env->make_unibyte_string(env, bytes, len);
+  return env->make_string(env, bytes, len);
+}
+
 emacs_value length(emacs_env *env, emacs_value string) {
   return env->funcall(env, Flength, 1, (emacs_value[]){string});
 }
@@ -94,6 +111,9 @@ emacs_value length(emacs_env *env, emacs_value string) {
 emacs_value list(emacs_env *env, emacs_value elements[], ptrdiff_t len) {
   return env->funcall(env, Flist, len, elements);
 }
+emacs_value vector(emacs_env *env, emacs_value elements[], ptrdiff_t len) {
+  return env->funcall(env, Fvector, len, elements);
+}
 emacs_value nth(emacs_env *env, int idx, emacs_value list) {
   emacs_value eidx = env->make_integer(env, idx);
   return env->funcall(env, Fnth, 2, (emacs_value[]){eidx, list});
@@ -129,10 +149,6 @@ void insert_batch(emacs_env *env, emacs_value *strings, ptrdiff_t count) {
   env->funcall(env, Finsert, count, strings);
 }
 
-void ding(emacs_env *env, emacs_value flag) {
-  env->funcall(env, Fding, 1, (emacs_value[]){flag});
-}
-
 void goto_char(emacs_env *env, int pos) {
   emacs_value point = env->make_integer(env, pos);
   env->funcall(env, Fgoto_char, 1, (emacs_value[]){point});
@@ -196,38 +212,15 @@ emacs_value selected_window(emacs_env *env) {
   return env->funcall(env, Fselected_window, 0, (emacs_value[]){});
 }
 
-void set_cursor_type(emacs_env *env, emacs_value cursor_type) {
-  env->funcall(env, Fset, 2, (emacs_value[]){Qcursor_type, cursor_type});
-}
-
-void set_cursor_blink(emacs_env *env, bool blink) {
-  env->funcall(env, Fblink_cursor_mode, 1,
-               (emacs_value[]){env->make_integer(env, blink)});
-}
-
 emacs_value vterm_get_color(emacs_env *env, int index, emacs_value args) {
   emacs_value idx = env->make_integer(env, index);
   return env->funcall(env, Fapply, 3,
                       (emacs_value[]){Fvterm_get_color, idx, args});
 }
 
-void set_title(emacs_env *env, emacs_value string) {
-  env->funcall(env, Fvterm_set_title, 1, (emacs_value[]){string});
-}
-
-void set_directory(emacs_env *env, emacs_value string) {
-  env->funcall(env, Fvterm_set_directory, 1, (emacs_value[]){string});
-}
-
 void vterm_invalidate(emacs_env *env) {
   env->funcall(env, Fvterm_invalidate, 0, NULL);
 }
-emacs_value vterm_eval(emacs_env *env, emacs_value string) {
-  return env->funcall(env, Fvterm_eval, 1, (emacs_value[]){string});
-}
-
-emacs_value vterm_set_selection(emacs_env *env, emacs_value selection_target,
-                                emacs_value selection_data) {
-  return env->funcall(env, Fvterm_set_selection, 2,
-                      (emacs_value[]){selection_target, selection_data});
+void apply_events(emacs_env *env, emacs_value events) {
+  env->funcall(env, Fvterm_apply_events, 1, (emacs_value[]){events});
 }
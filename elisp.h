@@ -22,23 +22,35 @@ extern emacs_value Qface;
 extern emacs_value Qbox;
 extern emacs_value Qbar;
 extern emacs_value Qhbar;
-extern emacs_value Qcursor_type;
 extern emacs_value Qemacs_major_version;
 extern emacs_value Qvterm_line_wrap;
 extern emacs_value Qrear_nonsticky;
 extern emacs_value Qvterm_prompt;
 extern emacs_value Qdefault_directory;
+extern emacs_value Qk_title;
+extern emacs_value Qk_directory;
+extern emacs_value Qk_cursor_type;
+extern emacs_value Qk_cursor_blink;
+extern emacs_value Qk_bell;
+extern emacs_value Qk_eval;
+extern emacs_value Qk_selection;
+extern emacs_value Qk_expect;
+extern emacs_value Qk_lines;
+extern emacs_value Qinteger;
+extern emacs_value Qsymbol;
 
 // Emacs functions
 extern emacs_value Fapply;
-extern emacs_value Fblink_cursor_mode;
 extern emacs_value Fsymbol_value;
 extern emacs_value Flength;
 extern emacs_value Flist;
+extern emacs_value Fvector;
+extern emacs_value Fsymbol_name;
+extern emacs_value Fdowncase;
+extern emacs_value Fupcase;
 extern emacs_value Fnth;
 extern emacs_value Ferase_buffer;
 extern emacs_value Finsert;
-extern emacs_value Fding;
 extern emacs_value Fgoto_char;
 extern emacs_value Fforward_char;
 extern emacs_value Fforward_line;
@@ -55,21 +67,20 @@ extern emacs_value Fset;
 extern emacs_value Fvterm_flush_output;
 extern emacs_value Fget_buffer_window_list;
 extern emacs_value Fselected_window;
-extern emacs_value Fvterm_set_title;
-extern emacs_value Fvterm_set_directory;
 extern emacs_value Fvterm_invalidate;
 extern emacs_value Feq;
 extern emacs_value Fvterm_get_color;
-extern emacs_value Fvterm_eval;
-extern emacs_value Fvterm_set_selection;
+extern emacs_value Fvterm_apply_events;
 
 // Utils
 void bind_function(emacs_env *env, const char *name, emacs_value Sfun);
 void provide(emacs_env *env, const char *feature);
 emacs_value symbol_value(emacs_env *env, emacs_value symbol);
 ptrdiff_t string_bytes(emacs_env *env, emacs_value string);
+emacs_value unibyte_string(emacs_env *env, const char *bytes, ptrdiff_t len);
 emacs_value length(emacs_env *env, emacs_value string);
 emacs_value list(emacs_env *env, emacs_value elements[], ptrdiff_t len);
+emacs_value vector(emacs_env *env, emacs_value elements[], ptrdiff_t len);
 emacs_value nth(emacs_env *env, int idx, emacs_value list);
 void put_text_property(emacs_env *env, emacs_value string, emacs_value property,
                        emacs_value value);
@@ -78,12 +89,9 @@ void add_text_properties(emacs_env *env, emacs_value string,
 void erase_buffer(emacs_env *env);
 void insert(emacs_env *env, emacs_value string);
 void insert_batch(emacs_env *env, emacs_value *strings, ptrdiff_t count);
-void ding(emacs_env *env, emacs_value flag);
 void goto_char(emacs_env *env, int pos);
 void forward_line(emacs_env *env, int n);
 void goto_line(emacs_env *env, int n);
-void set_cursor_type(emacs_env *env, emacs_value cursor_type);
-void set_cursor_blink(emacs_env *env, bool blink);
 void delete_lines(emacs_env *env, int linenum, int count, bool del_whole_line);
 void recenter(emacs_env *env, emacs_value pos);
 void set_window_point(emacs_env *env, emacs_value win, emacs_value point);
@@ -93,12 +101,8 @@ bool eq(emacs_env *env, emacs_value e1, emacs_value e2);
 void forward_char(emacs_env *env, emacs_value n);
 emacs_value get_buffer_window_list(emacs_env *env);
 emacs_value selected_window(emacs_env *env);
-void set_title(emacs_env *env, emacs_value string);
-void set_directory(emacs_env *env, emacs_value string);
 void vterm_invalidate(emacs_env *env);
 emacs_value vterm_get_color(emacs_env *env, int index, emacs_value args);
-emacs_value vterm_eval(emacs_env *env, emacs_value string);
-emacs_value vterm_set_selection(emacs_env *env, emacs_value selection_target,
-                                emacs_value selection_data);
+void apply_events(emacs_env *env, emacs_value events);
 
 #endif /* ELISP_H */
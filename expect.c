@@ -0,0 +1,209 @@
+#include "expect.h"
+#include <string.h>
+
+// escape sequence filter states
+enum {
+  EXPECT_GROUND = 0,
+  EXPECT_ESC,        // after ESC
+  EXPECT_CSI,        // inside ESC [ ... until a final byte
+  EXPECT_STRING,     // inside OSC, DCS, APC, PM or SOS
+  EXPECT_STRING_ESC, // ESC inside a string, maybe the start of ST
+};
+
+void expect_init(Expect *expect, MemStats *mem) {
+  expect->waiters = NULL;
+  expect->next_id = 1;
+  expect->esc_state = EXPECT_GROUND;
+  expect->matched = NULL;
+  expect->matched_len = 0;
+  expect->matched_cap = 0;
+  expect->mem = mem;
+}
+
+void expect_free(Expect *expect) {
+  while (expect->waiters) {
+    ExpectWaiter *waiter = expect->waiters;
+    expect->waiters = waiter->next;
+    tracked_free(expect->mem, waiter);
+  }
+  tracked_free(expect->mem, expect->matched);
+  expect_init(expect, expect->mem);
+}
+
+long expect_add(Expect *expect, const char *pattern, size_t len) {
+  if (len == 0) {
+    return -1;
+  }
+  // waiter, pattern and failure function in one block
+  size_t fail_offset = (sizeof(ExpectWaiter) + len + sizeof(size_t) - 1) /
+                       sizeof(size_t) * sizeof(size_t);
+  ExpectWaiter *waiter = tracked_malloc(expect->mem, MEM_TAG_STRINGS,
+                                        fail_offset + len * sizeof(size_t));
+  if (!waiter) {
+    return -1;
+  }
+  waiter->id = expect->next_id++;
+  waiter->len = len;
+  waiter->state = 0;
+  waiter->fail = (size_t *)((char *)waiter + fail_offset);
+  memcpy(waiter->pattern, pattern, len);
+
+  // fail[i]: length of the longest proper border of pattern[0..i]
+  waiter->fail[0] = 0;
+  size_t k = 0;
+  for (size_t i = 1; i < len; i++) {
+    while (k > 0 && pattern[i] != pattern[k]) {
+      k = waiter->fail[k - 1];
+    }
+    if (pattern[i] == pattern[k]) {
+      k++;
+    }
+    waiter->fail[i] = k;
+  }
+
+  if (!expect->waiters) {
+    // the filter state is not tracked while nobody waits
+    expect->esc_state = EXPECT_GROUND;
+  }
+  waiter->next = expect->waiters;
+  expect->waiters = waiter;
+  return waiter->id;
+}
+
+bool expect_cancel(Expect *expect, long id) {
+  for (ExpectWaiter **p = &expect->waiters; *p; p = &(*p)->next) {
+    if ((*p)->id == id) {
+      ExpectWaiter *waiter = *p;
+      *p = waiter->next;
+      tracked_free(expect->mem, waiter);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool push_matched(Expect *expect, long id) {
+  if (expect->matched_len == expect->matched_cap) {
+    size_t cap = expect->matched_cap ? expect->matched_cap * 2 : 8;
+    long *matched = tracked_realloc(expect->mem, MEM_TAG_STRINGS,
+                                    expect->matched, sizeof(long) * cap);
+    if (!matched) {
+      return false;
+    }
+    expect->matched = matched;
+    expect->matched_cap = cap;
+  }
+  expect->matched[expect->matched_len++] = id;
+  return true;
+}
+
+// Advance WAITER over C; true once its whole pattern is matched
+static bool waiter_step(ExpectWaiter *waiter, char c) {
+  size_t k = waiter->state;
+  while (k > 0 && waiter->pattern[k] != c) {
+    k = waiter->fail[k - 1];
+  }
+  if (waiter->pattern[k] == c) {
+    k++;
+  }
+  waiter->state = k;
+  return k == waiter->len;
+}
+
+// Queue the id of the matched waiter at *P and remove it. If the id can't
+// be queued, the waiter stays to fire on a later match.
+static bool fire(Expect *expect, ExpectWaiter **p) {
+  ExpectWaiter *waiter = *p;
+  if (!push_matched(expect, waiter->id)) {
+    waiter->state = waiter->fail[waiter->len - 1];
+    return false;
+  }
+  *p = waiter->next;
+  tracked_free(expect->mem, waiter);
+  return true;
+}
+
+bool expect_search(Expect *expect, long id, const char *text, size_t len) {
+  for (ExpectWaiter **p = &expect->waiters; *p; p = &(*p)->next) {
+    ExpectWaiter *waiter = *p;
+    if (waiter->id != id) {
+      continue;
+    }
+    for (size_t i = 0; i < len; i++) {
+      if (waiter_step(waiter, text[i]) && fire(expect, p)) {
+        return true;
+      }
+    }
+    // the output that follows starts a new match
+    waiter->state = 0;
+    return false;
+  }
+  return false;
+}
+
+// Whether C is text, advancing the escape sequence filter
+static bool filter_byte(Expect *expect, unsigned char c) {
+  switch (expect->esc_state) {
+  case EXPECT_ESC:
+    if (c == '[') {
+      expect->esc_state = EXPECT_CSI;
+    } else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') {
+      expect->esc_state = EXPECT_STRING;
+    } else if (c < 0x20 || c > 0x2f) {
+      // intermediate bytes keep us in the sequence, anything else ends it
+      expect->esc_state = EXPECT_GROUND;
+    }
+    return false;
+  case EXPECT_CSI:
+    if (c >= 0x40 && c <= 0x7e) {
+      expect->esc_state = EXPECT_GROUND;
+    }
+    return false;
+  case EXPECT_STRING:
+    if (c == 0x07) {
+      expect->esc_state = EXPECT_GROUND;
+    } else if (c == 0x1b) {
+      expect->esc_state = EXPECT_STRING_ESC;
+    }
+    return false;
+  case EXPECT_STRING_ESC:
+    expect->esc_state = c == '\\' ? EXPECT_GROUND : EXPECT_STRING;
+    return false;
+  default:
+    if (c == 0x1b) {
+      expect->esc_state = EXPECT_ESC;
+      return false;
+    }
+    return c >= 0x20 ? c != 0x7f : c == '\n' || c == '\t';
+  }
+}
+
+void expect_feed(Expect *expect, const char *bytes, size_t len) {
+  for (size_t i = 0; i < len && expect->waiters; i++) {
+    char c = bytes[i];
+    if (!filter_byte(expect, (unsigned char)c)) {
+      continue;
+    }
+    ExpectWaiter **p = &expect->waiters;
+    while (*p) {
+      ExpectWaiter *waiter = *p;
+      if (waiter_step(waiter, c) && fire(expect, p)) {
+        continue;
+      }
+      p = &waiter->next;
+    }
+  }
+}
+
+bool expect_has_matched(const Expect *expect) {
+  return expect->matched_len > 0;
+}
+
+size_t expect_take_matched(Expect *expect, long *ids, size_t max) {
+  size_t n = max < expect->matched_len ? max : expect->matched_len;
+  memcpy(ids, expect->matched, sizeof(long) * n);
+  memmove(expect->matched, expect->matched + n,
+          sizeof(long) * (expect->matched_len - n));
+  expect->matched_len -= n;
+  return n;
+}
@@ -0,0 +1,76 @@
+#ifndef EXPECT_H
+#define EXPECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "alloc.h"
+
+// Incremental matching of literal patterns against terminal output
+//
+// Automation waits for a prompt or a message to appear. Instead of
+// searching the buffer after every redraw, waiters are matched against
+// the output bytes as they are fed to libvterm: escape sequences (CSI,
+// OSC, DCS and friends) and control characters other than newline and tab
+// are skipped, and every waiter keeps a KMP state, so each byte is looked
+// at once per waiter whatever the size of the buffer. A waiter fires once
+// and is then removed.
+//
+// Text written after the waiter was added can match it, and so can the
+// screen as it was then, searched once with expect_search. Text that is
+// later overwritten on the screen still counts.
+//
+// Usage:
+//   Expect expect;
+//   expect_init(&expect, &term->mem);
+//   long id = expect_add(&expect, "$ ", 2);
+//   expect_search(&expect, id, screen, screen_len);  // already there?
+//   expect_feed(&expect, bytes, len);
+//   long ids[8];
+//   size_t n = expect_take_matched(&expect, ids, 8);  // ids that fired
+//   expect_free(&expect);
+
+typedef struct ExpectWaiter {
+  long id;
+  size_t len;
+  size_t state;  // bytes of the pattern matched so far
+  size_t *fail;  // KMP failure function, LEN entries
+  struct ExpectWaiter *next;
+  char pattern[];
+} ExpectWaiter;
+
+typedef struct {
+  ExpectWaiter *waiters;
+  long next_id;
+  int esc_state; // where the filter is inside an escape sequence
+  long *matched; // ids that fired, oldest first
+  size_t matched_len;
+  size_t matched_cap;
+  MemStats *mem; // waiters are accounted as MEM_TAG_STRINGS
+} Expect;
+
+void expect_init(Expect *expect, MemStats *mem);
+
+void expect_free(Expect *expect);
+
+// Wait for the LEN bytes of PATTERN. Returns the waiter id, or -1 if
+// PATTERN is empty or out of memory.
+long expect_add(Expect *expect, const char *pattern, size_t len);
+
+// Remove the waiter ID; returns false if it already fired or is unknown
+bool expect_cancel(Expect *expect, long id);
+
+// Match the waiter ID against LEN bytes of plain TEXT, such as the screen
+// when it was added. Returns true and fires it if TEXT holds its pattern.
+bool expect_search(Expect *expect, long id, const char *text, size_t len);
+
+// Match LEN bytes of terminal output against every waiter
+void expect_feed(Expect *expect, const char *bytes, size_t len);
+
+// Whether some waiter fired since the last expect_take_matched
+bool expect_has_matched(const Expect *expect);
+
+// Copy up to MAX fired ids to IDS, oldest first, and forget them
+size_t expect_take_matched(Expect *expect, long *ids, size_t max);
+
+#endif // EXPECT_H
@@ -0,0 +1,100 @@
+#include "linemeta.h"
+#include <string.h>
+
+void linemeta_init(LineMeta *meta, MemStats *mem) {
+  meta->spans = NULL;
+  meta->head = 0;
+  meta->len = 0;
+  meta->cap = 0;
+  meta->mem = mem;
+}
+
+static void free_span(LineMeta *meta, LineSpan *span) {
+  tracked_free(meta->mem, span->directory);
+  span->directory = NULL;
+}
+
+void linemeta_free(LineMeta *meta) {
+  for (size_t i = 0; i < meta->len; i++) {
+    free_span(meta, &meta->spans[meta->head + i]);
+  }
+  tracked_free(meta->mem, meta->spans);
+  linemeta_init(meta, meta->mem);
+}
+
+// Index (relative to head) of the first span starting after LINE
+static size_t upper_bound(const LineMeta *meta, int64_t line) {
+  size_t lo = 0, hi = meta->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (meta->spans[meta->head + mid].line <= line) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void linemeta_set(LineMeta *meta, int64_t line, const char *directory,
+                  int prompt_col) {
+  // drop spans at or after LINE
+  size_t keep = upper_bound(meta, line - 1);
+  for (size_t i = keep; i < meta->len; i++) {
+    free_span(meta, &meta->spans[meta->head + i]);
+  }
+  meta->len = keep;
+
+  if (meta->head + meta->len == meta->cap) {
+    if (meta->head > 0) {
+      // evicted spans left room at the front
+      memmove(meta->spans, meta->spans + meta->head,
+              sizeof(meta->spans[0]) * meta->len);
+      meta->head = 0;
+    } else {
+      size_t cap = meta->cap ? meta->cap * 2 : 16;
+      LineSpan *spans = tracked_realloc(meta->mem, MEM_TAG_METADATA,
+                                        meta->spans, sizeof(spans[0]) * cap);
+      if (!spans) {
+        return;
+      }
+      meta->spans = spans;
+      meta->cap = cap;
+    }
+  }
+
+  LineSpan *span = &meta->spans[meta->head + meta->len++];
+  span->line = line;
+  span->directory =
+      directory ? tracked_strndup(meta->mem, MEM_TAG_METADATA, directory,
+                                  strlen(directory))
+                : NULL;
+  span->prompt_col = prompt_col;
+}
+
+const LineSpan *linemeta_find(const LineMeta *meta, int64_t line) {
+  size_t i = upper_bound(meta, line);
+  return i > 0 ? &meta->spans[meta->head + i - 1] : NULL;
+}
+
+const char *linemeta_directory(const LineMeta *meta, int64_t line) {
+  const LineSpan *span = linemeta_find(meta, line);
+  return span ? span->directory : NULL;
+}
+
+int linemeta_prompt_col(const LineMeta *meta, int64_t line) {
+  const LineSpan *span = linemeta_find(meta, line);
+  return span && span->line == line ? span->prompt_col : -1;
+}
+
+void linemeta_evict(LineMeta *meta, int64_t line) {
+  // the last span starting at or before LINE still covers it
+  while (meta->len > 1 && meta->spans[meta->head + 1].line <= line) {
+    free_span(meta, &meta->spans[meta->head]);
+    meta->head++;
+    meta->len--;
+  }
+  if (meta->len == 0) {
+    meta->head = 0;
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef LINEMETA_H
+#define LINEMETA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc.h"
+
+// Directory and prompt metadata keyed by absolute line number
+//
+// The shell reports its directory and the end of its prompt with "51;A",
+// so the metadata only changes at prompts. Instead of one record per line
+// we keep an ordered list of spans: "from LINE onward the directory is D,
+// and the prompt on LINE ends at column C". Lookups are a binary search,
+// and spans that scrolled out of the scrollback are dropped from the front,
+// so memory is proportional to the number of prompts, not lines.
+//
+// Absolute line numbers only grow as rows scroll into the scrollback (and
+// shrink back when they are popped), so a span keeps describing the same
+// text while it moves from the screen into the scrollback.
+//
+// Usage:
+//   LineMeta meta;
+//   linemeta_init(&meta, &term->mem);
+//   linemeta_set(&meta, 42, "/home/user", 7);  // prompt on line 42
+//   linemeta_directory(&meta, 100);            // "/home/user"
+//   linemeta_prompt_col(&meta, 43);            // -1
+//   linemeta_evict(&meta, 50);                 // lines < 50 are gone
+//   linemeta_free(&meta);
+
+typedef struct {
+  int64_t line;    // first absolute line of the span
+  char *directory; // working directory from LINE onward, may be NULL
+  int prompt_col;  // end column of the prompt on LINE, -1 if none
+} LineSpan;
+
+typedef struct {
+  LineSpan *spans; // live spans are spans[head .. head + len), by line
+  size_t head;
+  size_t len;
+  size_t cap;
+  MemStats *mem; // spans and directories are accounted as MEM_TAG_METADATA
+} LineMeta;
+
+void linemeta_init(LineMeta *meta, MemStats *mem);
+
+void linemeta_free(LineMeta *meta);
+
+// Start a span at LINE. Spans at or after LINE are replaced, since a new
+// prompt also holds for every line below it.
+void linemeta_set(LineMeta *meta, int64_t line, const char *directory,
+                  int prompt_col);
+
+// The span covering LINE, or NULL if LINE is before the first span
+const LineSpan *linemeta_find(const LineMeta *meta, int64_t line);
+
+// Directory of LINE, or NULL
+const char *linemeta_directory(const LineMeta *meta, int64_t line);
+
+// End column of the prompt on LINE, or -1
+int linemeta_prompt_col(const LineMeta *meta, int64_t line);
+
+// Drop the spans that only cover lines before LINE
+void linemeta_evict(LineMeta *meta, int64_t line);
+
+#endif // LINEMETA_H
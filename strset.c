@@ -0,0 +1,89 @@
+#include "strset.h"
+#include <stdint.h>
+#include <string.h>
+
+void strset_init(StrSet *set, MemStats *mem) {
+  set->slots = NULL;
+  set->cap = 0;
+  set->len = 0;
+  set->mem = mem;
+}
+
+void strset_clear(StrSet *set) {
+  for (size_t i = 0; i < set->cap; i++) {
+    tracked_free(set->mem, set->slots[i]);
+    set->slots[i] = NULL;
+  }
+  set->len = 0;
+}
+
+void strset_free(StrSet *set) {
+  strset_clear(set);
+  tracked_free(set->mem, set->slots);
+  strset_init(set, set->mem);
+}
+
+// FNV-1a
+static uint32_t hash(const char *str, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)str[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool equal(const char *slot, const char *str, size_t len) {
+  return strncmp(slot, str, len) == 0 && slot[len] == '\0';
+}
+
+// Slot holding STR, or the empty slot where it belongs
+static size_t probe(char **slots, size_t cap, const char *str, size_t len) {
+  size_t i = hash(str, len) & (cap - 1);
+  while (slots[i] && !equal(slots[i], str, len)) {
+    i = (i + 1) & (cap - 1);
+  }
+  return i;
+}
+
+static bool grow(StrSet *set) {
+  size_t cap = set->cap ? set->cap * 2 : 16;
+  char **slots = tracked_calloc(set->mem, MEM_TAG_STRINGS, cap, sizeof(char *));
+  if (!slots) {
+    return false;
+  }
+  for (size_t i = 0; i < set->cap; i++) {
+    char *s = set->slots[i];
+    if (s) {
+      slots[probe(slots, cap, s, strlen(s))] = s;
+    }
+  }
+  tracked_free(set->mem, set->slots);
+  set->slots = slots;
+  set->cap = cap;
+  return true;
+}
+
+bool strset_add(StrSet *set, const char *str, size_t len) {
+  // keep the load factor under 1/2
+  if ((set->len + 1) * 2 > set->cap && !grow(set)) {
+    return false;
+  }
+  size_t i = probe(set->slots, set->cap, str, len);
+  if (set->slots[i]) {
+    return true;
+  }
+  set->slots[i] = tracked_strndup(set->mem, MEM_TAG_STRINGS, str, len);
+  if (!set->slots[i]) {
+    return false;
+  }
+  set->len++;
+  return true;
+}
+
+bool strset_contains(const StrSet *set, const char *str, size_t len) {
+  if (set->len == 0) {
+    return false;
+  }
+  return set->slots[probe(set->slots, set->cap, str, len)] != NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef STRSET_H
+#define STRSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "alloc.h"
+
+// Set of byte strings
+//
+// An open-addressing hash table of owned copies, used to look up short
+// names (such as the commands allowed by `vterm-eval-cmds') without
+// calling into Lisp. Strings may contain any byte except NUL.
+//
+// Usage:
+//   StrSet set;
+//   strset_init(&set, &term->mem);
+//   strset_add(&set, "find-file", 9);
+//   strset_contains(&set, "find-file", 9);  // true
+//   strset_clear(&set);
+//   strset_free(&set);
+
+typedef struct {
+  char **slots; // NULL or an owned NUL-terminated copy
+  size_t cap;   // power of two, or 0
+  size_t len;
+  MemStats *mem; // slots and strings are accounted as MEM_TAG_STRINGS
+} StrSet;
+
+void strset_init(StrSet *set, MemStats *mem);
+
+void strset_free(StrSet *set);
+
+// Remove every string, keeping the table
+void strset_clear(StrSet *set);
+
+// Add the LEN bytes of STR; return false if out of memory
+bool strset_add(StrSet *set, const char *str, size_t len);
+
+bool strset_contains(const StrSet *set, const char *str, size_t len);
+
+#endif // STRSET_H
@@ -0,0 +1,256 @@
+#include "tokidx.h"
+#include <string.h>
+
+#define NONE UINT32_MAX
+#define MIN_TOKEN 3
+#define MAX_TOKEN 255
+
+void tokidx_init(TokenIndex *index, MemStats *mem) {
+  index->entries = NULL;
+  index->entry_count = 0;
+  index->entry_cap = 0;
+  index->free_entry = NONE;
+  index->buckets = NULL;
+  index->bucket_cap = 0;
+  for (int c = 0; c < 256; c++) {
+    index->first[c] = NONE;
+  }
+  index->len = 0;
+  index->mem = mem;
+}
+
+void tokidx_clear(TokenIndex *index) {
+  for (size_t i = 0; i < index->entry_count; i++) {
+    tracked_free(index->mem, index->entries[i].str);
+  }
+  index->entry_count = 0;
+  index->free_entry = NONE;
+  for (size_t b = 0; b < index->bucket_cap; b++) {
+    index->buckets[b] = NONE;
+  }
+  for (int c = 0; c < 256; c++) {
+    index->first[c] = NONE;
+  }
+  index->len = 0;
+}
+
+void tokidx_free(TokenIndex *index) {
+  tokidx_clear(index);
+  tracked_free(index->mem, index->entries);
+  tracked_free(index->mem, index->buckets);
+  tokidx_init(index, index->mem);
+}
+
+static bool token_byte(unsigned char c) {
+  if (c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+      (c >= 'A' && c <= 'Z')) {
+    return true;
+  }
+  return c && strchr("_-./~:@%+", c) != NULL;
+}
+
+bool tokidx_next_token(const char *text, size_t len, size_t *start,
+                       size_t *end) {
+  size_t i = *end;
+  while (i < len) {
+    while (i < len && !token_byte(text[i])) {
+      i++;
+    }
+    size_t from = i;
+    while (i < len && token_byte(text[i])) {
+      i++;
+    }
+    // "see foo.c." and "error in bar:" end at the word; the next call
+    // skips the trailing dots, which make no token on their own
+    size_t to = i;
+    while (to > from && (text[to - 1] == '.' || text[to - 1] == ':')) {
+      to--;
+    }
+    if (to - from >= MIN_TOKEN && to - from <= MAX_TOKEN) {
+      *start = from;
+      *end = to;
+      return true;
+    }
+  }
+  *end = i;
+  return false;
+}
+
+// FNV-1a
+static uint32_t hash(const char *str, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)str[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool grow_buckets(TokenIndex *index) {
+  size_t cap = index->bucket_cap ? index->bucket_cap * 2 : 256;
+  uint32_t *buckets =
+      tracked_malloc(index->mem, MEM_TAG_TOKENS, cap * sizeof(uint32_t));
+  if (!buckets) {
+    return false;
+  }
+  for (size_t b = 0; b < cap; b++) {
+    buckets[b] = NONE;
+  }
+  for (size_t i = 0; i < index->entry_count; i++) {
+    TokenEntry *e = &index->entries[i];
+    if (e->str) {
+      size_t b = hash(e->str, e->len) & (cap - 1);
+      e->chain = buckets[b];
+      buckets[b] = (uint32_t)i;
+    }
+  }
+  tracked_free(index->mem, index->buckets);
+  index->buckets = buckets;
+  index->bucket_cap = cap;
+  return true;
+}
+
+static uint32_t new_entry(TokenIndex *index) {
+  if (index->free_entry != NONE) {
+    uint32_t i = index->free_entry;
+    index->free_entry = index->entries[i].chain;
+    return i;
+  }
+  if (index->entry_count == index->entry_cap) {
+    size_t cap = index->entry_cap ? index->entry_cap * 2 : 256;
+    TokenEntry *entries = tracked_realloc(index->mem, MEM_TAG_TOKENS,
+                                          index->entries,
+                                          cap * sizeof(TokenEntry));
+    if (!entries) {
+      return NONE;
+    }
+    index->entries = entries;
+    index->entry_cap = cap;
+  }
+  return (uint32_t)index->entry_count++;
+}
+
+static void release_entry(TokenIndex *index, uint32_t i) {
+  TokenEntry *e = &index->entries[i];
+  tracked_free(index->mem, e->str);
+  e->str = NULL;
+  e->chain = index->free_entry;
+  index->free_entry = i;
+}
+
+static void add_token(TokenIndex *index, const char *str, size_t len,
+                      int64_t line) {
+  // keep chains short: at most one token per bucket on average
+  if (index->len + 1 > index->bucket_cap && !grow_buckets(index)) {
+    return;
+  }
+  size_t b = hash(str, len) & (index->bucket_cap - 1);
+  for (uint32_t i = index->buckets[b]; i != NONE;
+       i = index->entries[i].chain) {
+    TokenEntry *e = &index->entries[i];
+    if (e->len == len && memcmp(e->str, str, len) == 0) {
+      e->refs++;
+      if (line > e->line) {
+        e->line = line;
+      }
+      return;
+    }
+  }
+
+  uint32_t i = new_entry(index);
+  if (i == NONE) {
+    return;
+  }
+  TokenEntry *e = &index->entries[i];
+  e->str = tracked_strndup(index->mem, MEM_TAG_TOKENS, str, len);
+  if (!e->str) {
+    e->chain = index->free_entry;
+    index->free_entry = i;
+    return;
+  }
+  e->len = (uint32_t)len;
+  e->refs = 1;
+  e->line = line;
+  e->chain = index->buckets[b];
+  index->buckets[b] = i;
+
+  uint32_t *head = &index->first[(unsigned char)str[0]];
+  e->prev = NONE;
+  e->next = *head;
+  if (*head != NONE) {
+    index->entries[*head].prev = i;
+  }
+  *head = i;
+  index->len++;
+}
+
+static void remove_token(TokenIndex *index, const char *str, size_t len) {
+  if (!index->bucket_cap) {
+    return;
+  }
+  uint32_t *link = &index->buckets[hash(str, len) & (index->bucket_cap - 1)];
+  while (*link != NONE) {
+    uint32_t i = *link;
+    TokenEntry *e = &index->entries[i];
+    if (e->len != len || memcmp(e->str, str, len) != 0) {
+      link = &e->chain;
+      continue;
+    }
+    if (--e->refs > 0) {
+      return;
+    }
+    *link = e->chain;
+    if (e->prev != NONE) {
+      index->entries[e->prev].next = e->next;
+    } else {
+      index->first[(unsigned char)str[0]] = e->next;
+    }
+    if (e->next != NONE) {
+      index->entries[e->next].prev = e->prev;
+    }
+    release_entry(index, i);
+    index->len--;
+    return;
+  }
+}
+
+void tokidx_add_line(TokenIndex *index, const char *text, size_t len,
+                     int64_t line) {
+  size_t start, end = 0;
+  while (tokidx_next_token(text, len, &start, &end)) {
+    add_token(index, text + start, end - start, line);
+  }
+}
+
+void tokidx_remove_line(TokenIndex *index, const char *text, size_t len) {
+  size_t start, end = 0;
+  while (tokidx_next_token(text, len, &start, &end)) {
+    remove_token(index, text + start, end - start);
+  }
+}
+
+size_t tokidx_complete(const TokenIndex *index, const char *prefix,
+                       size_t len, const TokenEntry **found, size_t max) {
+  size_t count = 0;
+  if (len == 0 || max == 0) {
+    return 0;
+  }
+  for (uint32_t i = index->first[(unsigned char)prefix[0]]; i != NONE;
+       i = index->entries[i].next) {
+    const TokenEntry *e = &index->entries[i];
+    if (e->len <= len || memcmp(e->str, prefix, len) != 0) {
+      continue;
+    }
+    if (count == max && e->line <= found[max - 1]->line) {
+      continue;
+    }
+    // insertion into FOUND, kept sorted newest first
+    size_t at = count < max ? count++ : max - 1;
+    while (at > 0 && found[at - 1]->line < e->line) {
+      found[at] = found[at - 1];
+      at--;
+    }
+    found[at] = e;
+  }
+  return count;
+}
@@ -0,0 +1,77 @@
+#ifndef TOKIDX_H
+#define TOKIDX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc.h"
+
+// Index of the tokens printed in the scrollback, for completion
+//
+// A token is a run of letters, digits, non-ASCII characters and the
+// punctuation of paths and hashes ("_-./~:@%+"), at least three bytes long.
+// Each scrollback line adds its tokens when it is pushed and removes them
+// when it scrolls out or is popped, so a token lives as long as some line
+// holding it and the index never outgrows the scrollback. Tokens remember
+// the newest line they were seen on, and prefix queries return the most
+// recent first.
+//
+// Tokens are kept in a chained hash table for counting, and in one list per
+// first byte for prefix queries, which only walk the list of the prefix.
+//
+// Usage:
+//   TokenIndex index;
+//   tokidx_init(&index, &term->mem);
+//   tokidx_add_line(&index, "cd /usr/share/emacs", 19, 42);
+//   const TokenEntry *found[8];
+//   tokidx_complete(&index, "/usr", 4, found, 8);  // "/usr/share/emacs"
+//   tokidx_remove_line(&index, "cd /usr/share/emacs", 19);
+//   tokidx_free(&index);
+
+typedef struct {
+  char *str;      // owned and NUL-terminated, NULL if the entry is free
+  uint32_t len;
+  uint32_t refs;  // occurrences in the indexed lines
+  int64_t line;   // newest absolute line holding the token
+  uint32_t chain; // next entry in the hash chain, or in the free list
+  uint32_t prev, next; // neighbours in the list of its first byte
+} TokenEntry;
+
+typedef struct {
+  TokenEntry *entries;
+  size_t entry_count; // entries used so far, live or free
+  size_t entry_cap;
+  uint32_t free_entry;
+  uint32_t *buckets;  // hash chains, bucket_cap is 0 or a power of two
+  size_t bucket_cap;
+  uint32_t first[256]; // list of the tokens starting with each byte
+  size_t len;          // live tokens
+  MemStats *mem;       // accounted as MEM_TAG_TOKENS
+} TokenIndex;
+
+void tokidx_init(TokenIndex *index, MemStats *mem);
+
+void tokidx_free(TokenIndex *index);
+
+// Remove every token, keeping the tables
+void tokidx_clear(TokenIndex *index);
+
+// Find the next token in TEXT[*END .. LEN): return false if there is none,
+// else set [*START, *END) to it
+bool tokidx_next_token(const char *text, size_t len, size_t *start,
+                       size_t *end);
+
+// Count the tokens of the LEN bytes of TEXT, seen on absolute line LINE
+void tokidx_add_line(TokenIndex *index, const char *text, size_t len,
+                     int64_t line);
+
+// Uncount the tokens of a line given to tokidx_add_line
+void tokidx_remove_line(TokenIndex *index, const char *text, size_t len);
+
+// Store in FOUND up to MAX tokens that extend the LEN bytes of PREFIX,
+// newest first, and return how many
+size_t tokidx_complete(const TokenIndex *index, const char *prefix,
+                       size_t len, const TokenEntry **found, size_t max);
+
+#endif // TOKIDX_H
@@ -67,3 +67,19 @@ bool utf8_to_codepoint(const unsigned char buffer[4], const size_t len,
 
   return false;
 }
+
+/* Length of the longest prefix of BUFFER that does not end inside a UTF-8
+ * sequence. Invalid bytes count as complete. */
+size_t utf8_complete_prefix(const unsigned char *buffer, size_t len) {
+  size_t stop = len > 4 ? len - 4 : 0;
+  for (size_t i = len; i > stop; i--) {
+    unsigned char byte = buffer[i - 1];
+    if (byte < 0x80)
+      return len;
+    if (byte < 0xC0)
+      continue;
+    size_t expected = byte < 0xE0 ? 2 : byte < 0xF0 ? 3 : byte < 0xF8 ? 4 : 1;
+    return i - 1 + expected > len ? i - 1 : len;
+  }
+  return len;
+}
@@ -8,5 +8,6 @@
 size_t codepoint_to_utf8(const uint32_t codepoint, unsigned char buffer[4]);
 bool utf8_to_codepoint(const unsigned char buffer[4], const size_t len,
                        uint32_t *codepoint);
+size_t utf8_complete_prefix(const unsigned char *buffer, size_t len);
 
 #endif /* UTF8_H */
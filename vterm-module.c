@@ -15,9 +15,29 @@ VTERM_EXPORT int plugin_is_GPL_compatible;
 #include <termios.h>
 #endif
 
+#include <time.h>
 #include <unistd.h>
 #include <vterm.h>
 
+static bool compare_cells(VTermScreenCell *a, VTermScreenCell *b);
+static bool is_key(unsigned char *key, size_t len, char *key_description);
+static emacs_value cell_face(emacs_env *env, Term *term,
+                             VTermScreenCell *cell);
+static emacs_value render_text(emacs_env *env, Term *term, char *string,
+                               int len, VTermScreenCell *cell);
+static emacs_value render_fake_newline(emacs_env *env, Term *term);
+static emacs_value render_prompt(emacs_env *env, emacs_value text);
+static emacs_value cell_rgb_color(emacs_env *env, Term *term,
+                                  VTermScreenCell *cell, bool is_foreground);
+
+static int term_settermprop(VTermProp prop, VTermValue *val, void *user_data);
+
+static void term_redraw(Term *term, emacs_env *env);
+static void term_flush_output(Term *term, emacs_env *env);
+static void term_process_key(Term *term, emacs_env *env, unsigned char *key,
+                             size_t len, VTermModifier modifier);
+static void invalidate_terminal(Term *term, int start_row, int end_row);
+
 /* ============================================================================
  * PROFILING INSTRUMENTATION
  * Compile with -DVTERM_PROFILE to enable performance profiling
@@ -155,6 +175,31 @@ static void profile_print_stats(void) {
     fclose(logfile);
 }
 
+/* Per-terminal memory report, printed when the terminal is finalized */
+static void profile_print_memory(Term *term) {
+  fprintf(stderr, "\n=== Vterm Memory Profile ===\n");
+  fprintf(stderr, "%-18s %12s %10s %12s %10s\n", "Subsystem", "Live (B)",
+          "Objects", "Peak (B)", "Allocs");
+  fprintf(stderr,
+          "--------------------------------------------------------------\n");
+  for (int i = 0; i < MEM_TAG_COUNT; i++) {
+    MemTagStats *t = &term->mem.tags[i];
+    fprintf(stderr, "%-18s %12zu %10zu %12zu %10llu\n", mem_tag_name(i),
+            t->live_bytes, t->live_objects, t->peak_bytes,
+            (unsigned long long)t->total_allocs);
+  }
+  fprintf(stderr, "%-18s %12zu %10s %12zu\n", "persistent_arena",
+          arena_used(term->persistent_arena), "-",
+          term->persistent_arena->reserved_bytes);
+  fprintf(stderr, "%-18s %12zu %10s %12zu\n", "temp_arena",
+          arena_used(term->temp_arena), "-", term->temp_arena->peak_used);
+  fprintf(stderr, "%-18s %12zu %10s %12zu\n", "total heap",
+          term->mem.live_bytes, "-", term->mem.peak_bytes);
+  fprintf(stderr,
+          "--------------------------------------------------------------\n");
+  fflush(stderr);
+}
+
 #else
 #define PROFILE_START(idx)                                                     \
   do {                                                                         \
@@ -168,6 +213,25 @@ static inline void profile_print_stats(void) {}
 /* Cached Emacs major version to avoid repeated symbol lookups */
 static int cached_emacs_major_version = 0;
 
+/* ============================================================================
+ * Allocator shim for libvterm
+ * Routes libvterm's internal allocations through the terminal's MemStats so
+ * they show up in `vterm--memory-stats'.  libvterm expects zeroed memory.
+ * ============================================================================
+ */
+static void *term_vterm_malloc(size_t size, void *allocdata) {
+  return tracked_calloc((MemStats *)allocdata, MEM_TAG_LIBVTERM, 1, size);
+}
+
+static void term_vterm_free(void *ptr, void *allocdata) {
+  tracked_free((MemStats *)allocdata, ptr);
+}
+
+static VTermAllocatorFunctions term_vterm_allocator = {
+    .malloc = term_vterm_malloc,
+    .free = term_vterm_free,
+};
+
 /* ============================================================================
  * PERFORMANCE OPTIMIZATION: Key lookup hash table
  * Instead of O(n) string comparisons, use hash-based O(1) lookup
@@ -309,6 +373,9 @@ static KeyEntry key_table[] = {
 /* Hash table buckets for O(1) lookup */
 #define KEY_HASH_SIZE 128
 static KeyEntry *key_hash_table[KEY_HASH_SIZE];
+/* Same entries keyed by event symbol name ("up" for "<up>"), for
+ * vterm--key-event */
+static KeyEntry *key_symbol_table[KEY_HASH_SIZE];
 static bool key_table_initialized = false;
 
 static void init_key_table(void) {
@@ -327,6 +394,16 @@ static void init_key_table(void) {
       idx = (idx + 1) % KEY_HASH_SIZE;
     }
     key_hash_table[idx] = &key_table[i];
+
+    if (key_table[i].name[0] != '<')
+      continue;
+    idx = hash_key((const unsigned char *)key_table[i].name + 1,
+                   key_table[i].len - 2) %
+          KEY_HASH_SIZE;
+    while (key_symbol_table[idx] != NULL) {
+      idx = (idx + 1) % KEY_HASH_SIZE;
+    }
+    key_symbol_table[idx] = &key_table[i];
   }
   key_table_initialized = true;
 }
@@ -353,15 +430,32 @@ VTERM_INLINE KeyEntry *lookup_key(const unsigned char *key, size_t len) {
   return NULL;
 }
 
+/* Look up an event symbol name, which is a key name without the brackets */
+static KeyEntry *lookup_key_symbol(const unsigned char *name, size_t len) {
+  if (VTERM_UNLIKELY(!key_table_initialized)) {
+    init_key_table();
+  }
+
+  uint32_t idx = hash_key(name, len) % KEY_HASH_SIZE;
+  int probes = 0;
+
+  while (key_symbol_table[idx] != NULL && probes < KEY_HASH_SIZE) {
+    KeyEntry *entry = key_symbol_table[idx];
+    if (entry->len == len + 2 && memcmp(entry->name + 1, name, len) == 0) {
+      return entry;
+    }
+    idx = (idx + 1) % KEY_HASH_SIZE;
+    probes++;
+  }
+  return NULL;
+}
+
 /* ============================================================================
  * PERFORMANCE OPTIMIZATION: Circular buffer helpers for scrollback
  * Provides O(1) push/pop instead of O(n) memmove operations
  * ============================================================================
  */
 
-/* Forward declaration needed for sb_push */
-static void free_lineinfo(LineInfo *line);
-
 /* Get the actual index in the circular buffer */
 VTERM_INLINE size_t sb_index(Term *term, size_t logical_idx) {
   return (term->sb_head + logical_idx) % term->sb_size;
@@ -378,16 +472,115 @@ VTERM_INLINE ScrollbackLine *sb_get(Term *term, size_t logical_idx) {
   return term->sb_buffer[actual_idx];
 }
 
+/* A scrollback row of COLS cells, from the pool when there is one. A free
+ * row of the pool may be wider than needed: after the terminal narrows, the
+ * rows of the old width serve the new one. */
+static ScrollbackLine *sb_row_alloc(Term *term, size_t cols) {
+  size_t size = sizeof(ScrollbackLine) + cols * sizeof(VTermScreenCell);
+  ScrollbackLine *row;
+  if (!term->sb_pool) {
+    row = tracked_malloc(&term->mem, MEM_TAG_SCROLLBACK, size);
+  } else {
+    SbFreeRows *best = NULL;
+    for (SbFreeRows *list = term->sb_free_rows; list; list = list->next) {
+      if (list->rows && list->capacity >= cols &&
+          (!best || list->capacity < best->capacity))
+        best = list;
+    }
+    if (best) {
+      row = best->rows;
+      memcpy(&best->rows, row->cells, sizeof(row));
+      best->count--;
+      row->cols = cols;
+      return row;
+    }
+    row = arena_alloc(term->sb_pool, size);
+  }
+  if (row)
+    row->cols = row->capacity = cols;
+  return row;
+}
+
+static void sb_row_free(Term *term, ScrollbackLine *row) {
+  if (!term->sb_pool) {
+    tracked_free(&term->mem, row);
+    return;
+  }
+  SbFreeRows *list = term->sb_free_rows;
+  while (list && list->capacity != row->capacity)
+    list = list->next;
+  if (!list) {
+    /* one list per width the terminal has had, kept until the pool goes */
+    list = arena_alloc(term->sb_pool, sizeof(SbFreeRows));
+    if (!list)
+      return;
+    list->capacity = row->capacity;
+    list->count = 0;
+    list->rows = NULL;
+    list->next = term->sb_free_rows;
+    term->sb_free_rows = list;
+  }
+  memcpy(row->cells, &list->rows, sizeof(row));
+  list->rows = row;
+  list->count++;
+}
+
+/* Free rows narrower than the terminal can't be used until it narrows
+ * again. Once they hold half of the pool, copy the rows of the scrollback
+ * to a new pool and give the old one back to the OS. The copy is at most as
+ * large as what is released, so memory peaks at 1.5 times the old pool, and
+ * it costs no more than the pushes that freed those rows. Called from
+ * term_redraw, never from the callbacks of libvterm. */
+static void sb_pool_trim(Term *term) {
+  size_t stranded = 0;
+  for (SbFreeRows *list = term->sb_free_rows; list; list = list->next) {
+    if (list->capacity < (size_t)term->width)
+      stranded += list->count * (sizeof(ScrollbackLine) +
+                                 list->capacity * sizeof(VTermScreenCell));
+  }
+  if (stranded == 0 || stranded < arena_used(term->sb_pool) / 2)
+    return;
+
+  arena_allocator_t *pool =
+      arena_create_large(SB_POOL_BLOCK, term->sb_pool_flags);
+  ScrollbackLine **rows = tracked_malloc(
+      &term->mem, MEM_TAG_SCROLLBACK, (term->sb_current + 1) * sizeof(*rows));
+  if (!pool || !rows) {
+    if (pool)
+      arena_destroy(pool);
+    tracked_free(&term->mem, rows);
+    return;
+  }
+  for (size_t i = 0; i < term->sb_current; i++) {
+    ScrollbackLine *row = term->sb_buffer[sb_index(term, i)];
+    rows[i] = NULL;
+    if (!row)
+      continue;
+    size_t size = sizeof(ScrollbackLine) + row->cols * sizeof(VTermScreenCell);
+    rows[i] = arena_alloc(pool, size);
+    if (!rows[i]) {
+      arena_destroy(pool);
+      tracked_free(&term->mem, rows);
+      return;
+    }
+    memcpy(rows[i], row, size);
+    rows[i]->capacity = row->cols;
+  }
+  for (size_t i = 0; i < term->sb_current; i++)
+    term->sb_buffer[sb_index(term, i)] = rows[i];
+  tracked_free(&term->mem, rows);
+  arena_destroy(term->sb_pool);
+  term->sb_pool = pool;
+  term->sb_free_rows = NULL;
+}
+
 /* Push a new line to the scrollback buffer (at the newest position) */
 VTERM_INLINE void sb_push(Term *term, ScrollbackLine *line) {
   if (term->sb_current == term->sb_size) {
     /* Buffer full - free oldest and advance head */
     ScrollbackLine *old = term->sb_buffer[term->sb_head];
     if (old != NULL) {
-      if (old->info != NULL) {
-        free_lineinfo(old->info);
-      }
-      free(old);
+      sb_row_free(term, old);
     }
     term->sb_head = (term->sb_head + 1) % term->sb_size;
   } else {
@@ -453,105 +646,257 @@ VTERM_INLINE bool fast_compare_cells(VTermScreenCell *a, VTermScreenCell *b) {
 }
 
 /* ============================================================================
- * Arena-based allocations for performance optimization
- * Reduces heap fragmentation, O(1) alloc, O(1) bulk free
+ * PERFORMANCE OPTIMIZATION: Row fingerprints for scroll-off reuse
+ * A row pushed to scrollback whose fingerprint matches the one rendered for
+ * it is already in the buffer, so refresh_scrollback can keep its line
  * ============================================================================
  */
 
-/* Arena-based LineInfo allocation */
-VTERM_INLINE LineInfo *arena_alloc_lineinfo(arena_allocator_t *arena) {
-  LineInfo *info = (LineInfo *)arena_alloc(arena, sizeof(LineInfo));
-  info->directory = NULL;
-  info->prompt_col = -1;
-  return info;
+/* FNV-1a over 32-bit words */
+VTERM_INLINE uint64_t row_fp_mix(uint64_t fp, uint32_t word) {
+  fp ^= word;
+  return fp * 1099511628211ull;
+}
+
+VTERM_INLINE uint32_t row_fp_color(const VTermColor *color) {
+  if (VTERM_COLOR_IS_INDEXED(color)) {
+    return ((uint32_t)color->type << 24) | color->indexed.idx;
+  }
+  return ((uint32_t)color->type << 24) | ((uint32_t)color->rgb.red << 16) |
+         ((uint32_t)color->rgb.green << 8) | color->rgb.blue;
+}
+
+/* Mix in everything refresh_lines renders from CELL */
+VTERM_INLINE uint64_t row_fp_cell(uint64_t fp, const VTermScreenCell *cell) {
+  int k;
+  for (k = 0; k < VTERM_MAX_CHARS_PER_CELL && cell->chars[k]; ++k) {
+    fp = row_fp_mix(fp, cell->chars[k]);
+  }
+  fp = row_fp_mix(fp, (uint32_t)k << 16 | (uint32_t)(uint8_t)cell->width << 8 |
+                          cell->attrs.bold | cell->attrs.underline << 1 |
+                          cell->attrs.italic << 3 | cell->attrs.reverse << 4 |
+                          cell->attrs.strike << 5);
+  fp = row_fp_mix(fp, row_fp_color(&cell->fg));
+  return row_fp_mix(fp, row_fp_color(&cell->bg));
+}
+
+/* Never 0, which marks an unknown row */
+VTERM_INLINE uint64_t row_fp_finish(uint64_t fp, int prompt_col) {
+  fp = row_fp_mix(fp, (uint32_t)(prompt_col + 1));
+  return fp | 1;
+}
+
+#define ROW_FP_SEED 14695981039346656037ull
+
+/* Fingerprint of a row about to be pushed, matching refresh_lines: cells up
+ * to the last non-blank one, stepping over wide characters */
+static uint64_t row_fp_cells(const VTermScreenCell *cells, int cols,
+                             int prompt_col) {
+  int last = cols - 1;
+  while (last >= 0 && cells[last].chars[0] == 0) {
+    last--;
+  }
+  uint64_t fp = ROW_FP_SEED;
+  for (int j = 0; j <= last; j += cells[j].width > 1 ? cells[j].width : 1) {
+    fp = row_fp_cell(fp, &cells[j]);
+  }
+  return row_fp_finish(fp, prompt_col);
+}
+
+/* Absolute line of ROW: rows keep their number while they scroll into the
+ * scrollback (row -1 is the newest scrollback line) */
+VTERM_INLINE int64_t row_to_abs_line(Term *term, int row) {
+  return term->top_line + row;
 }
 
-/* Arena-based LineInfo with directory */
-VTERM_INLINE LineInfo *arena_alloc_lineinfo_with_dir(arena_allocator_t *arena,
-                                                     const char *directory) {
-  LineInfo *info = arena_alloc_lineinfo(arena);
-  if (directory != NULL) {
-    info->directory = arena_strdup(arena, directory);
+/* UTF-8 text of the COLS cells into OUT, which holds
+ * COLS * VTERM_MAX_CHARS_PER_CELL * 4 bytes: a blank for an empty cell, none
+ * for the trailing ones. Returns its length; if ENDS is not NULL, ENDS[col]
+ * is the length up to the end of the cell at COL, for each cell before it. */
+static size_t row_text(const VTermScreenCell *cells, int cols, char *out,
+                       size_t *ends) {
+  size_t len = 0;
+  size_t end = 0; /* after the last non-blank cell */
+  for (int col = 0; col < cols; col += MAX(cells[col].width, 1)) {
+    const VTermScreenCell *cell = &cells[col];
+    if (cell->chars[0] == 0 || cell->chars[0] == (uint32_t)-1) {
+      out[len++] = ' ';
+    } else {
+      for (int k = 0; k < VTERM_MAX_CHARS_PER_CELL && cell->chars[k]; ++k) {
+        len += codepoint_to_utf8(cell->chars[k], (unsigned char *)out + len);
+      }
+      end = len;
+    }
+    if (ends)
+      ends[col] = len;
   }
-  return info;
+  return end;
 }
 
-/* Allocate LineInfo using term's arena */
-static LineInfo *alloc_lineinfo_for_term(Term *term) {
-  return arena_alloc_lineinfo(term->persistent_arena);
+/* UTF-8 text of COLS cells into term->token_text; return its length, or 0
+ * if out of memory */
+static size_t cells_token_text(Term *term, const VTermScreenCell *cells,
+                               size_t cols) {
+  size_t cap = cols * VTERM_MAX_CHARS_PER_CELL * 4 + 1;
+  if (cap > term->token_text_cap) {
+    char *text = tracked_realloc(&term->mem, MEM_TAG_TOKENS, term->token_text,
+                                 cap);
+    if (!text)
+      return 0;
+    term->token_text = text;
+    term->token_text_cap = cap;
+  }
+  return row_text(cells, (int)cols, term->token_text, NULL);
 }
 
-/* Allocate LineInfo with directory using term's arena */
-static LineInfo *alloc_lineinfo_with_dir_for_term(Term *term, const char *dir) {
-  return arena_alloc_lineinfo_with_dir(term->persistent_arena, dir);
+/* Count (ADD) or uncount the tokens of a scrollback row on absolute LINE */
+static void index_sb_row(Term *term, const ScrollbackLine *row,
+                         int64_t line, bool add) {
+  size_t len = cells_token_text(term, row->cells, row->cols);
+  if (add)
+    tokidx_add_line(&term->tokens, term->token_text, len, line);
+  else
+    tokidx_remove_line(&term->tokens, term->token_text, len);
+}
+
+/* Grow the array *PTR of *CAP elements of SIZE bytes to NEED elements;
+ * false if out of memory */
+static bool feed_reserve(Term *term, void **ptr, size_t *cap, size_t need,
+                         size_t size) {
+  if (need <= *cap)
+    return true;
+  size_t new_cap = MAX(need, *cap * 2);
+  void *grown = tracked_realloc(&term->mem, MEM_TAG_LINES, *ptr,
+                                new_cap * size);
+  if (!grown)
+    return false;
+  *ptr = grown;
+  *cap = new_cap;
+  return true;
 }
 
-/* Free LineInfo - no-op when arena is active (arena handles bulk free).
- * Only frees malloc-allocated memory as fallback. */
-static void free_lineinfo(LineInfo *line) {
-  /* Arena-allocated memory is freed in bulk by arena_destroy.
-   * Individual free() calls on arena memory are skipped. */
-  (void)line;
+/* Feed the COLS cells of the row with line id ID. A row ending in a printed
+ * cell goes on with the next one, as vterm-line-wrap marks it in the buffer.
+ * Past FEED_LINE_MAX bytes the rest of a line is cut. */
+static void feed_row(Term *term, const VTermScreenCell *cells, int cols,
+                     int64_t id) {
+  LineFeed *feed = &term->feed;
+  if (id < feed->next)
+    return; /* fed when the cursor left it */
+  feed->next = id + 1;
+
+  if (!feed->open) {
+    feed->dropping = feed->len >= (size_t)feed->max ||
+                     !feed_reserve(term, (void **)&feed->lines, &feed->cap,
+                                   feed->len + 1, sizeof(FeedLine));
+    if (feed->dropping) {
+      feed->dropped++;
+    } else {
+      feed->lines[feed->len++] = (FeedLine){
+          .id = id, .text = feed->text_len, .runs = feed->runs_len};
+    }
+  }
+  feed->open = cols > 0 && cells[cols - 1].chars[0] != 0;
+  if (feed->dropping)
+    return;
+
+  FeedLine *line = &feed->lines[feed->len - 1];
+  if (!feed_reserve(term, (void **)&feed->text, &feed->text_cap,
+                    feed->text_len + (size_t)cols * VTERM_MAX_CHARS_PER_CELL * 4,
+                    1) ||
+      (feed->faces &&
+       !feed_reserve(term, (void **)&feed->runs, &feed->runs_cap,
+                     feed->runs_len + cols, sizeof(FeedRun))))
+    return;
+  char *text = feed->text + feed->text_len;
+  size_t ends[cols + 1];
+  size_t len = row_text(cells, cols, text, ends);
+  if (line->len + len > FEED_LINE_MAX)
+    return;
+
+  size_t start = 0;
+  for (int col = 0; start < len; col += MAX(cells[col].width, 1)) {
+    VTermScreenCell cell = cells[col];
+    int first = line->chars;
+    for (; start < ends[col]; start++) /* count the characters */
+      line->chars += ((unsigned char)text[start] & 0xC0) != 0x80;
+    if (!feed->faces)
+      continue;
+    FeedRun *run = line->nruns ? &feed->runs[feed->runs_len - 1] : NULL;
+    if (run && fast_compare_cells(&cell, &run->cell)) {
+      run->end = line->chars;
+    } else {
+      feed->runs[feed->runs_len++] =
+          (FeedRun){.start = first, .end = line->chars, .cell = cell};
+      line->nruns++;
+    }
+  }
+  feed->text_len += len;
+  line->len = feed->text_len - line->text;
 }
+
 static int term_sb_push(int cols, const VTermScreenCell *cells, void *data) {
   Term *term = (Term *)data;
 
+  /* a row leaving the screen is complete */
+  if (term->feed.max > 0)
+    feed_row(term, cells, cols, row_to_abs_line(term, 0));
+
   if (!term->sb_size) {
+    /* the row is dropped, but the rows below it still move up */
+    term->top_line++;
+    linemeta_evict(&term->meta, term->top_line);
     return 0;
   }
 
+  /* rows pushed in order from the top of an unchanged screen are still in
+   * the buffer; count how many lead the pushes of this redraw */
+  if (term->resizing) {
+    term->sb_reuse_broken = true;
+  } else if (term->sb_pushed == term->sb_reused &&
+             term->sb_reused < MIN(term->height, term->row_fp_len) &&
+             term->row_fp[term->sb_reused] != 0 &&
+             term->row_fp[term->sb_reused] ==
+                 row_fp_cells(cells, cols,
+                              linemeta_prompt_col(&term->meta,
+                                                  row_to_abs_line(term, 0)))) {
+    term->sb_reused++;
+  }
+  term->sb_pushed++;
+
   // copy vterm cells into sb_buffer using circular buffer (O(1) instead of O(n)
   // memmove)
   size_t c = (size_t)cols;
-  ScrollbackLine *sbrow = NULL;
+  ScrollbackLine *oldest = term->sb_current == term->sb_size
+                               ? term->sb_buffer[term->sb_head]
+                               : NULL;
+  // Recycle the oldest entry of a full buffer if it is wide enough
+  bool recycle = oldest && oldest->capacity >= c;
+  ScrollbackLine *sbrow = recycle ? oldest : sb_row_alloc(term, c);
+  if (!sbrow) {
+    /* out of memory: the row is lost, as without a scrollback */
+    term->top_line++;
+    return 0;
+  }
+  if (oldest) {
+    if (term->tokens_enabled)
+      index_sb_row(term, oldest, 0, false);
+    if (!recycle)
+      sb_row_free(term, oldest);
+  }
+  sbrow->cols = c;
 
   if (term->sb_current == term->sb_size) {
-    // Buffer is full - recycle oldest entry at sb_head
-    ScrollbackLine *oldest = term->sb_buffer[term->sb_head];
-    if (oldest != NULL) {
-      if (oldest->cols == c) {
-        // Recycle old row if it's the right size
-        sbrow = oldest;
-      } else {
-        if (oldest->info != NULL) {
-          free_lineinfo(oldest->info);
-        }
-        free(oldest);
-      }
-    }
     // Advance head to discard oldest entry
     term->sb_head = (term->sb_head + 1) % term->sb_size;
   } else {
     term->sb_current++;
   }
 
-  if (!sbrow) {
-    sbrow = malloc(sizeof(ScrollbackLine) + c * sizeof(sbrow->cells[0]));
-    sbrow->cols = c;
-    sbrow->info = NULL;
-  }
-
-  if (sbrow->info != NULL) {
-    free_lineinfo(sbrow->info);
-  }
-  sbrow->info = term->lines[0];
-
-  memmove(term->lines, term->lines + 1,
-          sizeof(term->lines[0]) * (term->lines_len - 1));
-  if (term->resizing) {
-    /* pushed by window height decr */
-    if (term->lines[term->lines_len - 1] != NULL) {
-      /* do not need free here ,it is reused ,we just need set null */
-      term->lines[term->lines_len - 1] = NULL;
-    }
-    term->lines_len--;
-  } else {
-    LineInfo *lastline = term->lines[term->lines_len - 1];
-    if (lastline != NULL) {
-      term->lines[term->lines_len - 1] =
-          alloc_lineinfo_with_dir_for_term(term, lastline->directory);
-    }
-  }
+  /* the row keeps its absolute line, which is now in the scrollback */
+  term->top_line++;
+  linemeta_evict(&term->meta,
+                 row_to_abs_line(term, -(int)term->sb_current));
 
   // New row is added at tail position (O(1) operation)
   term->sb_buffer[term->sb_tail] = sbrow;
@@ -567,6 +912,8 @@ static int term_sb_push(int cols, const VTermScreenCell *cells, void *data) {
   }
 
   memcpy(sbrow->cells, cells, c * sizeof(cells[0]));
+  if (term->tokens_enabled)
+    index_sb_row(term, sbrow, term->top_line - 1, true);
 
   return 1;
 }
@@ -585,6 +932,7 @@ static int term_sb_pop(int cols, VTermScreenCell *cells, void *data) {
   if (term->sb_pending) {
     term->sb_pending--;
   }
+  term->sb_reuse_broken = true;
 
   // Pop newest entry from tail (O(1) instead of O(n) memmove)
   term->sb_tail = (term->sb_tail + term->sb_size - 1) % term->sb_size;
@@ -605,15 +953,11 @@ static int term_sb_pop(int cols, VTermScreenCell *cells, void *data) {
     cells[col].width = 1;
   }
 
-  LineInfo **lines = arena_alloc(term->persistent_arena,
-                                 sizeof(LineInfo *) * (term->lines_len + 1));
-
-  memmove(lines + 1, term->lines, sizeof(term->lines[0]) * term->lines_len);
-  lines[0] = sbrow->info;
-  free(sbrow);
-  term->lines_len += 1;
-  /* old term->lines array is abandoned in arena (bulk freed on destroy) */
-  term->lines = lines;
+  if (term->tokens_enabled)
+    index_sb_row(term, sbrow, 0, false);
+  sb_row_free(term, sbrow);
+  /* the row is back on the screen with the same absolute line */
+  term->top_line--;
 
   return 1;
 }
@@ -626,18 +970,21 @@ static int term_sb_clear(void *data) {
     return 0;
   }
 
-  // Iterate over circular buffer using head/tail pointers
-  size_t idx = term->sb_head;
-  for (size_t i = 0; i < term->sb_current; i++) {
-    if (term->sb_buffer[idx] != NULL) {
-      if (term->sb_buffer[idx]->info != NULL) {
-        free_lineinfo(term->sb_buffer[idx]->info);
-        term->sb_buffer[idx]->info = NULL;
+  if (term->sb_pool) {
+    /* the rows go back to the OS with their blocks */
+    arena_destroy(term->sb_pool);
+    term->sb_pool = arena_create_large(SB_POOL_BLOCK, term->sb_pool_flags);
+    term->sb_free_rows = NULL;
+  } else {
+    // Iterate over circular buffer using head/tail pointers
+    size_t idx = term->sb_head;
+    for (size_t i = 0; i < term->sb_current; i++) {
+      if (term->sb_buffer[idx] != NULL) {
+        tracked_free(&term->mem, term->sb_buffer[idx]);
+        term->sb_buffer[idx] = NULL;
       }
-      free(term->sb_buffer[idx]);
-      term->sb_buffer[idx] = NULL;
+      idx = (idx + 1) % term->sb_size;
     }
-    idx = (idx + 1) % term->sb_size;
   }
   /* old sb_buffer array is abandoned in arena (bulk freed on destroy) */
   term->sb_buffer = arena_calloc(term->persistent_arena, term->sb_size,
@@ -648,6 +995,9 @@ static int term_sb_clear(void *data) {
   term->sb_tail = 0;
   term->sb_pending = 0;
   term->sb_pending_by_height_decr = 0;
+  term->sb_reuse_broken = true;
+  linemeta_evict(&term->meta, row_to_abs_line(term, 0));
+  tokidx_clear(&term->tokens);
   invalidate_terminal(term, -1, -1);
 
   return 0;
@@ -697,27 +1047,14 @@ static void fetch_cell(Term *term, int row, int col, VTermScreenCell *cell) {
   PROFILE_END(PROFILE_FETCH_CELL);
 }
 
-static char *get_row_directory(Term *term, int row) {
-  if (row < 0) {
-    ScrollbackLine *sbrow = get_scrollback_line(term, (size_t)(-row - 1));
-    if (sbrow && sbrow->info && sbrow->info->directory) {
-      return sbrow->info->directory;
-    } else {
-      return NULL;
-    }
-  } else {
-    LineInfo *line = term->lines[row];
-    return line ? line->directory : NULL;
+static const char *get_row_directory(Term *term, int row) {
+  if (row < 0 && get_scrollback_line(term, (size_t)(-row - 1)) == NULL) {
+    return NULL;
   }
+  return linemeta_directory(&term->meta, row_to_abs_line(term, row));
 }
-static LineInfo *get_lineinfo(Term *term, int row) {
-  if (row < 0) {
-    ScrollbackLine *sbrow = get_scrollback_line(term, (size_t)(-row - 1));
-    return sbrow ? sbrow->info : NULL;
-    /* return term->dirs[0]; */
-  } else {
-    return term->lines[row];
-  }
+static int get_row_prompt_col(Term *term, int row) {
+  return linemeta_prompt_col(&term->meta, row_to_abs_line(term, row));
 }
 static bool is_eol(Term *term, int end_col, int row, int col) {
   /* This cell is EOL if this and every cell to the right is black */
@@ -738,18 +1075,16 @@ static bool is_eol(Term *term, int end_col, int row, int col) {
   }
   return 1;
 }
-static int is_end_of_prompt(Term *term, int end_col, int row, int col) {
-  LineInfo *info = get_lineinfo(term, row);
-  if (info == NULL) {
-    return 0;
-  }
-  if (info->prompt_col < 0) {
+/* PROMPT_COL is get_row_prompt_col for ROW, looked up once per row */
+static int is_end_of_prompt(Term *term, int end_col, int row, int col,
+                            int prompt_col) {
+  if (prompt_col < 0) {
     return 0;
   }
-  if (info->prompt_col == col) {
+  if (prompt_col == col) {
     return 1;
   }
-  if (is_eol(term, end_col, row, col) && info->prompt_col >= col) {
+  if (is_eol(term, end_col, row, col) && prompt_col >= col) {
     return 1;
   }
   return 0;
@@ -840,6 +1175,9 @@ static void refresh_lines(Term *term, emacs_env *env, int start_row,
 
     int newline = 0;
     int isprompt = 0;
+    bool track_fp = i >= 0 && i < term->row_fp_len;
+    uint64_t fp = ROW_FP_SEED;
+    int prompt_col = get_row_prompt_col(term, i);
     for (j = 0; j < end_col; j++) {
       fetch_cell(term, i, j, &cell);
       if (isprompt && length > 0) {
@@ -848,7 +1186,7 @@ static void refresh_lines(Term *term, emacs_env *env, int start_row,
         length = 0;
       }
 
-      isprompt = is_end_of_prompt(term, end_col, i, j);
+      isprompt = is_end_of_prompt(term, end_col, i, j, prompt_col);
       if (isprompt && length > 0) {
         PUSH_SEGMENT(render_text(env, term, buffer, length, &lastCell));
         length = 0;
@@ -878,6 +1216,9 @@ static void refresh_lines(Term *term, emacs_env *env, int start_row,
           }
         }
       }
+      if (track_fp) {
+        fp = row_fp_cell(fp, &cell);
+      }
 
       if (cell.width > 1) {
         int w = cell.width - 1;
@@ -890,6 +1231,9 @@ static void refresh_lines(Term *term, emacs_env *env, int start_row,
       length = 0;
       isprompt = 0;
     }
+    if (track_fp) {
+      term->row_fp[i] = row_fp_finish(fp, prompt_col);
+    }
 
     if (!newline) {
       emacs_value text = render_text(env, term, buffer, length, &lastCell);
@@ -941,6 +1285,7 @@ static void refresh_screen(Term *term, emacs_env *env) {
 
   term->invalid_start = INT_MAX;
   term->invalid_end = -1;
+  term->scroll_invalid_start = INT_MAX;
   PROFILE_END(PROFILE_REFRESH_SCREEN);
 }
 
@@ -951,32 +1296,22 @@ static int term_resize(int rows, int cols, void *user_data) {
   Term *term = (Term *)user_data;
   term->invalid_start = 0;
   term->invalid_end = rows;
-
-  /* if rows=term->lines_len, that means term_sb_pop already resize term->lines
-   */
-  /* if rows<term->lines_len, term_sb_push would resize term->lines there */
-  /* we only need to take care of rows>term->height */
-
-  if (rows > term->height) {
-    if (rows > term->lines_len) {
-      LineInfo **infos = term->lines;
-      term->lines =
-          arena_alloc(term->persistent_arena, sizeof(LineInfo *) * rows);
-      memmove(term->lines, infos, sizeof(infos[0]) * term->lines_len);
-
-      LineInfo *lastline = term->lines[term->lines_len - 1];
-      for (int i = term->lines_len; i < rows; i++) {
-        if (lastline != NULL) {
-          term->lines[i] =
-              alloc_lineinfo_with_dir_for_term(term, lastline->directory);
-        } else {
-          term->lines[i] = NULL;
-        }
-      }
-      term->lines_len = rows;
-      /* old infos array is abandoned in arena (bulk freed on destroy) */
-    }
+  term->scroll_invalid_start = 0;
+
+  /* Rows added at the bottom continue the last directory span and rows
+   * moved through the scrollback keep their absolute lines, so the
+   * directory and prompt metadata need no update here */
+
+  /* every row is rendered again, so the fingerprints start over */
+  if (rows > term->row_fp_len) {
+    /* old row_fp array is abandoned in arena (bulk freed on destroy) */
+    term->row_fp =
+        arena_calloc(term->persistent_arena, rows, sizeof(term->row_fp[0]));
+    term->row_fp_len = rows;
+  } else {
+    memset(term->row_fp, 0, sizeof(term->row_fp[0]) * term->row_fp_len);
   }
+  term->sb_reuse_broken = true;
 
   term->width = cols;
   term->height = rows;
@@ -987,6 +1322,49 @@ static int term_resize(int rows, int cols, void *user_data) {
   return 1;
 }
 
+/* Number of pending scrollback rows that can keep their buffer lines: the
+ * rows pushed first, in order, whose fingerprints match the screen rows
+ * rendered by the last redraw. Anything that reorders rows falls back to
+ * rendering every pending row. */
+static int reusable_scrollback_rows(Term *term) {
+  if (term->sb_reuse_broken || term->height_resize != 0 ||
+      term->linenum_added != 0 || term->sb_pushed != term->sb_pending) {
+    return 0;
+  }
+  return term->sb_reused;
+}
+
+/* The first REUSED pending rows are the top REUSED screen lines of the
+ * buffer: leave them where they are, render the remaining pending rows
+ * below them and open REUSED lines at the bottom for the screen. */
+static void reuse_scrolled_rows(Term *term, emacs_env *env, int reused) {
+  int pending = term->sb_pending;
+  if (pending > reused) {
+    goto_line(env, -(term->height - reused));
+    refresh_lines(term, env, -(pending - reused), 0, term->width);
+  }
+
+  char *newlines = arena_alloc(term->temp_arena, reused);
+  memset(newlines, '\n', reused);
+  goto_line(env, 0);
+  insert(env, env->make_string(env, newlines, reused));
+
+  if (term->scroll_pure && term->scroll_shift == pending &&
+      reused == pending) {
+    /* Plain scroll-up: the remaining screen lines moved up with the screen,
+     * only rows damaged since the last redraw and the exposed bottom rows
+     * need rendering */
+    term->invalid_start =
+        MIN(term->scroll_invalid_start, term->height - reused);
+    term->invalid_end = term->height;
+    memmove(term->row_fp, term->row_fp + reused,
+            sizeof(term->row_fp[0]) * (term->height - reused));
+  } else {
+    term->invalid_start = 0;
+    term->invalid_end = term->height;
+  }
+}
+
 // Refresh the scrollback of an invalidated terminal.
 static void refresh_scrollback(Term *term, emacs_env *env) {
   PROFILE_START(PROFILE_REFRESH_SCROLLBACK);
@@ -1015,13 +1393,18 @@ static void refresh_scrollback(Term *term, emacs_env *env) {
 
     term->linenum += term->sb_pending;
     del_cnt = term->linenum - max_line_count; /* extra lines at the bottom */
-    /* buf_index is negative, so we move to end of buffer, then backward
-       -buf_index lines. goto lines backward is effective when
-       vterm-max-scrollback is a large number.
-     */
-    int buf_index = -(term->height + del_cnt);
-    goto_line(env, buf_index);
-    refresh_lines(term, env, -term->sb_pending, 0, term->width);
+    int reused = del_cnt > 0 ? 0 : reusable_scrollback_rows(term);
+    if (reused > 0) {
+      reuse_scrolled_rows(term, env, reused);
+    } else {
+      /* buf_index is negative, so we move to end of buffer, then backward
+         -buf_index lines. goto lines backward is effective when
+         vterm-max-scrollback is a large number.
+       */
+      int buf_index = -(term->height + del_cnt);
+      goto_line(env, buf_index);
+      refresh_lines(term, env, -term->sb_pending, 0, term->width);
+    }
 
     term->sb_pending = 0;
   }
@@ -1038,6 +1421,11 @@ static void refresh_scrollback(Term *term, emacs_env *env) {
 
   term->sb_pending_by_height_decr = 0;
   term->height_resize = 0;
+  term->sb_pushed = 0;
+  term->sb_reused = 0;
+  term->sb_reuse_broken = false;
+  term->scroll_shift = 0;
+  term->scroll_pure = true;
   PROFILE_END(PROFILE_REFRESH_SCROLLBACK);
 }
 
@@ -1079,6 +1467,7 @@ static void invalidate_terminal(Term *term, int start_row, int end_row) {
   if (start_row != -1 && end_row != -1) {
     term->invalid_start = MIN(term->invalid_start, start_row);
     term->invalid_end = MAX(term->invalid_end, end_row);
+    term->scroll_invalid_start = MIN(term->scroll_invalid_start, start_row);
   }
   term->is_invalidated = true;
 }
@@ -1096,7 +1485,22 @@ static int term_bell(void *data) {
 }
 
 static int term_moverect(VTermRect dest, VTermRect src, void *data) {
-  invalidate_terminal(data, MIN(dest.start_row, src.start_row),
+  Term *term = data;
+  int shift = src.start_row - dest.start_row;
+  if (shift > 0 && dest.start_row == 0 && src.end_row == term->height &&
+      dest.end_row == term->height - shift && src.start_col == 0 &&
+      dest.start_col == 0 && src.end_col == term->width &&
+      dest.end_col == term->width) {
+    /* Whole screen scrolled up: rows invalidated so far moved up too */
+    int start = MAX(0, term->scroll_invalid_start - shift);
+    invalidate_terminal(term, 0, term->height);
+    term->scroll_invalid_start = start;
+    term->scroll_shift += shift;
+    return 1;
+  }
+
+  term->scroll_pure = false;
+  invalidate_terminal(term, MIN(dest.start_row, src.start_row),
                       MAX(dest.end_row, src.end_row));
   return 1;
 }
@@ -1112,95 +1516,300 @@ static int term_movecursor(VTermPos new, VTermPos old, int visible,
   return 1;
 }
 
-static void term_redraw_cursor(Term *term, emacs_env *env) {
+/* Whether screen ROW ends in a printed cell and goes on with the next one */
+static bool row_wraps(Term *term, int row) {
+  VTermScreenCell cell;
+  fetch_cell(term, row, term->width - 1, &cell);
+  return cell.chars[0] != 0;
+}
+
+/* Feed the screen rows the cursor has left. When it went back above rows
+ * already fed, as after a clear, they are fed again once it leaves them,
+ * with the same ids. The alternate screen is not fed. */
+static void feed_screen_rows(Term *term) {
+  LineFeed *feed = &term->feed;
+  if (term->altscreen)
+    return;
+
+  if (row_to_abs_line(term, term->cursor.row) < feed->next) {
+    int row = term->cursor.row;
+    while (row > 0 && row_wraps(term, row - 1))
+      row--;
+    int64_t from = row_to_abs_line(term, row);
+    if (feed->open && !feed->dropping) {
+      /* withdraw the open line: fed again from the screen, or lost */
+      FeedLine *line = &feed->lines[--feed->len];
+      if (line->id >= term->top_line)
+        from = MIN(from, line->id);
+      else
+        feed->dropped++;
+      feed->text_len = line->text;
+      feed->runs_len = line->runs;
+    }
+    feed->open = false;
+    feed->dropping = false;
+    feed->next = from;
+  }
+
+  int64_t first = MAX(feed->next - term->top_line, 0);
+  if (first >= term->cursor.row)
+    return;
+  VTermScreenCell *cells =
+      arena_alloc(term->temp_arena, sizeof(VTermScreenCell) * term->width);
+  for (int row = (int)first; row < term->cursor.row; row++) {
+    for (int col = 0; col < term->width; col++)
+      fetch_cell(term, row, col, &cells[col]);
+    feed_row(term, cells, term->width, row_to_abs_line(term, row));
+  }
+}
+
+/* (DROPPED (ID TEXT RUNS)...) for the complete lines of the feed, RUNS as
+ * in vterm--face-runs or nil; the open line stays for the next redraw */
+static emacs_value take_feed_lines(Term *term, emacs_env *env) {
+  LineFeed *feed = &term->feed;
+  size_t n = feed->len - (feed->open && !feed->dropping ? 1 : 0);
+  emacs_value *values =
+      arena_alloc(term->temp_arena, sizeof(emacs_value) * (n + 1));
+  values[0] = env->make_integer(env, feed->dropped);
+  for (size_t i = 0; i < n; i++) {
+    FeedLine *line = &feed->lines[i];
+    emacs_value runs = Qnil;
+    if (feed->faces) {
+      emacs_value *items =
+          arena_alloc(term->temp_arena, sizeof(emacs_value) * 3 * line->nruns);
+      for (size_t r = 0; r < line->nruns; r++) {
+        FeedRun *run = &feed->runs[line->runs + r];
+        items[3 * r] = env->make_integer(env, run->start);
+        items[3 * r + 1] = env->make_integer(env, run->end);
+        items[3 * r + 2] = cell_face(env, term, &run->cell);
+      }
+      runs = list(env, items, 3 * line->nruns);
+    }
+    const char *text = line->len ? feed->text + line->text : "";
+    values[i + 1] = list(
+        env,
+        (emacs_value[]){env->make_integer(env, line->id),
+                        env->make_string(env, text, line->len), runs},
+        3);
+  }
+  emacs_value result = list(env, values, n + 1);
+
+  if (n < feed->len) {
+    FeedLine open = feed->lines[n];
+    memmove(feed->text, feed->text + open.text, open.len);
+    memmove(feed->runs, feed->runs + open.runs, open.nruns * sizeof(FeedRun));
+    open.text = 0;
+    open.runs = 0;
+    feed->lines[0] = open;
+  }
+  feed->len -= n;
+  feed->text_len = feed->len ? feed->lines[0].len : 0;
+  feed->runs_len = feed->len ? feed->lines[0].nruns : 0;
+  feed->dropped = 0;
+  return result;
+}
+
+/* Side-channel events of one redraw, delivered with a single call to
+ * vterm--apply-events as a plist of what changed */
+#define EVENT_KINDS 9
+typedef struct {
+  emacs_value plist[2 * EVENT_KINDS];
+  int len;
+} Events;
+
+VTERM_INLINE void push_event(Events *events, emacs_value key,
+                             emacs_value value) {
+  events->plist[events->len++] = key;
+  events->plist[events->len++] = value;
+}
+
+/* Cursor states besides the VTERM_PROP_CURSORSHAPE_* values */
+#define CURSOR_HIDDEN -2
+#define CURSOR_UNSENT INT_MIN
+
+static emacs_value cursor_type_value(int cursor) {
+  switch (cursor) {
+  case CURSOR_HIDDEN:
+    return Qnil;
+  case VTERM_PROP_CURSORSHAPE_BLOCK:
+    return Qbox;
+  case VTERM_PROP_CURSORSHAPE_UNDERLINE:
+    return Qhbar;
+  case VTERM_PROP_CURSORSHAPE_BAR_LEFT:
+    return Qbar;
+  default:
+    return Qt;
+  }
+}
+
+static void term_redraw_cursor(Term *term, Events *events) {
   PROFILE_START(PROFILE_TERM_REDRAW_CURSOR);
 
   if (term->cursor.cursor_blink_changed) {
     term->cursor.cursor_blink_changed = false;
-    set_cursor_blink(env, term->cursor.cursor_blink);
+    if (term->cursor.cursor_blink != term->cursor.blink_sent) {
+      term->cursor.blink_sent = term->cursor.cursor_blink;
+      push_event(events, Qk_cursor_blink,
+                 term->cursor.cursor_blink ? Qt : Qnil);
+    }
   }
 
   if (term->cursor.cursor_type_changed) {
     term->cursor.cursor_type_changed = false;
-
-    if (!term->cursor.cursor_visible) {
-      set_cursor_type(env, Qnil);
-      PROFILE_END(PROFILE_TERM_REDRAW_CURSOR);
-      return;
-    }
-
-    switch (term->cursor.cursor_type) {
-    case VTERM_PROP_CURSORSHAPE_BLOCK:
-      set_cursor_type(env, Qbox);
-      break;
-    case VTERM_PROP_CURSORSHAPE_UNDERLINE:
-      set_cursor_type(env, Qhbar);
-      break;
-    case VTERM_PROP_CURSORSHAPE_BAR_LEFT:
-      set_cursor_type(env, Qbar);
-      break;
-    default:
-      set_cursor_type(env, Qt);
-      break;
+    int cursor = term->cursor.cursor_visible ? term->cursor.cursor_type
+                                             : CURSOR_HIDDEN;
+    if (cursor != term->cursor.type_sent) {
+      term->cursor.type_sent = cursor;
+      push_event(events, Qk_cursor_type, cursor_type_value(cursor));
     }
   }
 
   PROFILE_END(PROFILE_TERM_REDRAW_CURSOR);
 }
 
+/* A queued 51;E command: the list (NAME ARGS...) of its words, or the raw
+ * payload string when it was left to `split-string-and-unquote' */
+static emacs_value elisp_code_value(Term *term, emacs_env *env,
+                                    ElispCodeListNode *node) {
+  if (node->argc == 0) {
+    return env->make_string(env, node->code, node->code_len);
+  }
+  emacs_value *words =
+      arena_alloc(term->temp_arena, sizeof(emacs_value) * node->argc);
+  char *word = node->code;
+  for (int i = 0; i < node->argc; i++) {
+    size_t len = strlen(word);
+    words[i] = env->make_string(env, word, len);
+    word += len + 1;
+  }
+  return list(env, words, node->argc);
+}
+
+/* Queued 51;E commands, oldest first; the queue is emptied */
+static emacs_value take_elisp_code(Term *term, emacs_env *env) {
+  int count = 0;
+  for (ElispCodeListNode *node = term->elisp_code_first; node;
+       node = node->next) {
+    count++;
+  }
+  emacs_value *codes =
+      arena_alloc(term->temp_arena, sizeof(emacs_value) * count);
+  int i = 0;
+  while (term->elisp_code_first) {
+    ElispCodeListNode *node = term->elisp_code_first;
+    term->elisp_code_first = node->next;
+    codes[i++] = elisp_code_value(term, env, node);
+    tracked_free(&term->mem, node);
+  }
+  term->elisp_code_p_insert = &term->elisp_code_first;
+  return list(env, codes, count);
+}
+
+/* Microseconds on a monotonic clock, for the time accounting of Term */
+static uint64_t monotonic_us(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (!freq.QuadPart)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000 +
+                    now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
 static void term_redraw(Term *term, emacs_env *env) {
   PROFILE_START(PROFILE_TERM_REDRAW);
-  term_redraw_cursor(term, env);
+  uint64_t start = monotonic_us();
+  Events events = {.len = 0};
+  term_redraw_cursor(term, &events);
 
   if (term->is_invalidated) {
     int oldlinenum = term->linenum;
     refresh_scrollback(term, env);
     refresh_screen(term, env);
+    term->buffer_top_line = term->top_line - (term->linenum - term->height);
     term->linenum_added = term->linenum - oldlinenum;
     adjust_topline(term, env);
     term->linenum_added = 0;
     if (term->queued_bell) {
-      ding(env, Qt);
+      push_event(&events, Qk_bell, Qt);
       term->queued_bell = false;
     }
   }
 
+  /* Only the last title and directory of the redraw are delivered; those
+   * equal to the buffer's are dropped in Lisp, where Lisp may have changed
+   * them since */
   if (term->title_changed) {
-    set_title(env, env->make_string(env, term->title, strlen(term->title)));
     term->title_changed = false;
+    push_event(&events, Qk_title,
+               env->make_string(env, term->title, strlen(term->title)));
   }
 
   if (term->directory_changed) {
-    set_directory(
-        env, env->make_string(env, term->directory, strlen(term->directory)));
     term->directory_changed = false;
+    push_event(&events, Qk_directory,
+               env->make_string(env, term->directory,
+                                strlen(term->directory)));
   }
 
-  while (term->elisp_code_first) {
-    ElispCodeListNode *node = term->elisp_code_first;
-    term->elisp_code_first = node->next;
-    emacs_value elisp_code = env->make_string(env, node->code, node->code_len);
-    vterm_eval(env, elisp_code);
-    /* Arena-allocated nodes are freed in bulk by arena_destroy */
+  if (term->elisp_code_first) {
+    push_event(&events, Qk_eval, take_elisp_code(term, env));
+  }
+
+  if (expect_has_matched(&term->expect)) {
+    size_t count = term->expect.matched_len;
+    long *ids = arena_alloc(term->temp_arena, sizeof(long) * count);
+    emacs_value *values =
+        arena_alloc(term->temp_arena, sizeof(emacs_value) * count);
+    size_t n = expect_take_matched(&term->expect, ids, count);
+    for (size_t i = 0; i < n; i++) {
+      values[i] = env->make_integer(env, ids[i]);
+    }
+    push_event(&events, Qk_expect, list(env, values, n));
+  }
+
+  if (term->feed.max > 0) {
+    feed_screen_rows(term);
+    size_t open = term->feed.open && !term->feed.dropping;
+    if (term->feed.len > open || term->feed.dropped) {
+      push_event(&events, Qk_lines, take_feed_lines(term, env));
+    }
   }
-  term->elisp_code_p_insert = &term->elisp_code_first;
 
   if (term->selection_data) {
     emacs_value selection_mask = env->make_integer(env, term->selection_mask);
     emacs_value selection_data = env->make_string(env, term->selection_data,
                                                   strlen(term->selection_data));
-    vterm_set_selection(env, selection_mask, selection_data);
-    free(term->selection_data);
+    push_event(&events, Qk_selection,
+               list(env, (emacs_value[]){selection_mask, selection_data}, 2));
+    tracked_free(&term->mem, term->selection_data);
     term->selection_data = NULL;
     term->selection_mask = 0;
   }
 
+  if (events.len > 0) {
+    apply_events(env, list(env, events.plist, events.len));
+  }
+
   term->is_invalidated = false;
 
-  /* Reset temporary arena after each redraw for memory reuse (O(1) operation)
-   */
+  if (term->sb_pool)
+    sb_pool_trim(term);
+
+  /* Reset temporary arena after each redraw for memory reuse (O(1) operation).
+   * The vterm--* functions that use the arena reset it too, and the :expect
+   * callbacks and line subscribers may call them from apply_events; that is
+   * safe, since all the redraw put in the arena is in Lisp values by then
+   * and nothing reads it past apply_events. */
   arena_reset(term->temp_arena);
 
+  term->render_us += monotonic_us() - start;
   PROFILE_END(PROFILE_TERM_REDRAW);
 }
 
@@ -1235,34 +1844,32 @@ static bool is_key(unsigned char *key, size_t len, char *key_description) {
           memcmp(key, key_description, len) == 0);
 }
 
-/* str1=concat(str1,str2,str2_len,true); */
-/* str1 can be NULL */
-static char *concat(char *str1, const char *str2, size_t str2_len,
+/* str1=concat(term,str1,str2,str2_len,true); */
+/* str1 can be NULL; the result is accounted as MEM_TAG_STRINGS */
+static char *concat(Term *term, char *str1, const char *str2, size_t str2_len,
                     bool free_str1) {
   if (str1 == NULL) {
-    str1 = malloc(str2_len + 1);
-    memcpy(str1, str2, str2_len);
-    str1[str2_len] = '\0';
-    return str1;
+    return tracked_strndup(&term->mem, MEM_TAG_STRINGS, str2, str2_len);
   }
   size_t str1_len = strlen(str1);
-  char *buf = malloc(str1_len + str2_len + 1);
+  char *buf =
+      tracked_malloc(&term->mem, MEM_TAG_STRINGS, str1_len + str2_len + 1);
   memcpy(buf, str1, str1_len);
   memcpy(&buf[str1_len], str2, str2_len);
   buf[str1_len + str2_len] = '\0';
   if (free_str1) {
-    free(str1);
+    tracked_free(&term->mem, str1);
   }
   return buf;
 }
 static void term_set_title(Term *term, const char *title, size_t len,
                            bool initial, bool final) {
   if (term->title && initial) {
-    free(term->title);
+    tracked_free(&term->mem, term->title);
     term->title = NULL;
     term->title_changed = false;
   }
-  term->title = concat(term->title, title, len, true);
+  term->title = concat(term, term->title, title, len, true);
   if (final) {
     term->title_changed = true;
   }
@@ -1302,6 +1909,8 @@ static int term_settermprop(VTermProp prop, VTermValue *val, void *user_data) {
 #endif
     break;
   case VTERM_PROP_ALTSCREEN:
+    term->altscreen = val->boolean;
+    term->sb_reuse_broken = true;
     invalidate_terminal(term, 0, term->height);
     break;
   case VTERM_PROP_MOUSE:
@@ -1314,18 +1923,9 @@ static int term_settermprop(VTermProp prop, VTermValue *val, void *user_data) {
   return 1;
 }
 
-static emacs_value render_text(emacs_env *env, Term *term, char *buffer,
-                               int len, VTermScreenCell *cell) {
-  PROFILE_START(PROFILE_RENDER_TEXT);
-  emacs_value text;
-  if (len == 0) {
-    text = env->make_string(env, "", 0);
-    PROFILE_END(PROFILE_RENDER_TEXT);
-    return text;
-  } else {
-    text = env->make_string(env, buffer, len);
-  }
-
+/* The face plist for text drawn with CELL's attributes, or nil */
+static emacs_value cell_face(emacs_env *env, Term *term,
+                             VTermScreenCell *cell) {
   emacs_value fg = cell_rgb_color(env, term, cell, true);
   emacs_value bg = cell_rgb_color(env, term, cell, false);
   /* With vterm-disable-bold-font, vterm-disable-underline,
@@ -1347,7 +1947,6 @@ static emacs_value render_text(emacs_env *env, Term *term, char *buffer,
   // TODO: Blink, font, dwl, dhl is missing
   /* Use cached emacs_major_version instead of looking it up every call */
   int emacs_major_version = cached_emacs_major_version;
-  emacs_value properties;
   emacs_value props[64];
   int props_len = 0;
   if (env->is_not_nil(env, fg))
@@ -1367,10 +1966,29 @@ static emacs_value render_text(emacs_env *env, Term *term, char *buffer,
   if (emacs_major_version >= 27)
     props[props_len++] = Qextend, props[props_len++] = Qt;
 
-  properties = list(env, props, props_len);
+  if (!props_len)
+    return Qnil;
+  return list(env, props, props_len);
+}
+
+static emacs_value render_text(emacs_env *env, Term *term, char *buffer,
+                               int len, VTermScreenCell *cell) {
+  PROFILE_START(PROFILE_RENDER_TEXT);
+  emacs_value text;
+  if (len == 0) {
+    text = env->make_string(env, "", 0);
+    PROFILE_END(PROFILE_RENDER_TEXT);
+    return text;
+  } else {
+    text = env->make_string(env, buffer, len);
+  }
 
-  if (props_len)
-    put_text_property(env, text, Qface, properties);
+  /* With lazy faces, vterm--fontify-region applies them when displayed */
+  if (!term->lazy_faces) {
+    emacs_value face = cell_face(env, term, cell);
+    if (env->is_not_nil(env, face))
+      put_text_property(env, text, Qface, face);
+  }
 
   PROFILE_END(PROFILE_RENDER_TEXT);
   return text;
@@ -1446,7 +2064,7 @@ static void term_flush_output(Term *term, emacs_env *env) {
     char buffer[len];
     len = vterm_output_read(term->vt, buffer, len);
 
-    emacs_value output = env->make_string(env, buffer, len);
+    emacs_value output = unibyte_string(env, buffer, len);
     env->funcall(env, Fvterm_flush_output, 1, (emacs_value[]){output});
   }
 }
@@ -1457,145 +2075,372 @@ static void term_clear_scrollback(Term *term, emacs_env *env) {
   term_redraw(term, env);
 }
 
-static void term_process_key(Term *term, emacs_env *env, unsigned char *key,
-                             size_t len, VTermModifier modifier) {
-  /* Use hash-based O(1) key lookup instead of O(n) string comparisons */
-  KeyEntry *entry = lookup_key(key, len);
-
-  if (entry != NULL) {
-    /* Handle special keys that need custom logic */
-    switch (entry->type) {
-    case KEY_CLEAR_SCROLLBACK:
-      term_clear_scrollback(term, env);
-      return;
-    case KEY_START:
+/* Returns false if ENTRY has no action of its own */
+static bool term_process_key_entry(Term *term, emacs_env *env, KeyEntry *entry,
+                                   VTermModifier modifier) {
+  /* Handle special keys that need custom logic */
+  switch (entry->type) {
+  case KEY_CLEAR_SCROLLBACK:
+    term_clear_scrollback(term, env);
+    return true;
+  case KEY_START:
 #ifndef _WIN32
-      tcflow(term->pty_fd, TCOON);
+    tcflow(term->pty_fd, TCOON);
 #endif
-      return;
-    case KEY_STOP:
+    return true;
+  case KEY_STOP:
 #ifndef _WIN32
-      tcflow(term->pty_fd, TCOOFF);
+    tcflow(term->pty_fd, TCOOFF);
 #endif
-      return;
-    case KEY_START_PASTE:
-      vterm_keyboard_start_paste(term->vt);
-      return;
-    case KEY_END_PASTE:
-      vterm_keyboard_end_paste(term->vt);
-      return;
-    case KEY_BACKTAB:
-    case KEY_ISO_LEFTTAB:
-      /* backtab uses SHIFT modifier */
-      vterm_keyboard_key(term->vt, VTERM_KEY_TAB, VTERM_MOD_SHIFT);
-      return;
-    case KEY_SPC:
-      vterm_keyboard_unichar(term->vt, ' ', modifier);
-      return;
-    default:
-      /* All other keys with a direct vterm_key mapping */
-      if (entry->vterm_key != VTERM_KEY_NONE) {
-        vterm_keyboard_key(term->vt, entry->vterm_key, modifier);
-        return;
-      }
-      break;
+    return true;
+  case KEY_START_PASTE:
+    vterm_keyboard_start_paste(term->vt);
+    return true;
+  case KEY_END_PASTE:
+    vterm_keyboard_end_paste(term->vt);
+    return true;
+  case KEY_BACKTAB:
+  case KEY_ISO_LEFTTAB:
+    /* backtab uses SHIFT modifier */
+    vterm_keyboard_key(term->vt, VTERM_KEY_TAB, VTERM_MOD_SHIFT);
+    return true;
+  case KEY_SPC:
+    vterm_keyboard_unichar(term->vt, ' ', modifier);
+    return true;
+  default:
+    /* All other keys with a direct vterm_key mapping */
+    if (entry->vterm_key != VTERM_KEY_NONE) {
+      vterm_keyboard_key(term->vt, entry->vterm_key, modifier);
+      return true;
     }
+    return false;
   }
+}
 
+static void term_process_unichar(Term *term, uint32_t codepoint,
+                                 VTermModifier modifier) {
   /* Handle Ctrl+j -> newline */
-  if (len == 1 && key[0] == 'j' && (modifier == VTERM_MOD_CTRL)) {
+  if (codepoint == 'j' && modifier == VTERM_MOD_CTRL) {
     vterm_keyboard_unichar(term->vt, '\n', 0);
     return;
   }
+  vterm_keyboard_unichar(term->vt, codepoint, modifier);
+}
+
+static void term_process_key(Term *term, emacs_env *env, unsigned char *key,
+                             size_t len, VTermModifier modifier) {
+  /* Use hash-based O(1) key lookup instead of O(n) string comparisons */
+  KeyEntry *entry = lookup_key(key, len);
+
+  if (entry != NULL && term_process_key_entry(term, env, entry, modifier))
+    return;
 
   /* Fallback: try to decode as UTF-8 codepoint */
   if (len <= 4) {
     uint32_t codepoint;
     if (utf8_to_codepoint(key, len, &codepoint)) {
-      vterm_keyboard_unichar(term->vt, codepoint, modifier);
+      term_process_unichar(term, codepoint, modifier);
     }
   }
 }
 
+/* Modifier bits of character events, see `event-modifiers' */
+#define EVENT_CHAR_MASK ((1 << 22) - 1)
+#define EVENT_ALT (1 << 22)
+#define EVENT_SUPER (1 << 23)
+#define EVENT_HYPER (1 << 24)
+#define EVENT_SHIFT (1 << 25)
+#define EVENT_CTRL (1 << 26)
+#define EVENT_META (1 << 27)
+
+/* C in lower case, or in upper case if UPPER; only non-ASCII calls Lisp */
+static uint32_t event_case(emacs_env *env, uint32_t c, bool upper) {
+  if (c < 0x80) {
+    if (upper)
+      return c >= 'a' && c <= 'z' ? c - 32 : c;
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+  }
+  emacs_value arg = env->make_integer(env, c);
+  emacs_value fun = upper ? Fupcase : Fdowncase;
+  return (uint32_t)env->extract_integer(env, env->funcall(env, fun, 1, &arg));
+}
+
+/* The character event EV as `vterm--translate-event-to-args' and
+ * vterm--update would send it. Returns false for events left to them. */
+static bool term_key_event_char(Term *term, emacs_env *env, intmax_t ev,
+                                VTermModifier modifier) {
+  if (ev < 0 || ev & (EVENT_ALT | EVENT_SUPER | EVENT_HYPER))
+    return false;
+  uint32_t base = ev & EVENT_CHAR_MASK;
+  if ((base >= 0x80 && base < 0xA0) || base > 0x10FFFF)
+    return false;
+
+  if (ev & EVENT_META)
+    modifier |= VTERM_MOD_ALT;
+  if ((ev & EVENT_CTRL) || base < 32)
+    modifier |= VTERM_MOD_CTRL;
+  if ((ev & EVENT_SHIFT) || base != event_case(env, base, false))
+    modifier |= VTERM_MOD_SHIFT;
+
+  uint32_t basic = event_case(env, base < 32 ? base | 64 : base, false);
+  if (basic == 127) // "DEL", which is not a key vterm--update knows
+    return true;
+  if (modifier == VTERM_MOD_SHIFT)
+    basic = event_case(env, basic, true);
+
+  term_process_unichar(term, basic, modifier);
+  return true;
+}
+
+/* A function key event symbol such as `up' or `C-M-prior' */
+static bool term_key_event_symbol(Term *term, emacs_env *env, emacs_value ev,
+                                  VTermModifier modifier) {
+  emacs_value name = env->funcall(env, Fsymbol_name, 1, &ev);
+  ptrdiff_t len = string_bytes(env, name);
+  if (len > 32)
+    return false;
+  unsigned char buf[32];
+  env->copy_string_contents(env, name, (char *)buf, &len);
+
+  unsigned char *p = buf;
+  size_t n = len - 1;
+  while (n > 2 && p[1] == '-') {
+    if (p[0] == 'C')
+      modifier |= VTERM_MOD_CTRL;
+    else if (p[0] == 'M')
+      modifier |= VTERM_MOD_ALT;
+    else if (p[0] == 'S')
+      modifier |= VTERM_MOD_SHIFT;
+    else
+      return false;
+    p += 2;
+    n -= 2;
+  }
+
+  KeyEntry *entry = lookup_key_symbol(p, n);
+  if (!entry || entry->vterm_key == VTERM_KEY_NONE)
+    return false;
+  return term_process_key_entry(term, env, entry, modifier);
+}
+
 void term_finalize(void *object) {
   Term *term = (Term *)object;
   // Iterate over circular buffer using head/tail pointers
   size_t idx = term->sb_head;
-  for (size_t i = 0; i < term->sb_current; i++) {
+  for (size_t i = 0; i < term->sb_current && !term->sb_pool; i++) {
     if (term->sb_buffer[idx] != NULL) {
       /* ScrollbackLine is malloc'd (individually recycled) */
-      free(term->sb_buffer[idx]);
+      tracked_free(&term->mem, term->sb_buffer[idx]);
     }
     idx = (idx + 1) % term->sb_size;
   }
+  /* pooled rows go with the pool */
+  arena_destroy(term->sb_pool);
   if (term->title) {
-    free(term->title);
+    tracked_free(&term->mem, term->title);
     term->title = NULL;
   }
 
-  /* directory is arena-allocated - freed in bulk by arena_destroy */
+  tracked_free(&term->mem, term->directory);
+  term->directory = NULL;
+  linemeta_free(&term->meta);
+  tokidx_free(&term->tokens);
+  tracked_free(&term->mem, term->token_text);
+  tracked_free(&term->mem, term->feed.lines);
+  tracked_free(&term->mem, term->feed.text);
+  tracked_free(&term->mem, term->feed.runs);
 
-  /* elisp_code nodes are arena-allocated - freed in bulk by arena_destroy */
+  while (term->elisp_code_first) {
+    ElispCodeListNode *node = term->elisp_code_first;
+    term->elisp_code_first = node->next;
+    tracked_free(&term->mem, node);
+  }
+  strset_free(&term->eval_cmds);
+  expect_free(&term->expect);
 
   if (term->cmd_buffer) {
-    free(term->cmd_buffer);
+    tracked_free(&term->mem, term->cmd_buffer);
     term->cmd_buffer = NULL;
   }
   if (term->selection_data) {
-    free(term->selection_data);
+    tracked_free(&term->mem, term->selection_data);
     term->selection_data = NULL;
   }
 
-  /* lines[] and LineInfo entries are arena-allocated */
-
   if (term->pty_fd > 0) {
     close(term->pty_fd);
   }
 
-  /* sb_buffer array and lines[] are arena-allocated */
+  /* sb_buffer array is arena-allocated */
+  /* libvterm frees through term->mem, so it must go before the report */
   vterm_free(term->vt);
 
-  /* Destroy arena allocators (frees all allocated memory in bulk - O(1)) */
-  arena_destroy(term->persistent_arena);
-  arena_destroy(term->temp_arena);
-
 #ifdef VTERM_PROFILE
   profile_print_stats();
+  profile_print_memory(term);
 #endif
 
+  /* Destroy arena allocators (frees all allocated memory in bulk - O(1)) */
+  arena_destroy(term->persistent_arena);
+  arena_destroy(term->temp_arena);
+
   free(term);
 }
 
+/* Whitespace as seen by `split-string-and-unquote' in a vterm buffer */
+VTERM_INLINE bool is_eval_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+         c == '\v';
+}
+
+/* Split a 51;E payload the way `split-string-and-unquote' does: words are
+ * separated by whitespace, and a double-quoted word is read as a Lisp
+ * string. The words are written to OUT, which must hold strlen(IN) + 1
+ * bytes, each followed by a NUL; *OUT_LEN receives the bytes written.
+ * Returns the number of words, or -1 for an unterminated string or an
+ * escape that only the Lisp reader handles (\x, \u, \C-, ...). */
+static int split_eval_command(const char *in, char *out, size_t *out_len) {
+  const char *p = in;
+  char *o = out;
+  int argc = 0;
+
+  while (*p) {
+    if (is_eval_space(*p)) {
+      p++;
+      continue;
+    }
+    if (*p != '"') {
+      while (*p && !is_eval_space(*p) && *p != '"') {
+        *o++ = *p++;
+      }
+    } else {
+      p++;
+      while (*p != '"') {
+        char c = *p++;
+        if (c == '\0') {
+          return -1;
+        }
+        if (c == '\\') {
+          c = *p++;
+          switch (c) {
+          case 'n':
+            c = '\n';
+            break;
+          case 't':
+            c = '\t';
+            break;
+          case 'r':
+            c = '\r';
+            break;
+          case 'f':
+            c = '\f';
+            break;
+          case 'v':
+            c = '\v';
+            break;
+          case 'a':
+            c = '\a';
+            break;
+          case 'b':
+            c = '\b';
+            break;
+          case 'e':
+            c = 27;
+            break;
+          case 'd':
+            c = 127;
+            break;
+          case 's':
+            c = ' ';
+            break;
+          case '\n':
+          case ' ':
+            /* escaped newline and space are ignored */
+            continue;
+          case '0':
+          case '1':
+          case '2':
+          case '3':
+          case '4':
+          case '5':
+          case '6':
+          case '7': {
+            int value = c - '0';
+            for (int i = 0; i < 2 && *p >= '0' && *p <= '7'; i++) {
+              value = value * 8 + (*p++ - '0');
+            }
+            if (value == 0 || value > 127) {
+              return -1;
+            }
+            c = (char)value;
+            break;
+          }
+          case '\0':
+          case 'x':
+          case 'u':
+          case 'U':
+          case 'N':
+          case 'C':
+          case 'M':
+          case 'S':
+          case 'H':
+          case 'A':
+          case '^':
+            return -1;
+          default:
+            break;
+          }
+        }
+        *o++ = c;
+      }
+      p++;
+    }
+    *o++ = '\0';
+    argc++;
+  }
+  *out_len = o - out;
+  return argc;
+}
+
 static int handle_osc_cmd_51(Term *term, char subCmd, char *buffer) {
   if (subCmd == 'A') {
     /* "51;A" sets the current directory */
     /* "51;A" has also the role of identifying the end of the prompt */
-    /* Old directory is arena-allocated - abandoned (freed in bulk) */
-    term->directory = arena_strdup(term->persistent_arena, buffer);
+    tracked_free(&term->mem, term->directory);
+    term->directory =
+        tracked_strndup(&term->mem, MEM_TAG_STRINGS, buffer, strlen(buffer));
     term->directory_changed = true;
 
-    for (int i = term->cursor.row; i < term->lines_len; i++) {
-      if (term->lines[i] == NULL) {
-        term->lines[i] = alloc_lineinfo_for_term(term);
-      }
-
-      /* Old directory is arena-allocated - abandoned (freed in bulk) */
-      term->lines[i]->directory = arena_strdup(term->persistent_arena, buffer);
-      if (i == term->cursor.row) {
-        term->lines[i]->prompt_col = term->cursor.col;
-      } else {
-        term->lines[i]->prompt_col = -1;
-      }
-    }
+    /* the directory holds from the cursor row down, the prompt ends at the
+     * cursor column */
+    linemeta_set(&term->meta, row_to_abs_line(term, term->cursor.row), buffer,
+                 term->cursor.col);
     return 1;
   } else if (subCmd == 'E') {
     /* "51;E" executes elisp code */
     /* The elisp code is executed in term_redraw */
-    ElispCodeListNode *node = (ElispCodeListNode *)arena_alloc(
-        term->persistent_arena, sizeof(ElispCodeListNode));
-    node->code_len = strlen(buffer);
-    node->code = arena_strdup(term->persistent_arena, buffer);
+    size_t len = strlen(buffer);
+    /* node and code in one block, freed once delivered; the words never
+     * take more room than the payload */
+    ElispCodeListNode *node = tracked_malloc(
+        &term->mem, MEM_TAG_STRINGS, sizeof(ElispCodeListNode) + len + 1);
+    if (!node) {
+      return 1;
+    }
+    node->code = (char *)(node + 1);
     node->next = NULL;
+    node->argc = split_eval_command(buffer, node->code, &node->code_len);
+    if (node->argc <= 0) {
+      node->argc = 0;
+      node->code_len = len;
+      memcpy(node->code, buffer, len + 1);
+    } else if (term->eval_cmds_synced &&
+               !strset_contains(&term->eval_cmds, node->code,
+                                strlen(node->code))) {
+      /* not allowed: only the name goes to Lisp, which reports it */
+      node->argc = 1;
+      node->code_len = strlen(node->code) + 1;
+    }
 
     *(term->elisp_code_p_insert) = node;
     term->elisp_code_p_insert = &(node->next);
@@ -1663,7 +2508,7 @@ static int osc_callback(int cmd, VTermStringFragment frag, void *user) {
   if (frag.initial) {
     /* drop old fragment,because this is a initial fragment */
     if (term->cmd_buffer) {
-      free(term->cmd_buffer);
+      tracked_free(&term->mem, term->cmd_buffer);
       term->cmd_buffer = NULL;
     }
   }
@@ -1677,9 +2522,11 @@ static int osc_callback(int cmd, VTermStringFragment frag, void *user) {
     return 0;
   }
 
+  term->cmd_buffer = concat(term, term->cmd_buffer, frag.str, frag.len, true);
+
   if (frag.final) {
     handle_osc_cmd(term, cmd, term->cmd_buffer);
-    free(term->cmd_buffer);
+    tracked_free(&term->mem, term->cmd_buffer);
     term->cmd_buffer = NULL;
   }
   return 0;
@@ -1698,14 +2545,14 @@ static int set_selection(VTermSelectionMask mask, VTermStringFragment frag,
   if (frag.initial) {
     term->selection_mask = mask;
     if (term->selection_data) {
-      free(term->selection_data);
+      tracked_free(&term->mem, term->selection_data);
     }
     term->selection_data = NULL;
   }
 
   if (frag.len) {
     term->selection_data =
-        concat(term->selection_data, frag.str, frag.len, true);
+        concat(term, term->selection_data, frag.str, frag.len, true);
   }
   return 1;
 }
@@ -1727,6 +2574,14 @@ static VTermSelectionCallbacks selection_callbacks = {
 emacs_value Fvterm_new(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
                        void *data) {
   Term *term = malloc(sizeof(Term));
+  memset(&term->mem, 0, sizeof(term->mem));
+  term->top_line = 0;
+  term->buffer_top_line = 0;
+  linemeta_init(&term->meta, &term->mem);
+  tokidx_init(&term->tokens, &term->mem);
+  term->tokens_enabled = false;
+  term->token_text = NULL;
+  term->token_text_cap = 0;
 
   /* Initialize arena allocators early so subsequent allocations can use them */
   term->persistent_arena = arena_create(65536); /* 64KB for long-lived data */
@@ -1742,13 +2597,29 @@ emacs_value Fvterm_new(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
   int ignore_blink_cursor = env->is_not_nil(env, args[6]);
   int set_bold_highbright = env->is_not_nil(env, args[7]);
   int ignore_cursor_change = env->is_not_nil(env, args[8]);
+  int lazy_faces = nargs > 9 && env->is_not_nil(env, args[9]);
 
-  term->vt = vterm_new(rows, cols);
+  /* scrollback rows in huge pages, see vterm-scrollback-huge-pages */
+  term->sb_pool = NULL;
+  term->sb_pool_flags = 0;
+  term->sb_free_rows = NULL;
+  if (nargs > 10 && env->is_not_nil(env, args[10])) {
+    term->sb_pool_flags = ARENA_HUGE_PAGES;
+    if (env->eq(env, args[10], env->intern(env, "prefault")))
+      term->sb_pool_flags |= ARENA_PREFAULT;
+    term->sb_pool = arena_create_large(SB_POOL_BLOCK, term->sb_pool_flags);
+  }
+
+  term->vt =
+      vterm_new_with_allocator(rows, cols, &term_vterm_allocator, &term->mem);
   vterm_set_utf8(term->vt, 1);
 
   term->vts = vterm_obtain_screen(term->vt);
 
   term->queued_bell = false;
+  term->utf8_held_len = 0;
+  term->parse_us = 0;
+  term->render_us = 0;
 
   VTermState *state = vterm_obtain_state(term->vt);
   vterm_state_set_unrecognised_fallbacks(state, &parser_callbacks, term);
@@ -1775,6 +2646,12 @@ emacs_value Fvterm_new(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
   term->invalid_start = 0;
   term->invalid_end = rows;
   term->is_invalidated = false;
+  term->scroll_invalid_start = 0;
+  term->scroll_shift = 0;
+  term->scroll_pure = true;
+  term->sb_pushed = 0;
+  term->sb_reused = 0;
+  term->sb_reuse_broken = false;
   term->width = cols;
   term->height = rows;
   term->height_resize = 0;
@@ -1783,6 +2660,7 @@ emacs_value Fvterm_new(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
   term->disable_inverse_video = disable_inverse_video;
   term->ignore_blink_cursor = ignore_blink_cursor;
   term->ignore_cursor_change = ignore_cursor_change;
+  term->lazy_faces = lazy_faces;
   emacs_value newline = env->make_string(env, "\n", 1);
   for (int i = 0; i < term->height; i++) {
     insert(env, newline);
@@ -1803,11 +2681,18 @@ emacs_value Fvterm_new(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
   term->cursor.cursor_type_changed = false;
   term->cursor.cursor_blink = false;
   term->cursor.cursor_blink_changed = false;
+  term->cursor.type_sent = CURSOR_UNSENT;
+  term->cursor.blink_sent = -1;
   term->follow_terminal_cursor = true;
   term->directory = NULL;
   term->directory_changed = false;
   term->elisp_code_first = NULL;
   term->elisp_code_p_insert = &term->elisp_code_first;
+  strset_init(&term->eval_cmds, &term->mem);
+  term->eval_cmds_synced = false;
+  expect_init(&term->expect, &term->mem);
+  memset(&term->feed, 0, sizeof(term->feed));
+  term->altscreen = false;
   term->selection_data = NULL;
   term->selection_mask = 0;
 
@@ -1817,9 +2702,9 @@ emacs_value Fvterm_new(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
   term->conpty = NULL;
 #endif
 
-  term->lines = (LineInfo **)arena_calloc(term->persistent_arena, rows,
-                                          sizeof(LineInfo *));
-  term->lines_len = rows;
+  term->row_fp = (uint64_t *)arena_calloc(term->persistent_arena, rows,
+                                          sizeof(uint64_t));
+  term->row_fp_len = rows;
 
   return env->make_user_ptr(env, term_finalize, term);
 }
@@ -1854,6 +2739,30 @@ emacs_value Fvterm_update(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
   return env->make_integer(env, 0);
 }
 
+emacs_value Fvterm_key_event(emacs_env *env, ptrdiff_t nargs,
+                             emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  VTermModifier modifier = VTERM_MOD_NONE;
+  if (nargs > 2 && env->is_not_nil(env, args[2]))
+    modifier = VTERM_MOD_ALT;
+
+  emacs_value type = env->type_of(env, args[1]);
+  bool sent = false;
+  if (env->eq(env, type, Qinteger))
+    sent = term_key_event_char(term, env, env->extract_integer(env, args[1]),
+                               modifier);
+  else if (env->eq(env, type, Qsymbol))
+    sent = term_key_event_symbol(term, env, args[1], modifier);
+  if (!sent)
+    return Qnil;
+
+  term_flush_output(term, env);
+  if (term->is_invalidated) {
+    vterm_invalidate(env);
+  }
+  return Qt;
+}
+
 emacs_value Fvterm_redraw(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
                           void *data) {
   Term *term = env->get_user_ptr(env, args[0]);
@@ -1871,12 +2780,26 @@ emacs_value Fvterm_write_input(emacs_env *env, ptrdiff_t nargs,
   Term *term = env->get_user_ptr(env, args[0]);
   ptrdiff_t len = string_bytes(env, args[1]);
 
-  if (len > 0) {
-    char bytes[len];
-    env->copy_string_contents(env, args[1], bytes, &len);
-
-    vterm_input_write(term->vt, bytes, len - 1);
-    vterm_screen_flush_damage(term->vts);
+  if (len > 1) {
+    // The process output is read with the `binary' coding system, so the
+    // string is unibyte and its bytes are copied through unchanged.
+    size_t held = term->utf8_held_len;
+    char bytes[held + len];
+    memcpy(bytes, term->utf8_held, held);
+    env->copy_string_contents(env, args[1], bytes + held, &len);
+
+    size_t n = held + len - 1;
+    size_t complete = utf8_complete_prefix((unsigned char *)bytes, n);
+    term->utf8_held_len = n - complete;
+    memcpy(term->utf8_held, bytes + complete, n - complete);
+
+    if (complete > 0) {
+      uint64_t start = monotonic_us();
+      expect_feed(&term->expect, bytes, complete);
+      vterm_input_write(term->vt, bytes, complete);
+      vterm_screen_flush_damage(term->vts);
+      term->parse_us += monotonic_us() - start;
+    }
   }
 
   return env->make_integer(env, 0);
@@ -1916,6 +2839,594 @@ emacs_value Fvterm_mouse_mode(emacs_env *env, ptrdiff_t nargs,
   return env->make_integer(env, term->mouse_mode);
 }
 
+/* (PARSE-US RENDER-US) */
+emacs_value Fvterm_cpu_time(emacs_env *env, ptrdiff_t nargs,
+                            emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  return list(env,
+              (emacs_value[]){env->make_integer(env, (intmax_t)term->parse_us),
+                              env->make_integer(env, (intmax_t)term->render_us)},
+              2);
+}
+
+/* (:TAG (LIVE-BYTES LIVE-OBJECTS PEAK-BYTES TOTAL-ALLOCS) ...) */
+emacs_value Fvterm_memory_stats(emacs_env *env, ptrdiff_t nargs,
+                                emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  emacs_value plist[2 * (MEM_TAG_COUNT + 4)];
+  int n = 0;
+  char key[32];
+
+  for (int i = 0; i < MEM_TAG_COUNT; i++) {
+    MemTagStats *t = &term->mem.tags[i];
+    snprintf(key, sizeof(key), ":%s", mem_tag_name(i));
+    plist[n++] = env->intern(env, key);
+    plist[n++] = list(env,
+                      (emacs_value[]){
+                          env->make_integer(env, (intmax_t)t->live_bytes),
+                          env->make_integer(env, (intmax_t)t->live_objects),
+                          env->make_integer(env, (intmax_t)t->peak_bytes),
+                          env->make_integer(env, (intmax_t)t->total_allocs)},
+                      4);
+  }
+
+  /* Arenas: (USED RESERVED PEAK-USED BLOCKS) */
+  arena_allocator_t *arenas[2] = {term->persistent_arena, term->temp_arena};
+  const char *arena_keys[2] = {":persistent-arena", ":temp-arena"};
+  for (int i = 0; i < 2; i++) {
+    plist[n++] = env->intern(env, arena_keys[i]);
+    plist[n++] = list(
+        env,
+        (emacs_value[]){
+            env->make_integer(env, (intmax_t)arena_used(arenas[i])),
+            env->make_integer(env, (intmax_t)arenas[i]->reserved_bytes),
+            env->make_integer(env, (intmax_t)arenas[i]->peak_used),
+            env->make_integer(env, (intmax_t)arenas[i]->block_count)},
+        4);
+  }
+
+  /* Scrollback pool: (USED RESERVED RESIDENT HUGE) */
+  if (term->sb_pool) {
+    ArenaPages pages;
+    arena_pages(term->sb_pool, &pages);
+    plist[n++] = env->intern(env, ":scrollback-pool");
+    plist[n++] = list(
+        env,
+        (emacs_value[]){
+            env->make_integer(env, (intmax_t)arena_used(term->sb_pool)),
+            env->make_integer(env, (intmax_t)pages.reserved),
+            env->make_integer(env, (intmax_t)pages.resident),
+            env->make_integer(env, (intmax_t)pages.huge)},
+        4);
+  }
+
+  /* Heap total: (LIVE-BYTES PEAK-BYTES) */
+  plist[n++] = env->intern(env, ":total");
+  plist[n++] = list(
+      env,
+      (emacs_value[]){env->make_integer(env, (intmax_t)term->mem.live_bytes),
+                      env->make_integer(env, (intmax_t)term->mem.peak_bytes)},
+      2);
+
+  return list(env, plist, n);
+}
+
+/* Row drawn on the buffer line FROM_END lines before the end of the buffer
+ * (1 is the last line), skipping rows pushed since the last redraw, which
+ * are not in the buffer yet. INT_MAX if the line shows no row. */
+static int buffer_line_to_row(Term *term, int from_end) {
+  if (from_end < 1) {
+    return INT_MAX;
+  }
+  if (from_end <= term->height) {
+    return term->height - from_end;
+  }
+  int idx = from_end - term->height - 1 + term->sb_pending;
+  if (idx >= (int)term->sb_current) {
+    return INT_MAX;
+  }
+  return -idx - 1;
+}
+
+/* (START END FACE ...) for ROW, offsets in characters from the start of its
+ * line. Runs split like refresh_lines splits segments, and the newline
+ * ending a short row belongs to the last run. */
+static emacs_value row_face_runs(emacs_env *env, Term *term, int row) {
+  emacs_value *runs =
+      arena_alloc(term->temp_arena, sizeof(emacs_value) * 3 * (term->width + 1));
+  int n = 0;
+  int start = 0, offset = 0;
+  VTermScreenCell cell, run_cell;
+  fetch_cell(term, row, 0, &run_cell);
+
+  for (int j = 0; j < term->width; j++) {
+    fetch_cell(term, row, j, &cell);
+    if (!fast_compare_cells(&cell, &run_cell)) {
+      if (offset > start) {
+        runs[n++] = env->make_integer(env, start);
+        runs[n++] = env->make_integer(env, offset);
+        runs[n++] = cell_face(env, term, &run_cell);
+      }
+      start = offset;
+      run_cell = cell;
+    }
+    if (cell.chars[0] == 0) {
+      offset++;
+      if (is_eol(term, term->width, row, j)) {
+        break;
+      }
+    } else {
+      for (int k = 0; k < VTERM_MAX_CHARS_PER_CELL && cell.chars[k]; ++k) {
+        offset++;
+      }
+    }
+    if (cell.width > 1) {
+      j += cell.width - 1;
+    }
+  }
+  if (offset > start) {
+    runs[n++] = env->make_integer(env, start);
+    runs[n++] = env->make_integer(env, offset);
+    runs[n++] = cell_face(env, term, &run_cell);
+  }
+  return list(env, runs, n);
+}
+
+/* (vterm--face-runs TERM FROM-END COUNT): one list of runs per buffer line,
+ * see row_face_runs; nil for lines that show no row */
+emacs_value Fvterm_face_runs(emacs_env *env, ptrdiff_t nargs,
+                             emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  int from_end = env->extract_integer(env, args[1]);
+  int count = env->extract_integer(env, args[2]);
+  if (count <= 0) {
+    return Qnil;
+  }
+
+  emacs_value *lines =
+      arena_alloc(term->temp_arena, sizeof(emacs_value) * count);
+  for (int i = 0; i < count; i++) {
+    int row = buffer_line_to_row(term, from_end - i);
+    lines[i] = row == INT_MAX ? Qnil : row_face_runs(env, term, row);
+  }
+  emacs_value result = list(env, lines, count);
+
+  arena_reset(term->temp_arena);
+  return result;
+}
+
+/* (vterm--line-id TERM FROM-END): id of the buffer line FROM-END lines
+ * before the end of the buffer (1 is the last line) as of the last redraw.
+ * A line keeps its id while it scrolls into the scrollback and out of the
+ * buffer, and the ids of scrolled lines are never reused, so they can key
+ * caches of lines. A screen row rewritten in place keeps its id. */
+emacs_value Fvterm_line_id(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
+                           void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  int64_t from_end = env->extract_integer(env, args[1]);
+  if (from_end < 1 || from_end > term->linenum) {
+    return Qnil;
+  }
+  return env->make_integer(env, term->buffer_top_line + term->linenum -
+                                    from_end);
+}
+
+/* (vterm--line-id-from-end TERM ID): inverse of vterm--line-id, nil if the
+ * line with ID has left the buffer or is not drawn yet */
+emacs_value Fvterm_line_id_from_end(emacs_env *env, ptrdiff_t nargs,
+                                    emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  int64_t id = env->extract_integer(env, args[1]);
+  int64_t from_end = term->buffer_top_line + term->linenum - id;
+  if (from_end < 1 || from_end > term->linenum) {
+    return Qnil;
+  }
+  return env->make_integer(env, from_end);
+}
+
+/* (vterm--line-ids TERM): ids of the oldest scrollback line, of the first
+ * screen row and of the last one, as (OLDEST TOP LAST). Unlike those of
+ * vterm--line-id they include output not redrawn yet. */
+emacs_value Fvterm_line_ids(emacs_env *env, ptrdiff_t nargs,
+                            emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  return list(
+      env,
+      (emacs_value[]){
+          env->make_integer(env, row_to_abs_line(term, -(int)term->sb_current)),
+          env->make_integer(env, row_to_abs_line(term, 0)),
+          env->make_integer(env, row_to_abs_line(term, term->height - 1))},
+      3);
+}
+
+/* (vterm--feed-lines TERM MAX FACES): deliver up to MAX completed lines per
+ * redraw as the :lines event, with face runs if FACES; MAX nil or 0 stops.
+ * Lines printed before are not delivered. */
+emacs_value Fvterm_feed_lines(emacs_env *env, ptrdiff_t nargs,
+                              emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  LineFeed *feed = &term->feed;
+  int max = env->is_not_nil(env, args[1])
+                ? (int)MAX(env->extract_integer(env, args[1]), 0)
+                : 0;
+  if (max > 0 && feed->max == 0) {
+    int row = term->cursor.row;
+    while (row > 0 && row_wraps(term, row - 1))
+      row--;
+    feed->next = row_to_abs_line(term, row);
+  } else if (max == 0) {
+    feed->len = 0;
+    feed->text_len = 0;
+    feed->runs_len = 0;
+    feed->open = false;
+    feed->dropping = false;
+    feed->dropped = 0;
+  }
+  feed->max = max;
+  feed->faces = env->is_not_nil(env, args[2]);
+  return Qnil;
+}
+
+/* First row of a snapshot: the screen plus the last SCROLLBACK rows of the
+ * scrollback, read from libvterm and sb_buffer rather than the buffer */
+static int snapshot_first_row(Term *term, emacs_env *env, ptrdiff_t nargs,
+                              emacs_value args[]) {
+  int scrollback = 0;
+  if (nargs > 1 && env->is_not_nil(env, args[1])) {
+    scrollback = env->extract_integer(env, args[1]);
+  }
+  return -MAX(0, MIN(scrollback, (int)term->sb_current));
+}
+
+/* Rows FIRST to the bottom of the screen as plain text in the temp arena,
+ * one line per row without trailing blanks, joined by newlines; return its
+ * length */
+static size_t screen_text(Term *term, int first, char **text) {
+  int width = term->width;
+  size_t row_bytes = (size_t)width * VTERM_MAX_CHARS_PER_CELL * 4 + 1;
+  char *buffer = arena_alloc(term->temp_arena,
+                             row_bytes * (term->height - first) + 1);
+  size_t length = 0;
+  VTermScreenCell *cells =
+      arena_alloc(term->temp_arena, sizeof(VTermScreenCell) * width);
+
+  for (int row = first; row < term->height; row++) {
+    if (row > first) {
+      buffer[length++] = '\n';
+    }
+    for (int col = 0; col < width; col++) {
+      fetch_cell(term, row, col, &cells[col]);
+    }
+    length += row_text(cells, width, buffer + length, NULL);
+  }
+  *text = buffer;
+  return length;
+}
+
+/* (vterm--screen-text TERM &optional SCROLLBACK): the rows as plain text,
+ * one line per row without trailing blanks, joined by newlines */
+emacs_value Fvterm_screen_text(emacs_env *env, ptrdiff_t nargs,
+                               emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  char *buffer;
+  size_t length =
+      screen_text(term, snapshot_first_row(term, env, nargs, args), &buffer);
+  emacs_value text = env->make_string(env, buffer, length);
+
+  arena_reset(term->temp_arena);
+  return text;
+}
+
+/* Color of a snapshot cell: 2 bits of kind (0 default, 1 palette index,
+ * 2 RGB) above 24 bits of index or 0xRRGGBB */
+VTERM_INLINE uint64_t snapshot_color(const VTermColor *color, bool is_fg) {
+  if (is_fg ? VTERM_COLOR_IS_DEFAULT_FG(color)
+            : VTERM_COLOR_IS_DEFAULT_BG(color)) {
+    return 0;
+  }
+  if (VTERM_COLOR_IS_INDEXED(color)) {
+    return (1ull << 24) | color->indexed.idx;
+  }
+  return (2ull << 24) | ((uint64_t)color->rgb.red << 16) |
+         ((uint64_t)color->rgb.green << 8) | color->rgb.blue;
+}
+
+/* A snapshot cell packed in a fixnum: attribute bits 0-7 (bold, underline,
+ * italic, blink, reverse, strike, conceal, wide), foreground at bit 8 and
+ * background at bit 34, see snapshot_color */
+VTERM_INLINE int64_t snapshot_cell(const VTermScreenCell *cell) {
+  uint64_t attrs = (cell->attrs.bold ? 1 : 0) |
+                   (cell->attrs.underline ? 2 : 0) |
+                   (cell->attrs.italic ? 4 : 0) | (cell->attrs.blink ? 8 : 0) |
+                   (cell->attrs.reverse ? 16 : 0) |
+                   (cell->attrs.strike ? 32 : 0) |
+                   (cell->attrs.conceal ? 64 : 0) | (cell->width > 1 ? 128 : 0);
+  return (int64_t)(attrs | snapshot_color(&cell->fg, true) << 8 |
+                   snapshot_color(&cell->bg, false) << 34);
+}
+
+/* (vterm--screen-cells TERM &optional SCROLLBACK): a vector of rows, each a
+ * vector with one packed cell per column (see snapshot_cell); both columns
+ * of a wide character hold its cell */
+emacs_value Fvterm_screen_cells(emacs_env *env, ptrdiff_t nargs,
+                                emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  int first = snapshot_first_row(term, env, nargs, args);
+  int width = term->width;
+  int rows = term->height - first;
+  emacs_value *lines = arena_alloc(term->temp_arena, sizeof(emacs_value) * rows);
+  emacs_value *cells = arena_alloc(term->temp_arena, sizeof(emacs_value) * width);
+  VTermScreenCell cell;
+
+  for (int row = first; row < term->height; row++) {
+    for (int col = 0; col < width;) {
+      fetch_cell(term, row, col, &cell);
+      emacs_value value = env->make_integer(env, snapshot_cell(&cell));
+      int span = MIN(MAX(cell.width, 1), width - col);
+      for (int k = 0; k < span; k++) {
+        cells[col++] = value;
+      }
+    }
+    lines[row - first] = vector(env, cells, width);
+  }
+  emacs_value result = vector(env, lines, rows);
+
+  arena_reset(term->temp_arena);
+  return result;
+}
+
+/* Add TOKEN to the LEN strings of FOUND unless it is there */
+static size_t add_completion(const char **found, uint32_t *found_len,
+                             size_t len, const char *token,
+                             uint32_t token_len) {
+  for (size_t i = 0; i < len; i++) {
+    if (found_len[i] == token_len && !memcmp(found[i], token, token_len))
+      return len;
+  }
+  found[len] = token;
+  found_len[len] = token_len;
+  return len + 1;
+}
+
+/* (vterm--complete-token TERM PREFIX &optional MAX): up to MAX (default 64)
+ * tokens printed in TERM that extend PREFIX, newest first: those on the
+ * screen from the bottom up, then those of the scrollback by the newest line
+ * they are on. The scrollback is indexed from the first call on. */
+emacs_value Fvterm_complete_token(emacs_env *env, ptrdiff_t nargs,
+                                  emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  size_t max = 64;
+  if (nargs > 2 && env->is_not_nil(env, args[2]))
+    max = (size_t)MAX(env->extract_integer(env, args[2]), 1);
+
+  if (!term->tokens_enabled) {
+    term->tokens_enabled = true;
+    for (size_t i = term->sb_current; i > 0; i--) {
+      index_sb_row(term, get_scrollback_line(term, i - 1),
+                   term->top_line - (int64_t)i, true);
+    }
+  }
+
+  ptrdiff_t prefix_len = string_bytes(env, args[1]);
+  char *prefix = arena_alloc(term->temp_arena, prefix_len);
+  env->copy_string_contents(env, args[1], prefix, &prefix_len);
+  prefix_len--; /* without the final zero byte */
+
+  const char **found = arena_alloc(term->temp_arena, sizeof(char *) * max);
+  uint32_t *found_len = arena_alloc(term->temp_arena, sizeof(uint32_t) * max);
+  size_t count = 0;
+
+  /* Screen rows, copied since token_text is reused row after row */
+  VTermScreenCell *cells =
+      arena_alloc(term->temp_arena, sizeof(VTermScreenCell) * term->width);
+  for (int row = term->height - 1; row >= 0 && count < max && prefix_len;
+       row--) {
+    for (int col = 0; col < term->width; col++) {
+      fetch_cell(term, row, col, &cells[col]);
+    }
+    size_t len = cells_token_text(term, cells, term->width);
+    char *text = arena_alloc(term->temp_arena, len);
+    memcpy(text, term->token_text, len);
+    size_t start, end = 0;
+    while (count < max && tokidx_next_token(text, len, &start, &end)) {
+      if (end - start > (size_t)prefix_len &&
+          !memcmp(text + start, prefix, prefix_len)) {
+        count = add_completion(found, found_len, count, text + start,
+                               (uint32_t)(end - start));
+      }
+    }
+  }
+
+  const TokenEntry **entries =
+      arena_alloc(term->temp_arena, sizeof(TokenEntry *) * max);
+  size_t entry_count =
+      tokidx_complete(&term->tokens, prefix, prefix_len, entries, max);
+  for (size_t i = 0; i < entry_count && count < max; i++) {
+    count = add_completion(found, found_len, count, entries[i]->str,
+                           entries[i]->len);
+  }
+
+  emacs_value *strings =
+      arena_alloc(term->temp_arena, sizeof(emacs_value) * (count + 1));
+  for (size_t i = 0; i < count; i++) {
+    strings[i] = env->make_string(env, found[i], found_len[i]);
+  }
+  emacs_value result = list(env, strings, count);
+
+  arena_reset(term->temp_arena);
+  return result;
+}
+
+/* Append the SGR sequence switching from the attributes and colors of
+ * FROM to those of CELL; FROM NULL means the default rendition */
+static void export_sgr(FILE *file, const VTermScreenCell *from,
+                       const VTermScreenCell *cell) {
+  if (from && fast_compare_cells((VTermScreenCell *)from,
+                                 (VTermScreenCell *)cell) &&
+      from->attrs.blink == cell->attrs.blink &&
+      from->attrs.conceal == cell->attrs.conceal) {
+    return;
+  }
+  fputs("\x1b[0", file);
+  if (cell->attrs.bold)
+    fputs(";1", file);
+  if (cell->attrs.italic)
+    fputs(";3", file);
+  if (cell->attrs.underline)
+    fputs(";4", file);
+  if (cell->attrs.blink)
+    fputs(";5", file);
+  if (cell->attrs.reverse)
+    fputs(";7", file);
+  if (cell->attrs.conceal)
+    fputs(";8", file);
+  if (cell->attrs.strike)
+    fputs(";9", file);
+  for (int fg = 1; fg >= 0; fg--) {
+    const VTermColor *color = fg ? &cell->fg : &cell->bg;
+    if (fg ? VTERM_COLOR_IS_DEFAULT_FG(color)
+           : VTERM_COLOR_IS_DEFAULT_BG(color)) {
+      continue;
+    }
+    int base = fg ? 30 : 40;
+    if (VTERM_COLOR_IS_INDEXED(color)) {
+      uint8_t idx = color->indexed.idx;
+      if (idx < 8) {
+        fprintf(file, ";%d", base + idx);
+      } else if (idx < 16) {
+        fprintf(file, ";%d", base + 60 + idx - 8);
+      } else {
+        fprintf(file, ";%d;5;%d", base + 8, idx);
+      }
+    } else {
+      fprintf(file, ";%d;2;%d;%d;%d", base + 8, color->rgb.red,
+              color->rgb.green, color->rgb.blue);
+    }
+  }
+  fputc('m', file);
+}
+
+/* Write ROW to FILE without its trailing blanks. With ANSI, *LAST is the
+ * cell whose style is in effect if *STYLED, which holds across rows of a
+ * logical line. Returns true if the row is full, i.e. wraps into the next
+ * one like a fake newline in the buffer. */
+static bool export_row(Term *term, FILE *file, int row, bool ansi,
+                       VTermScreenCell *last, bool *styled) {
+  int cols = term->width;
+  if (row < 0) {
+    cols = (int)get_scrollback_line(term, (size_t)(-row - 1))->cols;
+  }
+  VTermScreenCell cells[cols + 1];
+  char text[(size_t)cols * VTERM_MAX_CHARS_PER_CELL * 4 + 1];
+  size_t ends[cols + 1];
+  for (int col = 0; col < cols; col++) {
+    fetch_cell(term, row, col, &cells[col]);
+  }
+  size_t length = row_text(cells, cols, text, ends);
+
+  int col = 0; /* after the last non-blank cell once done */
+  for (size_t start = 0; start < length; col += MAX(cells[col].width, 1)) {
+    if (ansi) {
+      export_sgr(file, *styled ? last : NULL, &cells[col]);
+      *styled = true;
+      *last = cells[col];
+    }
+    fwrite(text + start, 1, ends[col] - start, file);
+    start = ends[col];
+  }
+  return col >= cols;
+}
+
+/* (vterm--export-scrollback TERM FILE &optional FORMAT): write the
+ * scrollback and the screen to FILE, one logical line per line (rows joined
+ * where they wrapped), as plain text or, if FORMAT is `ansi', with SGR
+ * sequences. Returns the number of lines written, or nil on error. */
+emacs_value Fvterm_export_scrollback(emacs_env *env, ptrdiff_t nargs,
+                                     emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  ptrdiff_t len = string_bytes(env, args[1]);
+  char filename[len];
+  env->copy_string_contents(env, args[1], filename, &len);
+  bool ansi = nargs > 2 && env->eq(env, args[2], env->intern(env, "ansi"));
+
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    return Qnil;
+  }
+  char iobuf[1 << 16];
+  setvbuf(file, iobuf, _IOFBF, sizeof(iobuf));
+
+  long lines = 0;
+  VTermScreenCell last;
+  bool styled = false;
+  for (int row = -(int)term->sb_current; row < term->height; row++) {
+    bool wrapped = export_row(term, file, row, ansi, &last, &styled);
+    if (!wrapped || row == term->height - 1) {
+      if (styled) {
+        fputs("\x1b[0m", file);
+        styled = false;
+      }
+      fputc('\n', file);
+      lines++;
+    }
+  }
+
+  bool ok = !ferror(file);
+  ok = fclose(file) == 0 && ok;
+  return ok ? env->make_integer(env, lines) : Qnil;
+}
+
+/* (vterm--expect TERM STRING): wait for STRING in the output; returns
+ * (ID ON-SCREEN), ID being the waiter id reported under :expect once it
+ * matched, or nil. ON-SCREEN is t if STRING is on the screen already, so
+ * the next redraw reports it. */
+emacs_value Fvterm_expect(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
+                          void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  ptrdiff_t len = string_bytes(env, args[1]);
+  char pattern[len];
+  env->copy_string_contents(env, args[1], pattern, &len);
+
+  long id = expect_add(&term->expect, pattern, len - 1);
+  if (id < 0) {
+    return Qnil;
+  }
+  char *text;
+  size_t text_len = screen_text(term, 0, &text);
+  bool found = expect_search(&term->expect, id, text, text_len);
+  arena_reset(term->temp_arena);
+  return list(
+      env, (emacs_value[]){env->make_integer(env, id), found ? Qt : Qnil}, 2);
+}
+
+/* (vterm--expect-cancel TERM ID): t if the waiter ID was still pending */
+emacs_value Fvterm_expect_cancel(emacs_env *env, ptrdiff_t nargs,
+                                 emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  long id = env->extract_integer(env, args[1]);
+  return expect_cancel(&term->expect, id) ? Qt : Qnil;
+}
+
+/* (vterm--set-eval-cmds TERM NAMES): mirror the command names of
+ * `vterm-eval-cmds', a list of strings */
+emacs_value Fvterm_set_eval_cmds(emacs_env *env, ptrdiff_t nargs,
+                                 emacs_value args[], void *data) {
+  Term *term = env->get_user_ptr(env, args[0]);
+  int count = env->extract_integer(env, length(env, args[1]));
+
+  strset_clear(&term->eval_cmds);
+  for (int i = 0; i < count; i++) {
+    emacs_value name = nth(env, i, args[1]);
+    ptrdiff_t len = string_bytes(env, name);
+    char bytes[len];
+    env->copy_string_contents(env, name, bytes, &len);
+    strset_add(&term->eval_cmds, bytes, len - 1);
+  }
+  term->eval_cmds_synced = true;
+
+  return Qnil;
+}
+
 emacs_value Fvterm_set_size(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
                             void *data) {
   Term *term = env->get_user_ptr(env, args[0]);
@@ -1964,7 +3475,7 @@ emacs_value Fvterm_get_pwd(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
   Term *term = env->get_user_ptr(env, args[0]);
   int linenum = env->extract_integer(env, args[1]);
   int row = linenr_to_row(term, linenum);
-  char *dir = get_row_directory(term, row);
+  const char *dir = get_row_directory(term, row);
 
   return dir ? env->make_string(env, dir, strlen(dir)) : Qnil;
 }
@@ -2047,19 +3558,31 @@ int emacs_module_init(struct emacs_runtime *ert) {
   Qbox = env->make_global_ref(env, env->intern(env, "box"));
   Qbar = env->make_global_ref(env, env->intern(env, "bar"));
   Qhbar = env->make_global_ref(env, env->intern(env, "hbar"));
-  Qcursor_type = env->make_global_ref(env, env->intern(env, "cursor-type"));
+  Qk_title = env->make_global_ref(env, env->intern(env, ":title"));
+  Qk_directory = env->make_global_ref(env, env->intern(env, ":directory"));
+  Qk_cursor_type = env->make_global_ref(env, env->intern(env, ":cursor-type"));
+  Qk_cursor_blink =
+      env->make_global_ref(env, env->intern(env, ":cursor-blink"));
+  Qk_bell = env->make_global_ref(env, env->intern(env, ":bell"));
+  Qk_eval = env->make_global_ref(env, env->intern(env, ":eval"));
+  Qk_selection = env->make_global_ref(env, env->intern(env, ":selection"));
+  Qk_expect = env->make_global_ref(env, env->intern(env, ":expect"));
+  Qk_lines = env->make_global_ref(env, env->intern(env, ":lines"));
+  Qinteger = env->make_global_ref(env, env->intern(env, "integer"));
+  Qsymbol = env->make_global_ref(env, env->intern(env, "symbol"));
 
   // Functions
   Fapply = env->make_global_ref(env, env->intern(env, "apply"));
-  Fblink_cursor_mode =
-      env->make_global_ref(env, env->intern(env, "blink-cursor-mode"));
   Fsymbol_value = env->make_global_ref(env, env->intern(env, "symbol-value"));
   Flength = env->make_global_ref(env, env->intern(env, "length"));
   Flist = env->make_global_ref(env, env->intern(env, "list"));
+  Fvector = env->make_global_ref(env, env->intern(env, "vector"));
+  Fsymbol_name = env->make_global_ref(env, env->intern(env, "symbol-name"));
+  Fdowncase = env->make_global_ref(env, env->intern(env, "downcase"));
+  Fupcase = env->make_global_ref(env, env->intern(env, "upcase"));
   Fnth = env->make_global_ref(env, env->intern(env, "nth"));
   Ferase_buffer = env->make_global_ref(env, env->intern(env, "erase-buffer"));
   Finsert = env->make_global_ref(env, env->intern(env, "vterm--insert"));
-  Fding = env->make_global_ref(env, env->intern(env, "ding"));
   Fgoto_char = env->make_global_ref(env, env->intern(env, "goto-char"));
   Fput_text_property =
       env->make_global_ref(env, env->intern(env, "put-text-property"));
@@ -2085,23 +3608,18 @@ int emacs_module_init(struct emacs_runtime *ert) {
   Fselected_window =
       env->make_global_ref(env, env->intern(env, "selected-window"));
 
-  Fvterm_set_title =
-      env->make_global_ref(env, env->intern(env, "vterm--set-title"));
-  Fvterm_set_directory =
-      env->make_global_ref(env, env->intern(env, "vterm--set-directory"));
   Fvterm_invalidate =
       env->make_global_ref(env, env->intern(env, "vterm--invalidate"));
   Feq = env->make_global_ref(env, env->intern(env, "eq"));
   Fvterm_get_color =
       env->make_global_ref(env, env->intern(env, "vterm--get-color"));
-  Fvterm_eval = env->make_global_ref(env, env->intern(env, "vterm--eval"));
-  Fvterm_set_selection =
-      env->make_global_ref(env, env->intern(env, "vterm--set-selection"));
+  Fvterm_apply_events =
+      env->make_global_ref(env, env->intern(env, "vterm--apply-events"));
 
   // Exported functions
   emacs_value fun;
   fun =
-      env->make_function(env, 4, 9, Fvterm_new, "Allocate a new vterm.", NULL);
+      env->make_function(env, 4, 11, Fvterm_new, "Allocate a new vterm.", NULL);
   bind_function(env, "vterm--new", fun);
 
   fun = env->make_function(env, 1, 5, Fvterm_update,
@@ -2112,6 +3630,14 @@ int emacs_module_init(struct emacs_runtime *ert) {
       env->make_function(env, 1, 2, Fvterm_redraw, "Redraw the screen.", NULL);
   bind_function(env, "vterm--redraw", fun);
 
+  fun = env->make_function(
+      env, 2, 3, Fvterm_key_event,
+      "Send the key EVENT to TERM, with the meta modifier if META.\n\n"
+      "Return nil, sending nothing, if EVENT needs "
+      "`vterm--translate-event-to-args'.",
+      NULL);
+  bind_function(env, "vterm--key-event", fun);
+
   fun = env->make_function(env, 2, 2, Fvterm_write_input,
                            "Write input to vterm.", NULL);
   bind_function(env, "vterm--write-input", fun);
@@ -2129,6 +3655,92 @@ int emacs_module_init(struct emacs_runtime *ert) {
                            "Return current mouse tracking mode integer.", NULL);
   bind_function(env, "vterm--mouse-mode", fun);
 
+  fun = env->make_function(
+      env, 1, 1, Fvterm_memory_stats,
+      "Return a plist of memory accounting statistics for TERM.", NULL);
+  bind_function(env, "vterm--memory-stats", fun);
+
+  fun = env->make_function(
+      env, 1, 1, Fvterm_cpu_time,
+      "Return the microseconds TERM has spent parsing output and redrawing, "
+      "as (PARSE-US RENDER-US).",
+      NULL);
+  bind_function(env, "vterm--cpu-time", fun);
+
+  fun = env->make_function(
+      env, 2, 3, Fvterm_complete_token,
+      "Return up to MAX tokens printed in TERM that extend PREFIX, newest "
+      "first.",
+      NULL);
+  bind_function(env, "vterm--complete-token", fun);
+
+  fun = env->make_function(
+      env, 2, 2, Fvterm_line_id,
+      "Return the id of the buffer line FROM-END lines before the end of the "
+      "buffer.",
+      NULL);
+  bind_function(env, "vterm--line-id", fun);
+
+  fun = env->make_function(
+      env, 2, 2, Fvterm_line_id_from_end,
+      "Return how many lines before the end of the buffer the line with ID "
+      "is, or nil if it is not in the buffer.",
+      NULL);
+  bind_function(env, "vterm--line-id-from-end", fun);
+
+  fun = env->make_function(
+      env, 1, 1, Fvterm_line_ids,
+      "Return the line ids of TERM as (OLDEST TOP LAST).", NULL);
+  bind_function(env, "vterm--line-ids", fun);
+
+  fun = env->make_function(
+      env, 3, 3, Fvterm_feed_lines,
+      "Deliver up to MAX completed lines of TERM per redraw, with face runs "
+      "if FACES.",
+      NULL);
+  bind_function(env, "vterm--feed-lines", fun);
+
+  fun = env->make_function(
+      env, 3, 3, Fvterm_face_runs,
+      "Return the face runs of COUNT buffer lines, the first one FROM-END "
+      "lines before the end of the buffer.",
+      NULL);
+  bind_function(env, "vterm--face-runs", fun);
+
+  fun = env->make_function(
+      env, 2, 3, Fvterm_export_scrollback,
+      "Write the scrollback and screen of TERM to FILE as text, or as ANSI "
+      "colored text if FORMAT is `ansi'.",
+      NULL);
+  bind_function(env, "vterm--export-scrollback", fun);
+
+  fun = env->make_function(env, 2, 2, Fvterm_expect,
+                           "Wait for STRING in the output of TERM.", NULL);
+  bind_function(env, "vterm--expect", fun);
+
+  fun = env->make_function(env, 2, 2, Fvterm_expect_cancel,
+                           "Stop waiting for the pattern ID.", NULL);
+  bind_function(env, "vterm--expect-cancel", fun);
+
+  fun = env->make_function(
+      env, 1, 2, Fvterm_screen_text,
+      "Return the screen of TERM, after its last SCROLLBACK scrollback lines, "
+      "as plain text.",
+      NULL);
+  bind_function(env, "vterm--screen-text", fun);
+
+  fun = env->make_function(
+      env, 1, 2, Fvterm_screen_cells,
+      "Return the cell attributes of the screen of TERM, after its last "
+      "SCROLLBACK scrollback lines, as a vector of rows.",
+      NULL);
+  bind_function(env, "vterm--screen-cells", fun);
+
+  fun = env->make_function(
+      env, 2, 2, Fvterm_set_eval_cmds,
+      "Set the command names allowed in 51;E, from `vterm-eval-cmds'.", NULL);
+  bind_function(env, "vterm--set-eval-cmds", fun);
+
   fun = env->make_function(env, 3, 4, Fvterm_set_size,
                            "Set the size of the terminal.", NULL);
   bind_function(env, "vterm--set-size", fun);
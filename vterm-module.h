@@ -6,7 +6,12 @@
 #include <stdbool.h>
 #include <vterm.h>
 
+#include "alloc.h"
 #include "arena.h"
+#include "expect.h"
+#include "linemeta.h"
+#include "strset.h"
+#include "tokidx.h"
 #ifdef _WIN32
 #include "conpty.h"
 #endif
@@ -46,6 +51,8 @@ extern VTERM_EXPORT int plugin_is_GPL_compatible;
 #define SB_MAX 100000 // Maximum 'scrollback' value.
 #endif
 
+#define SB_POOL_BLOCK (2 << 20) // First block of the scrollback pool
+
 #ifndef MIN
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #endif
@@ -53,22 +60,60 @@ extern VTERM_EXPORT int plugin_is_GPL_compatible;
 #define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
 #endif
 
-typedef struct LineInfo {
-  char *directory; /* working directory */
-
-  int prompt_col; /* end column of the prompt, if the current line contains the
-                   * prompt */
-} LineInfo;
-
 typedef struct ScrollbackLine {
   size_t cols;
-  LineInfo *info;
+  size_t capacity; // cells allocated, at least cols
   VTermScreenCell cells[];
 } ScrollbackLine;
 
+/* Free scrollback rows of one capacity in the scrollback pool, chained
+ * through their first cell */
+typedef struct SbFreeRows {
+  size_t capacity;
+  size_t count;
+  ScrollbackLine *rows;
+  struct SbFreeRows *next;
+} SbFreeRows;
+
+/* A completed logical line waiting for the vterm-subscribe-lines consumers:
+ * LEN bytes of text at TEXT in LineFeed.text and NRUNS face runs at RUNS in
+ * LineFeed.runs */
+typedef struct {
+  int64_t id; // line id of its first row
+  size_t text, len;
+  size_t runs, nruns;
+  int chars; // characters in the text
+} FeedLine;
+
+/* Characters START to END of a feed line are drawn like CELL */
+typedef struct {
+  int start, end;
+  VTermScreenCell cell;
+} FeedRun;
+
+#define FEED_LINE_MAX 65536 // Bytes of text kept of one logical line
+
+/* Logical lines completed since the last redraw. A line is complete once the
+ * cursor is below its last row or that row scrolled off the screen. */
+typedef struct {
+  int max;         // lines per redraw, 0 if nobody subscribed
+  bool faces;      // with face runs
+  bool open;       // the last line goes on with the next row
+  bool dropping;   // the open line is over max and dropped
+  int64_t next;    // line id of the next row to feed
+  int64_t dropped; // lines dropped since the last redraw
+  FeedLine *lines;
+  size_t len, cap;
+  char *text;
+  size_t text_len, text_cap;
+  FeedRun *runs;
+  size_t runs_len, runs_cap;
+} LineFeed;
+
 typedef struct ElispCodeListNode {
   char *code;
   size_t code_len;
+  int argc; // words in code, each NUL-terminated; 0 if code is the raw payload
   struct ElispCodeListNode *next;
 } ElispCodeListNode;
 
@@ -83,6 +128,8 @@ typedef struct Cursor {
   bool cursor_blink;
   bool cursor_type_changed;
   bool cursor_blink_changed;
+  int type_sent;  // last cursor type delivered to Emacs
+  int blink_sent; // last blink state delivered to Emacs, -1 if none
 } Cursor;
 
 typedef struct Term {
@@ -111,6 +158,21 @@ typedef struct Term {
   bool is_invalidated;
   bool queued_bell;
 
+  // Start of a UTF-8 sequence cut at the end of the last output chunk
+  char utf8_held[4];
+  int utf8_held_len;
+
+  /* Scroll-off reuse: rows that scroll into scrollback unchanged keep the
+   * buffer lines they were rendered to. Counters cover one redraw. */
+  uint64_t *row_fp; // fingerprint of the rendered screen rows, 0 = unknown
+  int row_fp_len;
+  int sb_pushed;              // rows pushed since the last redraw
+  int sb_reused;              // leading pushed rows matching row_fp
+  bool sb_reuse_broken;       // popped, cleared or resized since last redraw
+  int scroll_shift;           // rows moved up by full-screen scrolls
+  bool scroll_pure;           // no other moverect since the last redraw
+  int scroll_invalid_start;   // invalid_start, moved up with the scrolls
+
   Cursor cursor;
   bool follow_terminal_cursor;
   char *title;
@@ -124,6 +186,16 @@ typedef struct Term {
   ElispCodeListNode *elisp_code_first;
   ElispCodeListNode **elisp_code_p_insert; // pointer to the position where new
                                            // node should be inserted
+  // Command names of `vterm-eval-cmds', mirrored by vterm--set-eval-cmds so
+  // 51;E commands outside it are turned down before reaching Lisp
+  StrSet eval_cmds;
+  bool eval_cmds_synced;
+
+  // Patterns waited for in the output, see vterm--expect
+  Expect expect;
+  // Completed lines for vterm--feed-lines
+  LineFeed feed;
+  bool altscreen;
 
   /*  c , p , q , s , 0 , 1 , 2 , 3 , 4 , 5 , 6 , and 7  */
   /* clipboard, primary, secondary, select, or cut buffers 0 through 7 */
@@ -131,9 +203,21 @@ typedef struct Term {
   char *selection_data;
   char selection_buf[SELECTION_BUF_LEN];
 
-  /* the size of dirs almost = window height, value = directory of that line */
-  LineInfo **lines;
-  int lines_len;
+  /* absolute line of screen row 0; grows by one per row pushed to the
+   * scrollback and shrinks by one per row popped. Absolute lines are the
+   * line ids of vterm--line-id: 64 bits, so they never wrap. */
+  int64_t top_line;
+  /* absolute line of the first buffer line as of the last redraw, which is
+   * what the buffer shows until the next one */
+  int64_t buffer_top_line;
+  /* directory and prompt spans keyed by absolute line */
+  LineMeta meta;
+  /* tokens of the scrollback for vterm--complete-token, indexed from its
+   * first call on; token_text holds the text of one row */
+  TokenIndex tokens;
+  bool tokens_enabled;
+  char *token_text;
+  size_t token_text_cap;
 
   int width, height;
   int height_resize;
@@ -143,6 +227,7 @@ typedef struct Term {
   bool disable_inverse_video;
   bool ignore_blink_cursor;
   bool ignore_cursor_change;
+  bool lazy_faces; // faces are applied on display, see vterm--face-runs
 
   char *cmd_buffer;
 
@@ -152,8 +237,19 @@ typedef struct Term {
 
   // Arena allocators for performance optimization
   arena_allocator_t
-      *persistent_arena;         // Long-lived data (LineInfo, directories)
+      *persistent_arena;         // Long-lived data (sb_buffer, row arrays)
   arena_allocator_t *temp_arena; // Temporary render buffers (reset per frame)
+  // Scrollback rows in 2 MB aligned blocks for huge pages, NULL when rows
+  // are malloc'd; see vterm-scrollback-huge-pages
+  arena_allocator_t *sb_pool;
+  int sb_pool_flags;
+  SbFreeRows *sb_free_rows;
+
+  // Heap accounting for this terminal (scrollback rows, strings, libvterm)
+  MemStats mem;
+  // Time spent in vterm_input_write and term_redraw, for vterm--cpu-time
+  uint64_t parse_us;
+  uint64_t render_us;
 
 #ifdef _WIN32
   // In-process ConPTY (Windows only)
@@ -161,23 +257,6 @@ typedef struct Term {
 #endif
 } Term;
 
-static bool compare_cells(VTermScreenCell *a, VTermScreenCell *b);
-static bool is_key(unsigned char *key, size_t len, char *key_description);
-static emacs_value render_text(emacs_env *env, Term *term, char *string,
-                               int len, VTermScreenCell *cell);
-static emacs_value render_fake_newline(emacs_env *env, Term *term);
-static emacs_value render_prompt(emacs_env *env, emacs_value text);
-static emacs_value cell_rgb_color(emacs_env *env, Term *term,
-                                  VTermScreenCell *cell, bool is_foreground);
-
-static int term_settermprop(VTermProp prop, VTermValue *val, void *user_data);
-
-static void term_redraw(Term *term, emacs_env *env);
-static void term_flush_output(Term *term, emacs_env *env);
-static void term_process_key(Term *term, emacs_env *env, unsigned char *key,
-                             size_t len, VTermModifier modifier);
-static void invalidate_terminal(Term *term, int start_row, int end_row);
-
 void term_finalize(void *object);
 
 emacs_value Fvterm_new(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
@@ -186,6 +265,8 @@ emacs_value Fvterm_update(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
                           void *data);
 emacs_value Fvterm_redraw(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
                           void *data);
+emacs_value Fvterm_key_event(emacs_env *env, ptrdiff_t nargs,
+                             emacs_value args[], void *data);
 emacs_value Fvterm_write_input(emacs_env *env, ptrdiff_t nargs,
                                emacs_value args[], void *data);
 emacs_value Fvterm_set_size(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
@@ -209,6 +290,34 @@ emacs_value Fvterm_mouse_button(emacs_env *env, ptrdiff_t nargs,
                                 emacs_value args[], void *data);
 emacs_value Fvterm_mouse_mode(emacs_env *env, ptrdiff_t nargs,
                               emacs_value args[], void *data);
+emacs_value Fvterm_memory_stats(emacs_env *env, ptrdiff_t nargs,
+                                emacs_value args[], void *data);
+emacs_value Fvterm_cpu_time(emacs_env *env, ptrdiff_t nargs,
+                            emacs_value args[], void *data);
+emacs_value Fvterm_face_runs(emacs_env *env, ptrdiff_t nargs,
+                             emacs_value args[], void *data);
+emacs_value Fvterm_line_id(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
+                           void *data);
+emacs_value Fvterm_line_id_from_end(emacs_env *env, ptrdiff_t nargs,
+                                    emacs_value args[], void *data);
+emacs_value Fvterm_line_ids(emacs_env *env, ptrdiff_t nargs,
+                            emacs_value args[], void *data);
+emacs_value Fvterm_feed_lines(emacs_env *env, ptrdiff_t nargs,
+                              emacs_value args[], void *data);
+emacs_value Fvterm_screen_text(emacs_env *env, ptrdiff_t nargs,
+                               emacs_value args[], void *data);
+emacs_value Fvterm_screen_cells(emacs_env *env, ptrdiff_t nargs,
+                                emacs_value args[], void *data);
+emacs_value Fvterm_complete_token(emacs_env *env, ptrdiff_t nargs,
+                                  emacs_value args[], void *data);
+emacs_value Fvterm_export_scrollback(emacs_env *env, ptrdiff_t nargs,
+                                     emacs_value args[], void *data);
+emacs_value Fvterm_expect(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
+                          void *data);
+emacs_value Fvterm_expect_cancel(emacs_env *env, ptrdiff_t nargs,
+                                 emacs_value args[], void *data);
+emacs_value Fvterm_set_eval_cmds(emacs_env *env, ptrdiff_t nargs,
+                                 emacs_value args[], void *data);
 
 VTERM_EXPORT int emacs_module_init(struct emacs_runtime *ert);
 
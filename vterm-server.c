@@ -0,0 +1,1141 @@
+/* vterm-server: terminals that live outside Emacs
+ *
+ * The server owns the ptys and the libvterm instances of its sessions, so
+ * parsing runs on another core and a session survives the Emacs that
+ * created it. Clients connect to a Unix socket, create or attach to a
+ * session and receive, at most every FRAME_INTERVAL_MS, the screen rows
+ * that changed since the last frame. The socket lives in a directory only
+ * its user can enter, and clients running as another user are turned away.
+ *
+ * Requests are lines of text:
+ *
+ *   new ROWS COLS [COMMAND]   start COMMAND (default $SHELL) and attach
+ *   attach ID ROWS COLS       attach to session ID, resizing it; the
+ *                             last HISTORY_LINES of scrollback are sent;
+ *                             a session whose program exited while
+ *                             detached is shown, reports (exit STATUS)
+ *                             and is gone
+ *   detach                    leave the session running
+ *   input LEN                 followed by LEN bytes written to the pty
+ *   key MODS NAME             a key, see key_names; MODS is a bit mask
+ *                             1 shift, 2 meta, 4 control
+ *   resize ROWS COLS
+ *   list                      describe the sessions
+ *   kill ID                   hang up session ID, or drop it once exited
+ *
+ * Replies and updates are Lisp forms, one per line, so the client reads
+ * them with `read':
+ *
+ *   (session ID)
+ *   (sessions (ID ROWS COLS RUNNING "TITLE") ...)
+ *   (scroll "TEXT" (RUN ...))       a row pushed to the scrollback
+ *   (frame CURSOR-ROW CURSOR-COL CURSOR-VISIBLE (ROW "TEXT" (RUN ...)) ...)
+ *   (title "TITLE")
+ *   (bell)
+ *   (exit STATUS)
+ *   (detached)
+ *   (error "MESSAGE")
+ *
+ * TEXT has no trailing blanks. A RUN is START END FG BG ATTRS, character
+ * offsets into TEXT followed by the colors and attributes packed like the
+ * cells of vterm--screen-cells; only runs that are not the default
+ * rendition are sent.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <vterm.h>
+
+#if defined(__APPLE__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <util.h>
+#elif defined(__FreeBSD__)
+#include <libutil.h>
+#else
+#include <pty.h>
+#endif
+
+#include "utf8.h"
+
+#define MAX_SESSIONS 64
+#define MAX_CLIENTS 64
+#define FRAME_INTERVAL_MS 16
+/* stop reading a pty while its client has this much output queued */
+#define CLIENT_BACKLOG (1 << 20)
+/* scrollback rows replayed to a client on attach, as vterm-max-scrollback */
+#define HISTORY_LINES 1000
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} Buf;
+
+typedef struct Client Client;
+
+typedef struct {
+  int id;
+  int pty_fd;
+  pid_t pid;
+  VTerm *vt;
+  VTermScreen *vts;
+  int rows, cols;
+  bool *dirty;
+  bool any_dirty;
+  VTermPos cursor;
+  bool cursor_visible;
+  char *title;
+  bool running;
+  bool exited; // the child was reaped and STATUS is its exit status
+  int status;
+  Buf input;    // bytes for the program the pty did not take yet
+  Buf *history; // (scroll ...) lines, a ring of HISTORY_LINES
+  int history_start, history_len;
+  Client *client; // attached client, or NULL
+} Session;
+
+struct Client {
+  int fd;
+  Buf in;
+  Buf out;
+  Session *session;
+};
+
+static Session *sessions[MAX_SESSIONS];
+static Client *clients[MAX_CLIENTS];
+static int next_session_id = 1;
+static bool had_session = false;
+
+static void buf_reserve(Buf *buf, size_t extra) {
+  if (buf->len + extra <= buf->cap) {
+    return;
+  }
+  size_t cap = buf->cap ? buf->cap : 4096;
+  while (cap < buf->len + extra) {
+    cap *= 2;
+  }
+  char *data = realloc(buf->data, cap);
+  if (!data) {
+    perror("vterm-server: realloc");
+    exit(1);
+  }
+  buf->data = data;
+  buf->cap = cap;
+}
+
+static void buf_append(Buf *buf, const char *data, size_t len) {
+  buf_reserve(buf, len);
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static void buf_printf(Buf *buf, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  buf_reserve(buf, n + 1);
+  va_start(ap, fmt);
+  vsnprintf(buf->data + buf->len, n + 1, fmt, ap);
+  va_end(ap);
+  buf->len += n;
+}
+
+static void buf_consume(Buf *buf, size_t len) {
+  memmove(buf->data, buf->data + len, buf->len - len);
+  buf->len -= len;
+}
+
+/* A Lisp string literal that stays on one line */
+static void buf_lisp_string(Buf *buf, const char *str, size_t len) {
+  buf_reserve(buf, len * 4 + 2);
+  buf->data[buf->len++] = '"';
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = str[i];
+    if (c == '"' || c == '\\') {
+      buf->data[buf->len++] = '\\';
+      buf->data[buf->len++] = c;
+    } else if (c < 0x20 || c == 0x7f) {
+      buf->len += sprintf(buf->data + buf->len, "\\%03o", c);
+    } else {
+      buf->data[buf->len++] = c;
+    }
+  }
+  buf->data[buf->len++] = '"';
+}
+
+/* Colors and attributes, packed as in vterm--screen-cells */
+static uint64_t pack_color(const VTermColor *color, bool is_fg) {
+  if (is_fg ? VTERM_COLOR_IS_DEFAULT_FG(color)
+            : VTERM_COLOR_IS_DEFAULT_BG(color)) {
+    return 0;
+  }
+  if (VTERM_COLOR_IS_INDEXED(color)) {
+    return (1ull << 24) | color->indexed.idx;
+  }
+  return (2ull << 24) | ((uint64_t)color->rgb.red << 16) |
+         ((uint64_t)color->rgb.green << 8) | color->rgb.blue;
+}
+
+static unsigned pack_attrs(const VTermScreenCell *cell) {
+  return (cell->attrs.bold ? 1 : 0) | (cell->attrs.underline ? 2 : 0) |
+         (cell->attrs.italic ? 4 : 0) | (cell->attrs.blink ? 8 : 0) |
+         (cell->attrs.reverse ? 16 : 0) | (cell->attrs.strike ? 32 : 0) |
+         (cell->attrs.conceal ? 64 : 0);
+}
+
+static bool same_rendition(const VTermScreenCell *a, const VTermScreenCell *b) {
+  return pack_attrs(a) == pack_attrs(b) &&
+         pack_color(&a->fg, true) == pack_color(&b->fg, true) &&
+         pack_color(&a->bg, false) == pack_color(&b->bg, false);
+}
+
+static bool is_default_rendition(const VTermScreenCell *cell) {
+  return pack_attrs(cell) == 0 && pack_color(&cell->fg, true) == 0 &&
+         pack_color(&cell->bg, false) == 0;
+}
+
+static bool is_blank(const VTermScreenCell *cell) {
+  return cell->chars[0] == 0 || cell->chars[0] == (uint32_t)-1;
+}
+
+/* Append "TEXT" (RUN ...) for the COLS cells of a row */
+static void encode_row(Buf *buf, const VTermScreenCell *cells, int cols) {
+  int end = cols;
+  while (end > 0 && is_blank(&cells[end - 1]) &&
+         pack_color(&cells[end - 1].bg, false) == 0 &&
+         !cells[end - 1].attrs.reverse) {
+    end--;
+  }
+
+  Buf text = {0};
+  Buf runs = {0};
+  int offset = 0, run_start = 0;
+  const VTermScreenCell *run_cell = NULL;
+
+  for (int col = 0; col < end; col += cells[col].width > 1 ? cells[col].width
+                                                           : 1) {
+    const VTermScreenCell *cell = &cells[col];
+    if (!run_cell || !same_rendition(run_cell, cell)) {
+      if (run_cell && offset > run_start && !is_default_rendition(run_cell)) {
+        buf_printf(&runs, "%s%d %d %llu %llu %u", runs.len ? " " : "",
+                   run_start, offset,
+                   (unsigned long long)pack_color(&run_cell->fg, true),
+                   (unsigned long long)pack_color(&run_cell->bg, false),
+                   pack_attrs(run_cell));
+      }
+      run_cell = cell;
+      run_start = offset;
+    }
+    if (is_blank(cell)) {
+      buf_append(&text, " ", 1);
+      offset++;
+      continue;
+    }
+    for (int k = 0; k < VTERM_MAX_CHARS_PER_CELL && cell->chars[k]; k++) {
+      unsigned char bytes[4];
+      size_t count = codepoint_to_utf8(cell->chars[k], bytes);
+      buf_append(&text, (char *)bytes, count);
+      offset++;
+    }
+  }
+  if (run_cell && offset > run_start && !is_default_rendition(run_cell)) {
+    buf_printf(&runs, "%s%d %d %llu %llu %u", runs.len ? " " : "", run_start,
+               offset, (unsigned long long)pack_color(&run_cell->fg, true),
+               (unsigned long long)pack_color(&run_cell->bg, false),
+               pack_attrs(run_cell));
+  }
+
+  buf_lisp_string(buf, text.data ? text.data : "", text.len);
+  buf_append(buf, " (", 2);
+  buf_append(buf, runs.data ? runs.data : "", runs.len);
+  buf_append(buf, ")", 1);
+  free(text.data);
+  free(runs.data);
+}
+
+static void send_to(Session *session, const char *fmt, ...) {
+  if (!session->client) {
+    return;
+  }
+  Buf *out = &session->client->out;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  buf_reserve(out, n + 1);
+  va_start(ap, fmt);
+  vsnprintf(out->data + out->len, n + 1, fmt, ap);
+  va_end(ap);
+  out->len += n;
+}
+
+static void mark_dirty(Session *session, int start_row, int end_row) {
+  for (int row = start_row < 0 ? 0 : start_row;
+       row < end_row && row < session->rows; row++) {
+    session->dirty[row] = true;
+  }
+  session->any_dirty = true;
+}
+
+/* libvterm callbacks */
+
+static int term_damage(VTermRect rect, void *user) {
+  mark_dirty(user, rect.start_row, rect.end_row);
+  return 1;
+}
+
+static int term_movecursor(VTermPos pos, VTermPos oldpos, int visible,
+                           void *user) {
+  (void)oldpos;
+  (void)visible;
+  Session *session = user;
+  session->cursor = pos;
+  session->any_dirty = true;
+  return 1;
+}
+
+static int term_settermprop(VTermProp prop, VTermValue *val, void *user) {
+  Session *session = user;
+  switch (prop) {
+  case VTERM_PROP_CURSORVISIBLE:
+    session->cursor_visible = val->boolean;
+    session->any_dirty = true;
+    break;
+#ifdef VTermStringFragmentNotExists
+  case VTERM_PROP_TITLE:
+    free(session->title);
+    session->title = strdup(val->string);
+    break;
+#else
+  case VTERM_PROP_TITLE:
+    if (val->string.initial) {
+      free(session->title);
+      session->title = NULL;
+    }
+    {
+      size_t old = session->title ? strlen(session->title) : 0;
+      char *title = realloc(session->title, old + val->string.len + 1);
+      if (title) {
+        memcpy(title + old, val->string.str, val->string.len);
+        title[old + val->string.len] = '\0';
+        session->title = title;
+      }
+    }
+    if (!val->string.final) {
+      return 1;
+    }
+    break;
+#endif
+  default:
+    return 1;
+  }
+  if (prop == VTERM_PROP_TITLE && session->client && session->title) {
+    Buf *out = &session->client->out;
+    buf_append(out, "(title ", 7);
+    buf_lisp_string(out, session->title, strlen(session->title));
+    buf_append(out, ")\n", 2);
+  }
+  return 1;
+}
+
+static int term_bell(void *user) {
+  send_to(user, "(bell)\n");
+  return 1;
+}
+
+/* Keep LINE, replacing the oldest line once the history is full */
+static void keep_history(Session *session, Buf *line) {
+  Buf *slot;
+  if (session->history_len < HISTORY_LINES) {
+    slot = &session->history[(session->history_start +
+                              session->history_len++) %
+                             HISTORY_LINES];
+  } else {
+    slot = &session->history[session->history_start];
+    session->history_start = (session->history_start + 1) % HISTORY_LINES;
+    free(slot->data);
+  }
+  char *data = realloc(line->data, line->len); /* drop the spare capacity */
+  if (data) {
+    line->data = data;
+    line->cap = line->len;
+  }
+  *slot = *line;
+}
+
+static int term_sb_pushline(int cols, const VTermScreenCell *cells,
+                            void *user) {
+  Session *session = user;
+  Buf line = {0};
+  buf_append(&line, "(scroll ", 8);
+  encode_row(&line, cells, cols);
+  buf_append(&line, ")\n", 2);
+  if (session->client) {
+    buf_append(&session->client->out, line.data, line.len);
+  }
+  keep_history(session, &line);
+  return 1;
+}
+
+static VTermScreenCallbacks screen_callbacks = {
+    .damage = term_damage,
+    .movecursor = term_movecursor,
+    .settermprop = term_settermprop,
+    .bell = term_bell,
+    .sb_pushline = term_sb_pushline,
+};
+
+/* Write as much of the queued input as the pty takes without blocking */
+static void flush_input(Session *session) {
+  while (session->input.len > 0) {
+    ssize_t n = write(session->pty_fd, session->input.data, session->input.len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        session->input.len = 0; /* the program is gone */
+      }
+      return;
+    }
+    buf_consume(&session->input, n);
+  }
+}
+
+/* Input for the program is queued and the main loop writes what the pty
+ * does not take at once, so a program that does not read its input only
+ * holds up its own session */
+static void term_output(const char *s, size_t len, void *user) {
+  Session *session = user;
+  if (!session->running) {
+    return;
+  }
+  buf_append(&session->input, s, len);
+  flush_input(session);
+}
+
+/* Sessions */
+
+static Session *find_session(int id) {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (sessions[i] && sessions[i]->id == id) {
+      return sessions[i];
+    }
+  }
+  return NULL;
+}
+
+static void set_pty_size(Session *session) {
+  struct winsize ws = {.ws_row = session->rows, .ws_col = session->cols};
+  ioctl(session->pty_fd, TIOCSWINSZ, &ws);
+}
+
+static void resize_session(Session *session, int rows, int cols) {
+  if (rows < 1 || cols < 1 ||
+      (rows == session->rows && cols == session->cols)) {
+    return;
+  }
+  bool *dirty = calloc(rows, sizeof(bool));
+  if (!dirty) {
+    return;
+  }
+  free(session->dirty);
+  session->dirty = dirty;
+  session->rows = rows;
+  session->cols = cols;
+  vterm_set_size(session->vt, rows, cols);
+  vterm_screen_flush_damage(session->vts);
+  set_pty_size(session);
+  mark_dirty(session, 0, rows);
+}
+
+static Session *new_session(int rows, int cols, const char *command) {
+  int slot = 0;
+  while (slot < MAX_SESSIONS && sessions[slot]) {
+    slot++;
+  }
+  if (slot == MAX_SESSIONS || rows < 1 || cols < 1) {
+    return NULL;
+  }
+  Session *session = calloc(1, sizeof(Session));
+  if (!session) {
+    return NULL;
+  }
+  session->dirty = calloc(rows, sizeof(bool));
+  session->history = calloc(HISTORY_LINES, sizeof(Buf));
+  if (!session->dirty || !session->history) {
+    free(session->dirty);
+    free(session->history);
+    free(session);
+    return NULL;
+  }
+  session->rows = rows;
+  session->cols = cols;
+
+  struct winsize ws = {.ws_row = rows, .ws_col = cols};
+  pid_t pid = forkpty(&session->pty_fd, NULL, NULL, &ws);
+  if (pid < 0) {
+    free(session->dirty);
+    free(session->history);
+    free(session);
+    return NULL;
+  }
+  if (pid == 0) {
+    setenv("TERM", "xterm-256color", 1);
+    setenv("INSIDE_EMACS", "vterm", 1);
+    setenv("EMACS_VTERM_SERVER", "1", 1);
+    const char *shell = getenv("SHELL");
+    if (command && *command) {
+      execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    } else {
+      execl(shell ? shell : "/bin/sh", shell ? shell : "/bin/sh",
+            (char *)NULL);
+    }
+    _exit(127);
+  }
+  fcntl(session->pty_fd, F_SETFL,
+        fcntl(session->pty_fd, F_GETFL) | O_NONBLOCK);
+  fcntl(session->pty_fd, F_SETFD, FD_CLOEXEC);
+
+  session->id = next_session_id++;
+  session->pid = pid;
+  session->running = true;
+  session->cursor_visible = true;
+  session->vt = vterm_new(rows, cols);
+  vterm_set_utf8(session->vt, 1);
+  vterm_output_set_callback(session->vt, term_output, session);
+  session->vts = vterm_obtain_screen(session->vt);
+  vterm_screen_set_callbacks(session->vts, &screen_callbacks, session);
+  vterm_screen_set_damage_merge(session->vts, VTERM_DAMAGE_SCROLL);
+  vterm_screen_reset(session->vts, 1);
+
+  sessions[slot] = session;
+  had_session = true;
+  return session;
+}
+
+static void free_session(Session *session) {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (sessions[i] == session) {
+      sessions[i] = NULL;
+    }
+  }
+  if (session->client) {
+    session->client->session = NULL;
+  }
+  if (session->running) {
+    kill(session->pid, SIGHUP);
+  }
+  close(session->pty_fd);
+  vterm_free(session->vt);
+  free(session->input.data);
+  for (int i = 0; i < session->history_len; i++) {
+    free(session->history[(session->history_start + i) % HISTORY_LINES].data);
+  }
+  free(session->history);
+  free(session->dirty);
+  free(session->title);
+  free(session);
+}
+
+static void send_frame(Session *session) {
+  if (!session->client || !session->any_dirty) {
+    return;
+  }
+  vterm_screen_flush_damage(session->vts);
+  Buf *out = &session->client->out;
+  buf_printf(out, "(frame %d %d %s", session->cursor.row, session->cursor.col,
+             session->cursor_visible ? "t" : "nil");
+
+  VTermScreenCell *cells = malloc(sizeof(VTermScreenCell) * session->cols);
+  for (int row = 0; row < session->rows; row++) {
+    if (!session->dirty[row]) {
+      continue;
+    }
+    for (int col = 0; col < session->cols; col++) {
+      vterm_screen_get_cell(session->vts, (VTermPos){.row = row, .col = col},
+                            &cells[col]);
+    }
+    buf_printf(out, " (%d ", row);
+    encode_row(out, cells, session->cols);
+    buf_append(out, ")", 1);
+    session->dirty[row] = false;
+  }
+  free(cells);
+  buf_append(out, ")\n", 2);
+  session->any_dirty = false;
+}
+
+static void attach(Client *client, Session *session, int rows, int cols) {
+  if (session->client && session->client != client) {
+    buf_append(&session->client->out, "(detached)\n", 11);
+    session->client->session = NULL;
+  }
+  if (client->session && client->session != session) {
+    client->session->client = NULL;
+  }
+  client->session = session;
+  session->client = client;
+  buf_printf(&client->out, "(session %d)\n", session->id);
+  if (session->title) {
+    buf_append(&client->out, "(title ", 7);
+    buf_lisp_string(&client->out, session->title, strlen(session->title));
+    buf_append(&client->out, ")\n", 2);
+  }
+  /* the buffer of the client starts empty */
+  for (int i = 0; i < session->history_len; i++) {
+    Buf *line =
+        &session->history[(session->history_start + i) % HISTORY_LINES];
+    buf_append(&client->out, line->data, line->len);
+  }
+  resize_session(session, rows, cols);
+  mark_dirty(session, 0, session->rows);
+  send_frame(session);
+  if (session->exited) {
+    /* the client collects the session */
+    buf_printf(&client->out, "(exit %d)\n", session->status);
+    free_session(session);
+  }
+}
+
+/* Keys */
+
+typedef struct {
+  const char *name;
+  VTermKey key;
+} KeyName;
+
+/* Names as printed by `key-description', like the keys of vterm--update */
+static const KeyName key_names[] = {
+    {"<return>", VTERM_KEY_ENTER},
+    {"RET", VTERM_KEY_ENTER},
+    {"<tab>", VTERM_KEY_TAB},
+    {"TAB", VTERM_KEY_TAB},
+    {"<backspace>", VTERM_KEY_BACKSPACE},
+    {"DEL", VTERM_KEY_BACKSPACE},
+    {"<escape>", VTERM_KEY_ESCAPE},
+    {"ESC", VTERM_KEY_ESCAPE},
+    {"<up>", VTERM_KEY_UP},
+    {"<down>", VTERM_KEY_DOWN},
+    {"<left>", VTERM_KEY_LEFT},
+    {"<right>", VTERM_KEY_RIGHT},
+    {"<insert>", VTERM_KEY_INS},
+    {"<delete>", VTERM_KEY_DEL},
+    {"<home>", VTERM_KEY_HOME},
+    {"<end>", VTERM_KEY_END},
+    {"<prior>", VTERM_KEY_PAGEUP},
+    {"<next>", VTERM_KEY_PAGEDOWN},
+};
+
+static void send_key(Session *session, int mods, const char *name) {
+  VTermModifier modifier = VTERM_MOD_NONE;
+  if (mods & 1)
+    modifier |= VTERM_MOD_SHIFT;
+  if (mods & 2)
+    modifier |= VTERM_MOD_ALT;
+  if (mods & 4)
+    modifier |= VTERM_MOD_CTRL;
+
+  for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+    if (strcmp(name, key_names[i].name) == 0) {
+      vterm_keyboard_key(session->vt, key_names[i].key, modifier);
+      return;
+    }
+  }
+  if (strcmp(name, "<backtab>") == 0) {
+    vterm_keyboard_key(session->vt, VTERM_KEY_TAB, VTERM_MOD_SHIFT);
+    return;
+  }
+  if (strcmp(name, "SPC") == 0) {
+    name = " ";
+  }
+  int fn;
+  if (sscanf(name, "<f%d>", &fn) == 1 && fn >= 1 && fn <= 12) {
+    vterm_keyboard_key(session->vt, VTERM_KEY_FUNCTION(fn), modifier);
+    return;
+  }
+  uint32_t codepoint;
+  size_t len = strlen(name);
+  if (len > 0 && len <= 4 &&
+      utf8_to_codepoint((const unsigned char *)name, len, &codepoint)) {
+    vterm_keyboard_unichar(session->vt, codepoint, modifier);
+  }
+}
+
+/* Clients */
+
+static void error_reply(Client *client, const char *message) {
+  buf_append(&client->out, "(error ", 7);
+  buf_lisp_string(&client->out, message, strlen(message));
+  buf_append(&client->out, ")\n", 2);
+}
+
+static void list_sessions(Client *client) {
+  buf_append(&client->out, "(sessions", 9);
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    Session *s = sessions[i];
+    if (!s) {
+      continue;
+    }
+    buf_printf(&client->out, " (%d %d %d %s ", s->id, s->rows, s->cols,
+               s->running ? "t" : "nil");
+    const char *title = s->title ? s->title : "";
+    buf_lisp_string(&client->out, title, strlen(title));
+    buf_append(&client->out, ")", 1);
+  }
+  buf_append(&client->out, ")\n", 2);
+}
+
+/* Handle the complete requests in the input of CLIENT */
+static void process_requests(Client *client) {
+  size_t pos = 0;
+  for (;;) {
+    char *start = client->in.data + pos;
+    char *nl = memchr(start, '\n', client->in.len - pos);
+    if (!nl) {
+      break;
+    }
+    *nl = '\0';
+    size_t next = nl + 1 - client->in.data;
+    Session *session = client->session;
+    int id, rows, cols, mods;
+    size_t len;
+    int consumed = 0;
+
+    if (sscanf(start, "input %zu", &len) == 1) {
+      if (client->in.len - next < len) {
+        *nl = '\n';
+        break; /* wait for the whole payload */
+      }
+      if (session && session->running) {
+        term_output(client->in.data + next, len, session);
+      }
+      next += len;
+    } else if (sscanf(start, "new %d %d %n", &rows, &cols, &consumed) >= 2) {
+      Session *created = new_session(rows, cols, start + consumed);
+      if (created) {
+        attach(client, created, rows, cols);
+      } else {
+        error_reply(client, "cannot create session");
+      }
+    } else if (sscanf(start, "attach %d %d %d", &id, &rows, &cols) == 3) {
+      Session *found = find_session(id);
+      if (found) {
+        attach(client, found, rows, cols);
+      } else {
+        error_reply(client, "no such session");
+      }
+    } else if (sscanf(start, "key %d %n", &mods, &consumed) == 1) {
+      if (session && session->running) {
+        send_key(session, mods, start + consumed);
+      }
+    } else if (sscanf(start, "resize %d %d", &rows, &cols) == 2) {
+      if (session) {
+        resize_session(session, rows, cols);
+      }
+    } else if (strcmp(start, "detach") == 0) {
+      if (session) {
+        session->client = NULL;
+        client->session = NULL;
+      }
+      buf_append(&client->out, "(detached)\n", 11);
+    } else if (strcmp(start, "list") == 0) {
+      list_sessions(client);
+    } else if (sscanf(start, "kill %d", &id) == 1) {
+      Session *found = find_session(id);
+      if (found && found->exited) {
+        free_session(found);
+      } else if (found && found->running) {
+        kill(found->pid, SIGHUP);
+      }
+    } else if (*start) {
+      error_reply(client, "unknown request");
+    }
+    pos = next;
+  }
+  buf_consume(&client->in, pos);
+}
+
+static void close_client(Client *client) {
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (clients[i] == client) {
+      clients[i] = NULL;
+    }
+  }
+  if (client->session) {
+    client->session->client = NULL;
+  }
+  close(client->fd);
+  free(client->in.data);
+  free(client->out.data);
+  free(client);
+}
+
+/* Whether the process at the other end of FD runs as our user */
+static bool peer_is_owner(int fd) {
+#if defined(__linux__)
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+    return false;
+  }
+  return cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) < 0) {
+    return false;
+  }
+  return uid == getuid();
+#endif
+}
+
+static void accept_client(int listen_fd) {
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+  if (!peer_is_owner(fd)) {
+    close(fd);
+    return;
+  }
+  int slot = 0;
+  while (slot < MAX_CLIENTS && clients[slot]) {
+    slot++;
+  }
+  Client *client = slot < MAX_CLIENTS ? calloc(1, sizeof(Client)) : NULL;
+  if (!client) {
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  client->fd = fd;
+  clients[slot] = client;
+}
+
+/* Returns false once the client is gone */
+static bool read_client(Client *client) {
+  buf_reserve(&client->in, 4096);
+  ssize_t n = read(client->fd, client->in.data + client->in.len,
+                   client->in.cap - client->in.len);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    return false;
+  }
+  if (n > 0) {
+    client->in.len += n;
+    process_requests(client);
+  }
+  return true;
+}
+
+static bool write_client(Client *client) {
+  while (client->out.len > 0) {
+    ssize_t n = write(client->fd, client->out.data, client->out.len);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EINTR;
+    }
+    buf_consume(&client->out, n);
+  }
+  return true;
+}
+
+/* Returns true if output was read */
+static bool read_pty(Session *session) {
+  char buffer[65536];
+  ssize_t n = read(session->pty_fd, buffer, sizeof(buffer));
+  if (n > 0) {
+    vterm_input_write(session->vt, buffer, n);
+    return true;
+  }
+  if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+    /* EIO once the child is gone; reaped below */
+    session->running = false;
+  }
+  return false;
+}
+
+static void reap_children(void) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      Session *session = sessions[i];
+      if (!session || session->pid != pid) {
+        continue;
+      }
+      session->running = false;
+      session->exited = true;
+      session->status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                          : 128 + WTERMSIG(status);
+      /* the last output of the child may still wait in the pty; bounded
+         in case a process it left behind keeps writing */
+      for (int reads = 0; reads < 64 && read_pty(session); reads++) {
+      }
+      /* a detached session keeps its screen and status until a client
+         attaches to collect them, or until it is killed */
+      if (session->client) {
+        send_frame(session);
+        send_to(session, "(exit %d)\n", session->status);
+        free_session(session);
+      }
+    }
+  }
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void default_socket_path(char *path, size_t size) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir && *dir) {
+    snprintf(path, size, "%s/vterm-server.sock", dir);
+  } else {
+    snprintf(path, size, "/tmp/vterm-server-%d/server.sock", (int)getuid());
+  }
+}
+
+/* Create the directory of the socket at PATH if needed and check that
+   only our user can reach it, so nobody else can replace the socket */
+static bool secure_socket_dir(const char *path) {
+  char dir[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char *slash = strrchr(dir, '/');
+  if (!slash) {
+    snprintf(dir, sizeof(dir), ".");
+  } else if (slash == dir) {
+    slash[1] = '\0';
+  } else {
+    *slash = '\0';
+  }
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    fprintf(stderr, "vterm-server: cannot create %s: %s\n", dir,
+            strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) ||
+      st.st_uid != getuid() || (st.st_mode & 077)) {
+    fprintf(stderr,
+            "vterm-server: %s must be a directory of this user with mode "
+            "0700\n",
+            dir);
+    return false;
+  }
+  return true;
+}
+
+static int listen_on(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "vterm-server: socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  if (!secure_socket_dir(path)) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("vterm-server: socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "vterm-server: already running on %s\n", path);
+    close(fd);
+    return -1;
+  }
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+      fprintf(stderr, "vterm-server: %s is not our socket\n", path);
+      close(fd);
+      return -1;
+    }
+    unlink(path); /* stale socket */
+  }
+  /* no window in which the socket has wider permissions */
+  mode_t mask = umask(077);
+  int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (bound < 0 || listen(fd, 16) < 0) {
+    perror("vterm-server: bind");
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  bool daemonize = false;
+  default_socket_path(path, sizeof(path));
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      snprintf(path, sizeof(path), "%s", argv[++i]);
+    } else if (strcmp(argv[i], "--daemon") == 0) {
+      daemonize = true;
+    } else {
+      fprintf(stderr, "usage: %s [--socket PATH] [--daemon]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  int listen_fd = listen_on(path);
+  if (listen_fd < 0) {
+    return 1;
+  }
+
+  if (daemonize) {
+    /* the socket accepts connections once the parent has exited */
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("vterm-server: fork");
+      return 1;
+    }
+    if (pid > 0) {
+      return 0;
+    }
+    setsid();
+    int null = open("/dev/null", O_RDWR);
+    if (null >= 0) {
+      dup2(null, 0);
+      dup2(null, 1);
+      dup2(null, 2);
+      close(null);
+    }
+  }
+
+  struct pollfd fds[1 + MAX_CLIENTS + MAX_SESSIONS];
+  void *owners[1 + MAX_CLIENTS + MAX_SESSIONS];
+  long last_frame = 0;
+
+  for (;;) {
+    int n = 0;
+    fds[n] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+    owners[n++] = NULL;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      Client *client = clients[i];
+      if (client) {
+        /* input the program does not read holds back its client */
+        bool full = client->session &&
+                    client->session->input.len > CLIENT_BACKLOG;
+        short events = (full ? 0 : POLLIN) | (client->out.len ? POLLOUT : 0);
+        fds[n] = (struct pollfd){.fd = client->fd, .events = events};
+        owners[n++] = client;
+      }
+    }
+    int first_session = n;
+    bool dirty = false;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      Session *session = sessions[i];
+      if (!session || !session->running) {
+        continue;
+      }
+      dirty = dirty || (session->any_dirty && session->client);
+      /* a client that does not keep up holds back the program */
+      bool backlog =
+          session->client && session->client->out.len > CLIENT_BACKLOG;
+      short events = (backlog ? 0 : POLLIN) |
+                     (session->input.len ? POLLOUT : 0);
+      fds[n] = (struct pollfd){.fd = session->pty_fd, .events = events};
+      owners[n++] = session;
+    }
+
+    int timeout = -1;
+    if (dirty) {
+      timeout = (int)(FRAME_INTERVAL_MS - (now_ms() - last_frame));
+      timeout = timeout < 0 ? 0 : timeout;
+    } else if (had_session) {
+      timeout = 1000; /* reap children that exit without closing the pty */
+    }
+    if (poll(fds, n, timeout) < 0 && errno != EINTR) {
+      perror("vterm-server: poll");
+      return 1;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      accept_client(listen_fd);
+    }
+    for (int i = 1; i < first_session; i++) {
+      Client *client = owners[i];
+      bool alive = true;
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        alive = read_client(client);
+      }
+      if (alive && (fds[i].revents & POLLOUT)) {
+        alive = write_client(client);
+      }
+      if (!alive) {
+        close_client(client);
+      }
+    }
+    for (int i = first_session; i < n; i++) {
+      if (fds[i].revents & POLLOUT) {
+        flush_input(owners[i]);
+      }
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        read_pty(owners[i]);
+      }
+    }
+    reap_children();
+
+    if (now_ms() - last_frame >= FRAME_INTERVAL_MS) {
+      for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i]) {
+          send_frame(sessions[i]);
+        }
+      }
+      last_frame = now_ms();
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      if (clients[i] && clients[i]->out.len && !write_client(clients[i])) {
+        close_client(clients[i]);
+      }
+    }
+
+    bool idle = had_session;
+    for (int i = 0; i < MAX_SESSIONS && idle; i++) {
+      idle = sessions[i] == NULL;
+    }
+    for (int i = 0; i < MAX_CLIENTS && idle; i++) {
+      idle = clients[i] == NULL;
+    }
+    if (idle) {
+      break; /* the last session ended and nobody is connected */
+    }
+  }
+
+  close(listen_fd);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,440 @@
+;;; vterm-server.el --- Terminals owned by a vterm-server process -*- lexical-binding: t; -*-
+
+;; This file is not part of GNU Emacs.
+
+;; This file is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 2, or (at your option)
+;; any later version.
+
+;; This file is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with GNU Emacs.  If not, see <https://www.gnu.org/licenses/>.
+
+;;; Commentary:
+
+;; `vterm-server' is an executable built next to vterm-module that owns
+;; the ptys and the libvterm state of its sessions.  Parsing the output
+;; of a busy program then happens in another process, on another core,
+;; and a session keeps running when Emacs exits: `vterm-server-attach'
+;; picks it up again.
+;;
+;; The server sends, at most every 16 ms, the rows that changed since
+;; the previous update, as Lisp forms read by the C reader; rows that
+;; scroll off the screen are appended to the buffer as history.  See
+;; the comment at the top of vterm-server.c for the protocol.
+;;
+;; This is a lighter client than `vterm-mode': the buffer shows the
+;; text and faces of the terminal, keys are sent to the server, and
+;; the window size is followed.  Copy mode, prompt tracking and message
+;; passing are not available.
+
+;;; Code:
+
+(require 'vterm)
+
+(defcustom vterm-server-program
+  (expand-file-name "vterm-server"
+                    (file-name-directory (locate-library "vterm")))
+  "The vterm-server executable."
+  :type 'file
+  :group 'vterm)
+
+(defcustom vterm-server-socket
+  (if-let* ((dir (getenv "XDG_RUNTIME_DIR")))
+      (expand-file-name "vterm-server.sock" dir)
+    (format "/tmp/vterm-server-%d/server.sock" (user-uid)))
+  "Unix socket on which vterm-server listens.
+Its directory must belong to you and have mode 0700; the server
+creates it if needed."
+  :type 'file
+  :group 'vterm)
+
+(defvar-local vterm-server--process nil
+  "Connection to the server for the session in this buffer.")
+
+(defvar-local vterm-server--session nil
+  "Id of the session shown in this buffer.")
+
+(defvar-local vterm-server--screen-start nil
+  "Marker at the first screen row; history lies before it.")
+
+(defvar-local vterm-server--size nil
+  "Size (ROWS . COLS) last requested from the server.")
+
+(defvar-local vterm-server--history 0
+  "Number of history lines before the screen.")
+
+(defvar-local vterm-server--pending ""
+  "Output of the server not yet ending with a newline.")
+
+(defun vterm-server--check-socket ()
+  "Signal an error unless `vterm-server-socket' can only be ours.
+The socket, and the directory that holds it, must belong to the
+user, and nobody else may enter the directory; either may be
+missing until the server starts."
+  (let* ((dir (file-name-directory (expand-file-name vterm-server-socket)))
+         (dir-attributes (file-attributes (directory-file-name dir) 'integer))
+         (attributes (file-attributes vterm-server-socket 'integer)))
+    (when (and dir-attributes
+               (not (and (eq (file-attribute-type dir-attributes) t)
+                         (eql (file-attribute-user-id dir-attributes)
+                              (user-uid))
+                         (string-suffix-p "------"
+                                          (file-attribute-modes
+                                           dir-attributes)))))
+      (user-error "%s must be a directory of yours with mode 0700" dir))
+    (when (and attributes
+               (not (eql (file-attribute-user-id attributes) (user-uid))))
+      (user-error "%s belongs to another user" vterm-server-socket))))
+
+(defun vterm-server--make-connection (name &rest args)
+  "Connect to `vterm-server-socket' as the process NAME with ARGS.
+ARGS are passed to `make-network-process'."
+  (vterm-server--check-socket)
+  (apply #'make-network-process :name name :family 'local
+         :service vterm-server-socket args))
+
+(defun vterm-server--ensure-running ()
+  "Start the server unless something listens on `vterm-server-socket'."
+  (unless (condition-case nil
+              (progn
+                (delete-process
+                 (vterm-server--make-connection "vterm-server-probe"))
+                t)
+            (file-error nil))
+    (unless (file-executable-p vterm-server-program)
+      (user-error "Cannot find %s; build it with vterm-module"
+                  vterm-server-program))
+    (unless (zerop (call-process vterm-server-program nil nil nil
+                                 "--daemon" "--socket" vterm-server-socket))
+      (error "Failed to start %s" vterm-server-program))))
+
+(defun vterm-server--connect (buffer)
+  "Return a new connection to the server for BUFFER."
+  (vterm-server--make-connection "vterm-server"
+                                 :buffer buffer
+                                 :coding 'utf-8-unix
+                                 :noquery t
+                                 :filter #'vterm-server--filter
+                                 :sentinel #'vterm-server--sentinel))
+
+(defun vterm-server--send (process format-string &rest args)
+  "Send the request FORMAT-STRING with ARGS to PROCESS."
+  (process-send-string process
+                       (concat (apply #'format format-string args) "\n")))
+
+(defun vterm-server--window-size ()
+  "Size (ROWS . COLS) of the selected window for a terminal."
+  (cons (window-body-height)
+        (max (- (window-max-chars-per-line) (vterm--get-margin-width))
+             vterm-min-window-width)))
+
+;;; Rendering
+
+(defun vterm-server--color (color foreground)
+  "Return the Emacs color of the packed COLOR, nil for the default.
+FOREGROUND non-nil means COLOR is a foreground color."
+  (let ((kind (ash color -24))
+        (value (logand color #xffffff)))
+    (pcase kind
+      (1 (if (< value 16)
+             (if foreground
+                 (vterm--get-color value :foreground)
+               (vterm--get-color value))
+           (vterm-server--indexed-color value)))
+      (2 (format "#%06X" value)))))
+
+(defun vterm-server--indexed-color (index)
+  "Return the xterm color INDEX, between 16 and 255."
+  (if (>= index 232)
+      (let ((level (+ 8 (* 10 (- index 232)))))
+        (format "#%02X%02X%02X" level level level))
+    (let* ((cube (- index 16))
+           (levels [0 95 135 175 215 255]))
+      (format "#%02X%02X%02X"
+              (aref levels (/ cube 36))
+              (aref levels (% (/ cube 6) 6))
+              (aref levels (% cube 6))))))
+
+(defun vterm-server--face (fg bg attrs)
+  "Return the face for the packed FG, BG and ATTRS of a run."
+  (let ((face nil)
+        (foreground (vterm-server--color fg t))
+        (background (vterm-server--color bg nil)))
+    (when foreground
+      (setq face (plist-put face :foreground foreground)))
+    (when background
+      (setq face (plist-put face :background background)))
+    (when (and (/= 0 (logand attrs 1)) (not vterm-disable-bold-font))
+      (setq face (plist-put face :weight 'bold)))
+    (when (and (/= 0 (logand attrs 2)) (not vterm-disable-underline))
+      (setq face (plist-put face :underline t)))
+    (when (/= 0 (logand attrs 4))
+      (setq face (plist-put face :slant 'italic)))
+    (when (and (/= 0 (logand attrs 16)) (not vterm-disable-inverse-video))
+      (setq face (plist-put face :inverse-video t)))
+    (when (/= 0 (logand attrs 32))
+      (setq face (plist-put face :strike-through t)))
+    face))
+
+(defun vterm-server--propertize (text runs)
+  "Return TEXT with the faces of RUNS, a list (START END FG BG ATTRS ...)."
+  (while runs
+    (let ((start (pop runs))
+          (end (pop runs))
+          (face (vterm-server--face (pop runs) (pop runs) (pop runs))))
+      (when face
+        (put-text-property start (min end (length text))
+                           'font-lock-face face text))))
+  text)
+
+(defun vterm-server--insert-history (text runs)
+  "Append the row TEXT with RUNS to the history before the screen."
+  (save-excursion
+    (goto-char vterm-server--screen-start)
+    (insert-before-markers (vterm-server--propertize text runs) "\n"))
+  (setq vterm-server--history (1+ vterm-server--history))
+  (when (> vterm-server--history vterm-max-scrollback)
+    (save-excursion
+      (goto-char (point-min))
+      (forward-line (- vterm-server--history vterm-max-scrollback))
+      (delete-region (point-min) (point)))
+    (setq vterm-server--history vterm-max-scrollback)))
+
+(defun vterm-server--apply-frame (cursor-row cursor-col cursor-visible rows)
+  "Replace the screen ROWS and place the cursor at CURSOR-ROW, CURSOR-COL.
+ROWS is a list of (ROW TEXT RUNS).  CURSOR-VISIBLE nil hides the cursor."
+  (let ((height (car vterm-server--size)))
+    (save-excursion
+      (goto-char vterm-server--screen-start)
+      ;; the screen always holds HEIGHT lines
+      (let ((lines (count-lines (point) (point-max))))
+        (goto-char (point-max))
+        (dotimes (_ (- height lines))
+          (insert "\n")))
+      ;; and no more once the terminal shrinks
+      (goto-char vterm-server--screen-start)
+      (when (zerop (forward-line height))
+        (delete-region (point) (point-max)))
+      (dolist (row rows)
+        (goto-char vterm-server--screen-start)
+        (when (zerop (forward-line (car row)))
+          (delete-region (point) (line-end-position))
+          (insert (vterm-server--propertize (nth 1 row) (nth 2 row))))))
+    (goto-char vterm-server--screen-start)
+    (forward-line cursor-row)
+    (move-to-column cursor-col t)
+    (setq cursor-type (and cursor-visible t))
+    (dolist (window (get-buffer-window-list (current-buffer) nil t))
+      (set-window-point window (point)))))
+
+(defun vterm-server--handle (message)
+  "Apply the server MESSAGE to the current buffer."
+  (let ((inhibit-read-only t))
+    (pcase message
+      (`(session ,id)
+       (setq vterm-server--session id)
+       (rename-buffer (format "*vterm-server %d*" id) t))
+      (`(scroll ,text ,runs) (vterm-server--insert-history text runs))
+      (`(frame ,row ,col ,visible . ,rows)
+       (vterm-server--apply-frame row col visible rows))
+      (`(title ,title) (vterm--set-title title))
+      (`(bell) (ding t))
+      (`(exit ,status)
+       (message "vterm-server: session %s exited with status %d"
+                vterm-server--session status)
+       (setq vterm-server--session nil))
+      (`(detached)
+       (message "vterm-server: session %s was attached elsewhere"
+                vterm-server--session)
+       (setq vterm-server--session nil))
+      (`(error ,text) (message "vterm-server: %s" text)))))
+
+(defun vterm-server--filter (process output)
+  "Read the messages of the server in OUTPUT from PROCESS."
+  (let ((buffer (process-buffer process)))
+    (when (buffer-live-p buffer)
+      (with-current-buffer buffer
+        (let ((data (concat vterm-server--pending output))
+              (start 0)
+              end)
+          (while (setq end (string-search "\n" data start))
+            (vterm-server--handle (car (read-from-string data start end)))
+            (setq start (1+ end)))
+          (setq vterm-server--pending (substring data start)))))))
+
+(defun vterm-server--sentinel (process _event)
+  "Forget the connection PROCESS once it is closed."
+  (let ((buffer (process-buffer process)))
+    (when (and (buffer-live-p buffer) (not (process-live-p process)))
+      (with-current-buffer buffer
+        (setq vterm-server--process nil)))))
+
+;;; Input
+
+(defun vterm-server-send-key (key &optional shift meta ctrl)
+  "Send KEY, as printed by `key-description', with modifiers to the server.
+SHIFT, META and CTRL non-nil add the respective modifier."
+  (when (process-live-p vterm-server--process)
+    (vterm-server--send vterm-server--process "key %d %s"
+                        (logior (if shift 1 0) (if meta 2 0) (if ctrl 4 0))
+                        key)))
+
+(defun vterm-server-self-insert ()
+  "Send the invoking key to the server."
+  (interactive)
+  (dolist (key (vterm--translate-event-to-args last-command-event))
+    (apply #'vterm-server-send-key key)))
+
+(defun vterm-server-self-insert-meta ()
+  "Send the invoking key with the meta modifier to the server."
+  (interactive)
+  (dolist (key (vterm--translate-event-to-args last-command-event :meta))
+    (apply #'vterm-server-send-key key)))
+
+(defun vterm-server-send-string (string)
+  "Send STRING to the program in the session as is."
+  (when (process-live-p vterm-server--process)
+    ;; the connection encodes STRING as UTF-8
+    (process-send-string vterm-server--process
+                         (format "input %d\n%s"
+                                 (length (encode-coding-string string
+                                                               'utf-8-unix))
+                                 string))))
+
+(defun vterm-server-yank ()
+  "Send the last killed text to the program in the session."
+  (interactive)
+  (vterm-server-send-string (current-kill 0)))
+
+(defvar vterm-server-mode-map
+  (let ((map (make-keymap))
+        (esc-map (make-keymap)))
+    (dotimes (i 128)
+      (let ((key (make-string 1 i)))
+        (unless (member (key-description key) vterm-keymap-exceptions)
+          (define-key map key #'vterm-server-self-insert))
+        (unless (or (eq i ?O) (eq i ?\[)
+                    (member (key-description key "\e")
+                            vterm-keymap-exceptions))
+          (define-key esc-map key #'vterm-server-self-insert-meta))))
+    (define-key map "\e" esc-map)
+    (define-key map [remap self-insert-command] #'vterm-server-self-insert)
+    (dolist (key '("<return>" "<tab>" "<backtab>" "<backspace>" "<escape>"
+                   "<up>" "<down>" "<left>" "<right>" "<insert>" "<delete>"
+                   "<home>" "<end>" "<prior>" "<next>"))
+      (define-key map (kbd key) #'vterm-server-self-insert))
+    (dotimes (i 12)
+      (define-key map (kbd (format "<f%d>" (1+ i))) #'vterm-server-self-insert))
+    (define-key map (kbd "C-c C-c") #'vterm-server-self-insert)
+    (define-key map (kbd "C-c C-d") #'vterm-server-detach)
+    (define-key map (kbd "C-y") #'vterm-server-yank)
+    map)
+  "Keymap for `vterm-server-mode'.")
+
+;;; Mode and commands
+
+(define-derived-mode vterm-server-mode fundamental-mode "VTerm-Server"
+  "Major mode for a terminal session owned by vterm-server."
+  (setq buffer-read-only t)
+  (setq-local truncate-lines t)
+  (setq-local scroll-conservatively 101)
+  (setq-local scroll-margin 0)
+  (setq vterm-server--screen-start (point-min-marker))
+  (add-hook 'window-size-change-functions #'vterm-server--resize nil t)
+  (add-hook 'kill-buffer-hook #'vterm-server--close nil t))
+
+(defun vterm-server--resize (window)
+  "Tell the server about the new size of WINDOW."
+  (with-current-buffer (window-buffer window)
+    (when (and (process-live-p vterm-server--process)
+               (eq window (get-buffer-window (current-buffer))))
+      (let ((size (with-selected-window window
+                    (vterm-server--window-size))))
+        (unless (equal size vterm-server--size)
+          (setq vterm-server--size size)
+          (vterm-server--send vterm-server--process "resize %d %d"
+                              (car size) (cdr size)))))))
+
+(defun vterm-server--close ()
+  "Detach from the session, leaving it running."
+  (when (process-live-p vterm-server--process)
+    (delete-process vterm-server--process)))
+
+(defun vterm-server--open (request)
+  "Show a new `vterm-server-mode' buffer and send REQUEST for it.
+REQUEST is a function called with the window size (ROWS . COLS)
+that returns the text of a \"new\" or \"attach\" request."
+  (vterm-server--ensure-running)
+  (let ((buffer (generate-new-buffer "*vterm-server*")))
+    (pop-to-buffer-same-window buffer)
+    (vterm-server-mode)
+    (setq vterm-server--size (vterm-server--window-size))
+    (setq vterm-server--process (vterm-server--connect buffer))
+    (vterm-server--send vterm-server--process "%s"
+                        (funcall request vterm-server--size))
+    buffer))
+
+;;;###autoload
+(defun vterm-server (&optional command)
+  "Start a new session running COMMAND (default the shell) in vterm-server."
+  (interactive)
+  (vterm-server--open (lambda (size)
+                        (format "new %d %d %s" (car size) (cdr size)
+                                (or command vterm-shell)))))
+
+(defun vterm-server-list-sessions ()
+  "Return the sessions of the server as a list (ID ROWS COLS RUNNING TITLE)."
+  (let* ((reply nil)
+         (deadline (+ (float-time) 5))
+         (process (vterm-server--make-connection
+                   "vterm-server-list"
+                   :coding 'utf-8-unix
+                   :noquery t
+                   :filter (lambda (_process output)
+                             (setq reply (concat reply output))))))
+    (unwind-protect
+        (progn
+          (vterm-server--send process "list")
+          (while (and (not (and reply (string-suffix-p "\n" reply)))
+                      (process-live-p process)
+                      (< (float-time) deadline))
+            (accept-process-output process 0.1))
+          (unless (and reply (string-suffix-p "\n" reply))
+            (error "vterm-server did not answer"))
+          (cdr (car (read-from-string reply))))
+      (delete-process process))))
+
+;;;###autoload
+(defun vterm-server-attach (id)
+  "Show the vterm-server session ID in a new buffer.
+A session whose program exited shows its last screen and is then
+gone from the server."
+  (interactive
+   (progn
+     (vterm-server--ensure-running)
+     (let* ((sessions (vterm-server-list-sessions))
+            (choices (mapcar (lambda (s)
+                               (cons (format "%d: %s%s" (nth 0 s) (nth 4 s)
+                                             (if (nth 3 s) "" " (exited)"))
+                                     (nth 0 s)))
+                             sessions)))
+       (unless choices
+         (user-error "No vterm-server sessions"))
+       (list (cdr (assoc (completing-read "Attach to session: " choices nil t)
+                         choices))))))
+  (vterm-server--open (lambda (size)
+                        (format "attach %d %d %d" id (car size) (cdr size)))))
+
+(defun vterm-server-detach ()
+  "Close this buffer and leave its session running in the server."
+  (interactive)
+  (kill-buffer (current-buffer)))
+
+(provide 'vterm-server)
+;;; vterm-server.el ends here
@@ -213,6 +213,10 @@ Downloads prebuilt binaries for supported platforms and architectures."
 ;; awk -F\" '/bind_function*/ {print "(declare-function", $2, "\"vterm-module\")"}' vterm-module.c
 (declare-function vterm--new "vterm-module")
 (declare-function vterm--update "vterm-module")
+(declare-function vterm--memory-stats "vterm-module")
+(declare-function vterm--cpu-time "vterm-module")
+(declare-function vterm--complete-token "vterm-module")
+(declare-function vterm--key-event "vterm-module")
 (declare-function vterm--redraw "vterm-module")
 (declare-function vterm--write-input "vterm-module")
 (declare-function vterm--set-size "vterm-module")
@@ -220,6 +224,17 @@ Downloads prebuilt binaries for supported platforms and architectures."
 (declare-function vterm--get-pwd-raw "vterm-module")
 (declare-function vterm--reset-point "vterm-module")
 (declare-function vterm--get-icrnl "vterm-module")
+(declare-function vterm--face-runs "vterm-module")
+(declare-function vterm--line-id "vterm-module")
+(declare-function vterm--line-id-from-end "vterm-module")
+(declare-function vterm--line-ids "vterm-module")
+(declare-function vterm--feed-lines "vterm-module")
+(declare-function vterm--screen-text "vterm-module")
+(declare-function vterm--screen-cells "vterm-module")
+(declare-function vterm--set-eval-cmds "vterm-module")
+(declare-function vterm--expect "vterm-module")
+(declare-function vterm--export-scrollback "vterm-module")
+(declare-function vterm--expect-cancel "vterm-module")
 (declare-function vterm--conpty-init "vterm-module")
 (declare-function vterm--conpty-write "vterm-module")
 (declare-function vterm--conpty-read-pending "vterm-module")
@@ -478,6 +493,67 @@ you can use `M-x blink-cursor-mode` to toggle."
   :type 'boolean
   :group 'vterm)
 
+(defcustom vterm-lazy-faces nil
+  "When not-nil, faces are applied to terminal text only when it is displayed.
+
+Output is inserted as plain text and `jit-lock' asks the module for
+the colors and attributes of the lines about to be shown.  This makes
+large amounts of output cheaper, since scrollback that is never looked
+at gets no faces.  The option is read when the terminal is created."
+  :type 'boolean
+  :group 'vterm)
+
+(defcustom vterm-line-batch-max 1000
+  "Most lines delivered to the `vterm-subscribe-lines' callbacks per redraw.
+
+Completed lines past it are dropped and only counted, so a burst of
+output costs the subscribers at most this many lines per redraw
+however much of it there is.  The option is read when a
+subscription is added or removed."
+  :type 'integer
+  :group 'vterm)
+
+(defcustom vterm-scrollback-huge-pages nil
+  "When non-nil, keep the scrollback in memory backed by huge pages.
+
+Scrollback rows are allocated from 2 MB aligned blocks that the
+kernel is asked to back with transparent huge pages, which cuts TLB
+misses when large scrollbacks are rendered, searched or reflowed.
+With `prefault', every page of a block is faulted in when the block
+is mapped rather than on first use.  Only worth it for a large
+`vterm-max-scrollback'; the memory of a terminal's scrollback is
+then kept until it is cleared or killed.  Huge pages need Linux with
+transparent huge pages in `madvise' or `always' mode; elsewhere the
+blocks are merely aligned.  The option is read when the terminal is
+created."
+  :type '(choice (const :tag "Off" nil)
+                 (const :tag "Huge pages" t)
+                 (const :tag "Huge pages, prefaulted" prefault))
+  :group 'vterm)
+
+(defcustom vterm-schedule-budget 0.01
+  "Seconds a terminal may spend parsing and redrawing per scheduling tick.
+
+When a terminal exceeds it, Emacs stops reading its output until
+the next tick of `vterm-schedule-interval' seconds, so a program
+flooding a terminal is slowed down instead of delaying the others.
+Terminals shown in a window get `vterm-schedule-visible-weight'
+times this budget, and the terminal in the selected window is
+never held back.  If nil, output is always read as it comes."
+  :type '(choice (number :tag "Seconds")
+                 (const :tag "No limit" nil))
+  :group 'vterm)
+
+(defcustom vterm-schedule-interval 0.05
+  "Length in seconds of a tick of `vterm-schedule-budget'."
+  :type 'number
+  :group 'vterm)
+
+(defcustom vterm-schedule-visible-weight 4
+  "Multiple of `vterm-schedule-budget' given to visible terminals."
+  :type 'number
+  :group 'vterm)
+
 (defcustom vterm-copy-exclude-prompt t
   "When not-nil, the prompt is not included by `vterm-copy-mode-done'."
   :type 'boolean
@@ -524,6 +600,10 @@ copy-mode and set to nil on leaving."
   :type 'symbol
   :group 'vterm)
 
+(make-obsolete-variable 'vterm-decode-coding-system
+                        "The process output is passed to the module as raw UTF-8 bytes."
+                        "0.1")
+
 (defcustom vterm-debug nil
   "Enable debug logging for vterm.
 When non-nil, debug messages are logged to *Messages* buffer."
@@ -691,7 +771,6 @@ for paste operations or bulk updates to avoid excessive redisplay calls.")
 (defvar-local vterm--insert-function (symbol-function #'insert))
 (defvar-local vterm--delete-char-function (symbol-function #'delete-char))
 (defvar-local vterm--delete-region-function (symbol-function #'delete-region))
-(defvar-local vterm--undecoded-bytes nil)
 (defvar-local vterm--copy-mode-fake-newlines nil)
 (defvar-local vterm--mouse-mode 0
   "Current mouse tracking mode reported by the terminal application.
@@ -725,6 +804,29 @@ Benefits all platforms, with Windows gaining the most improvement.")
 (defvar-local vterm--update-count 0
   "Number of updates in current time window, used for adaptive timer.")
 
+(defvar-local vterm--schedule-tick nil
+  "Scheduling tick in which `vterm--schedule-mark' was taken.")
+
+(defvar-local vterm--fontify-anchor nil
+  "(TICK POS . FROM-END) of the last line `vterm--fontify-region' saw.
+POS is the start of a line FROM-END lines before the end of the
+buffer, valid while `buffer-chars-modified-tick' is TICK.")
+
+(defvar-local vterm--schedule-mark 0
+  "Microseconds of `vterm--cpu-time' at the start of the tick.")
+
+(defvar-local vterm--expect-callbacks nil
+  "Alist of (ID . CALLBACK) for the pending `vterm-expect' waiters.")
+
+(defvar-local vterm--line-subscribers nil
+  "Alist of (ID CALLBACK . FACES) for `vterm-subscribe-lines'.")
+
+(defvar-local vterm--line-subscriber-id 0
+  "Id of the last `vterm-subscribe-lines' subscription.")
+
+(defvar-local vterm--eval-cmds-synced nil
+  "Value of `vterm-eval-cmds' last sent to the module.")
+
 (defvar-local vterm--last-char-height nil
   "Last frame char height, used for DPI change detection.")
 
@@ -905,7 +1007,6 @@ Exceptions are defined by `vterm-keymap-exceptions'."
                                      process-environment))
         ;; TODO: Figure out why inhibit is needed for curses to render correctly.
         (inhibit-eol-conversion nil)
-        (coding-system-for-read 'binary)
         (process-adaptive-read-buffering nil)
         (width (max (- (window-max-chars-per-line) (vterm--get-margin-width))
                     vterm-min-window-width)))
@@ -916,7 +1017,9 @@ Exceptions are defined by `vterm-keymap-exceptions'."
                                   vterm-disable-inverse-video
                                   vterm-ignore-blink-cursor
                                   vterm-set-bold-highbright
-                                  vterm-ignore-cursor-change))
+                                  vterm-ignore-cursor-change
+                                  vterm-lazy-faces
+                                  vterm-scrollback-huge-pages))
     (setq buffer-read-only t)
     (setq-local scroll-conservatively 101)
     (setq-local scroll-margin 0)
@@ -927,6 +1030,8 @@ Exceptions are defined by `vterm-keymap-exceptions'."
 
     ;; Disable all automatic fontification
     (setq-local font-lock-defaults '(nil t))
+    (when vterm-lazy-faces
+      (jit-lock-register #'vterm--fontify-region))
 
     (add-function :filter-return
                   (local 'filter-buffer-substring-function)
@@ -955,7 +1060,9 @@ Exceptions are defined by `vterm-keymap-exceptions'."
                  (if (eq system-type 'berkeley-unix) "" "iutf8")
                  (window-body-height)
                  width (vterm--get-shell)))
-             ;; :coding 'no-conversion
+             ;; Bytes go both ways untranslated: the module splits and
+             ;; decodes the UTF-8 output itself, and its replies are UTF-8.
+             :coding 'binary
              :connection-type 'pty
              :file-handler t
              :filter #'vterm--filter
@@ -1197,16 +1304,27 @@ will invert `vterm-copy-exclude-prompt' for that call."
 (defun vterm--self-insert-meta ()
   (interactive)
   (when vterm--term
-    (dolist (key (vterm--translate-event-to-args
-                  last-command-event :meta))
-      (apply #'vterm-send-key key))))
+    (vterm--send-event last-command-event :meta)))
 
 (defun vterm--self-insert ()
   "Send invoking key to libvterm."
   (interactive)
   (when vterm--term
-    (dolist (key (vterm--translate-event-to-args
-                  last-command-event))
+    (vterm--send-event last-command-event)))
+
+(defun vterm--send-event (event &optional meta)
+  "Send the key EVENT to libvterm, adding the meta modifier if META.
+Plain characters and function keys are translated by the module;
+other events and input methods go through
+`vterm--translate-event-to-args'."
+  (deactivate-mark)
+  (if (and (not input-method-function)
+           (let ((inhibit-redisplay t)
+                 (inhibit-read-only t))
+             (vterm--key-event vterm--term event meta)))
+      (setq vterm--redraw-immediately t
+            vterm--force-redisplay t)
+    (dolist (key (vterm--translate-event-to-args event meta))
       (apply #'vterm-send-key key))))
 
 (defun vterm-send-key (key &optional shift meta ctrl accept-proc-output)
@@ -1232,9 +1350,8 @@ will invert `vterm-copy-exclude-prompt' for that call."
 With this you can directly send modified keys to applications
 running in the terminal (like Emacs or Nano)."
   (interactive)
-  (dolist (key (vterm--translate-event-to-args
-                (read-event)))
-    (apply #'vterm-send-key key)))
+  (when vterm--term
+    (vterm--send-event (read-event))))
 
 (defun vterm-send-start ()
   "Output from the system is started when the system receives START."
@@ -1395,6 +1512,101 @@ Argument ARG is passed to `yank'"
     (cl-letf (((symbol-function 'insert-for-yank) #'vterm-insert))
       (yank-pop arg))))
 
+;;; Completion of printed tokens
+
+(defconst vterm--token-chars "[:alnum:][:nonascii:]_./~:@%+-"
+  "Characters of the tokens indexed by `vterm--complete-token'.")
+
+(defun vterm-completion-at-point ()
+  "Complete the word before point from the tokens printed in the terminal.
+
+Words, paths and hashes on the screen and in the scrollback are
+candidates, the most recently printed first.  For use in
+`completion-at-point-functions'; `vterm-complete' sends the result
+to the shell."
+  (when (and vterm--term (vterm-cursor-in-command-buffer-p))
+    (let ((end (point))
+          (start (save-excursion
+                   (skip-chars-backward vterm--token-chars
+                                        (line-beginning-position))
+                   (point))))
+      (when (< start end)
+        (let ((candidates (vterm--complete-token
+                           vterm--term
+                           (buffer-substring-no-properties start end))))
+          (list start end
+                (lambda (string pred action)
+                  (if (eq action 'metadata)
+                      '(metadata (display-sort-function . identity)
+                                 (cycle-sort-function . identity))
+                    (complete-with-action action candidates string pred)))
+                :exclusive 'no))))))
+
+(defun vterm--complete-in-region (start end collection &optional predicate)
+  "Complete the text between START and END in the shell.
+
+COLLECTION and PREDICATE are as in `completion-in-region'."
+  (let* ((input (buffer-substring-no-properties start end))
+         (choice (completing-read "Complete: " collection predicate nil
+                                  input)))
+    (cond
+     ((string-prefix-p input choice)
+      (vterm-send-string (substring choice (length input))))
+     ((vterm-goto-char end)
+      (cl-loop repeat (length input) do (vterm-send-backspace))
+      (vterm-send-string choice)))
+    t))
+
+(defun vterm-complete ()
+  "Complete the word before the cursor from the terminal's output.
+
+See `vterm-completion-at-point'."
+  (interactive)
+  (vterm-goto-char (point))
+  (let ((completion-at-point-functions '(vterm-completion-at-point))
+        (completion-in-region-function #'vterm--complete-in-region))
+    (completion-at-point)))
+
+;;; Line ids
+
+(defun vterm-line-id (&optional pos)
+  "Return the id of the terminal line at POS, or at point.
+
+Each line printed gets an id one more than the line above it.  A
+line keeps its id as it scrolls into the scrollback and the ids of
+scrolled lines are never reused, so they can key caches of lines
+and let incremental consumers of the output resume where they left
+off.  A screen row rewritten in place, as after `clear', keeps its
+id.  The ids are
+those of the buffer, which shows the terminal as of the last
+redraw.  See `vterm-line-id-position' for the converse."
+  (when vterm--term
+    (save-excursion
+      (when pos
+        (goto-char pos))
+      (forward-line 0)
+      (vterm--line-id vterm--term (count-lines (point) (point-max))))))
+
+(defun vterm-line-id-position (id)
+  "Return the position of the start of the line with ID.
+Return nil if the line is no longer in the buffer, having been
+trimmed from the scrollback or cleared, or is not drawn yet."
+  (when vterm--term
+    (let ((from-end (vterm--line-id-from-end vterm--term id)))
+      (when from-end
+        (save-excursion
+          (vterm--goto-line (- from-end))
+          (point))))))
+
+(defun vterm-line-ids ()
+  "Return the line ids of the terminal as (OLDEST TOP LAST).
+OLDEST is the id of the oldest scrollback line, TOP and LAST those
+of the first and last screen rows.  They include output not yet
+redrawn, so LAST may exceed the id `vterm-line-id' returns for the
+last line of the buffer."
+  (when vterm--term
+    (vterm--line-ids vterm--term)))
+
 (defun vterm-mouse-set-point (event &optional promote-to-region)
   "Move point to the position clicked on with the mouse.
 But when clicking to the unused area below the last prompt,
@@ -1731,9 +1943,9 @@ PROC is the notification pipe process, _DATA is ignored (just a signal)."
                 (inhibit-read-only t))
             ;; Read pending output from C module
             (when-let* ((output (vterm--conpty-read-pending vterm--term)))
-              (setq output (vterm--handle-undecoded-bytes output))
               (when (> (length output) 0)
                 ;; Feed to libvterm for processing
+                (vterm--sync-eval-cmds)
                 (vterm--write-input vterm--term output)
                 (vterm--update vterm--term)))))))))
 
@@ -1880,55 +2092,6 @@ value of `vterm-buffer-name'."
 (defconst vterm-control-seq-prefix-regexp
   "[\032\e]")
 
-(defun vterm--handle-undecoded-bytes (input)
-  "Handle incomplete UTF-8 sequences at the end of INPUT.
-Prepends any previously saved incomplete bytes from `vterm--undecoded-bytes',
-scans for incomplete UTF-8 sequences at the end, saves them for the next call,
-and returns the safe-to-process portion of INPUT."
-  ;; Prepend any incomplete bytes from previous call
-  (when vterm--undecoded-bytes
-    (setq input (concat vterm--undecoded-bytes input))
-    (setq vterm--undecoded-bytes nil))
-  ;; Find incomplete UTF-8 sequence at end of input
-  ;; UTF-8 continuation bytes are 10xxxxxx (0x80-0xBF)
-  ;; UTF-8 start bytes are 11xxxxxx (0xC0-0xFF)
-  (let* ((len (length input))
-         (incomplete-start nil))
-    ;; Scan backwards to find potential incomplete UTF-8 sequence
-    (when (> len 0)
-      (let ((i (1- len))
-            (found-start nil))
-        ;; Look for incomplete sequence in last 4 bytes (max UTF-8 length)
-        (while (and (>= i (max 0 (- len 4)))
-                    (not found-start))
-          (let ((byte (aref input i)))
-            (cond
-             ;; ASCII byte (0x00-0x7F) - complete, stop scanning
-             ((< byte #x80)
-              (setq found-start t))
-             ;; Continuation byte (0x80-0xBF) - keep scanning
-             ((< byte #xC0)
-              (cl-decf i))
-             ;; Start byte (0xC0-0xFF) - check if sequence is complete
-             (t
-              (let ((expected-len
-                     (cond ((< byte #xE0) 2)
-                           ((< byte #xF0) 3)
-                           ((< byte #xF8) 4)
-                           (t 1))))  ; Invalid, treat as single byte
-                (when (> (+ i expected-len) len)
-                  ;; Incomplete sequence
-                  (setq incomplete-start i))
-                (setq found-start t))))))
-        ;; Handle edge case: only continuation bytes found
-        (when (and (not found-start) (< i (max 0 (- len 4))))
-          (setq incomplete-start (max 0 (- len 4))))))
-    ;; Save incomplete bytes for next call
-    (when incomplete-start
-      (setq vterm--undecoded-bytes (substring input incomplete-start))
-      (setq input (substring input 0 incomplete-start))))
-  input)
-
 (defun vterm--filter (process input)
   "I/O Event.  Feeds PROCESS's INPUT to the virtual terminal.
 
@@ -1941,15 +2104,77 @@ which handles escape sequence parsing natively in C."
         (buf (process-buffer process)))
     (when (buffer-live-p buf)
       (with-current-buffer buf
-        (setq input (vterm--handle-undecoded-bytes input))
         ;; Send all input directly to libvterm - it handles escape sequences natively
         (when (> (length input) 0)
+          (vterm--sync-eval-cmds)
           (ignore-errors (vterm--write-input vterm--term input)))
-        (vterm--update vterm--term)))))
+        (vterm--update vterm--term)
+        (vterm--schedule process)))))
+
+(defvar vterm--schedule-thread nil
+  "Thread that never reads output, to which held processes are locked.")
+
+(defun vterm--schedule-thread ()
+  "Return `vterm--schedule-thread', starting it if needed."
+  (unless (and vterm--schedule-thread (thread-live-p vterm--schedule-thread))
+    (let* ((mutex (make-mutex "vterm-schedule"))
+           (never (make-condition-variable mutex)))
+      (setq vterm--schedule-thread
+            (make-thread (lambda ()
+                           (with-mutex mutex
+                             (while t (condition-wait never))))
+                         "vterm-schedule"))))
+  vterm--schedule-thread)
+
+(defun vterm--schedule (process)
+  "Stop reading PROCESS until the next tick if it is over budget.
+See `vterm-schedule-budget'.  Reading resumes through
+`vterm--schedule-resume'."
+  (when (and vterm-schedule-budget vterm--term
+             (not (process-get process 'vterm-held)))
+    (let ((tick (floor (float-time) vterm-schedule-interval))
+          (spent (apply #'+ (vterm--cpu-time vterm--term))))
+      (unless (eql tick vterm--schedule-tick)
+        (setq vterm--schedule-tick tick
+              vterm--schedule-mark spent))
+      (setq spent (/ (- spent vterm--schedule-mark) 1e6))
+      (when (and (> spent vterm-schedule-budget)
+                 (not (eq (current-buffer) (window-buffer (selected-window))))
+                 (or (not (get-buffer-window nil t))
+                     (> spent (* vterm-schedule-budget
+                                 vterm-schedule-visible-weight))))
+        ;; Lock the process to a thread that never reads rather than set
+        ;; its filter to t: the output left when the program exits is
+        ;; then still read before the sentinel runs, which Emacs skips
+        ;; for a filter of t.
+        (if (fboundp 'make-thread)
+            (progn
+              (process-put process 'vterm-held
+                           (cons 'thread (process-thread process)))
+              (set-process-thread process (vterm--schedule-thread)))
+          ;; the filter may be advised or replaced by the user
+          (process-put process 'vterm-held
+                       (cons 'filter (process-filter process)))
+          (set-process-filter process t))
+        (run-with-timer (- (* (1+ tick) vterm-schedule-interval) (float-time))
+                        nil #'vterm--schedule-resume process)))))
+
+(defun vterm--schedule-resume (process)
+  "Read the output of PROCESS again after `vterm--schedule' held it back."
+  (pcase (process-get process 'vterm-held)
+    (`(thread . ,thread)
+     (when (eq (process-thread process) vterm--schedule-thread)
+       (set-process-thread process thread)))
+    (`(filter . ,filter)
+     (when (eq (process-filter process) t)
+       (set-process-filter process filter))))
+  (process-put process 'vterm-held nil))
 
 (defun vterm--sentinel (process event)
   "Sentinel of vterm PROCESS.
 Argument EVENT process event."
+  ;; a process held by `vterm--schedule' exited before its tick ended
+  (vterm--schedule-resume process)
   (let ((buf (process-buffer process)))
     (run-hook-with-args 'vterm-exit-functions
                         (if (buffer-live-p buf) buf nil)
@@ -2076,15 +2301,52 @@ If N is negative backward-line from end of buffer."
     (goto-char (point-max))
     (eq 0 (forward-line n)))))
 
+(defun vterm--apply-events (events)
+  "Apply the side-channel EVENTS of one redraw.
+EVENTS is a plist built by the module, with only the entries that
+changed since the last redraw, in the order they must be applied:
+:cursor-type, :cursor-blink, :bell, :title, :directory, :eval (a
+list of 51;E commands, see `vterm--eval-command'), :expect (the
+ids of the `vterm-expect' waiters that matched), :lines (completed
+lines, see `vterm--deliver-lines') and :selection (a list (MASK
+DATA))."
+  (while events
+    (let ((key (pop events))
+          (value (pop events)))
+      (pcase key
+        (:cursor-type (setq cursor-type value))
+        (:cursor-blink (blink-cursor-mode (if value 1 0)))
+        (:bell (ding t))
+        (:title (vterm--set-title value))
+        (:directory (vterm--set-directory value))
+        (:eval (dolist (command value)
+                 (if (stringp command)
+                     (vterm--eval command)
+                   (vterm--eval-command command))))
+        (:expect (dolist (id value)
+                   (let ((callback (alist-get id vterm--expect-callbacks)))
+                     (setq vterm--expect-callbacks
+                           (assq-delete-all id vterm--expect-callbacks))
+                     (when callback
+                       (condition-case-unless-debug err
+                           (funcall callback)
+                         (error (message "vterm: error in expect callback: %S"
+                                         err)))))))
+        (:lines (vterm--deliver-lines (car value) (cdr value)))
+        (:selection (apply #'vterm--set-selection value))))))
+
 (defun vterm--set-title (title)
   "Use TITLE to set the buffer name according to `vterm-buffer-name-string'."
   (when vterm-buffer-name-string
-    (rename-buffer (format vterm-buffer-name-string title) t)))
+    (let ((name (format vterm-buffer-name-string title)))
+      (unless (equal name (buffer-name))
+        (rename-buffer name t)))))
 
 (defun vterm--set-directory (path)
   "Set `default-directory' to PATH."
   (let ((dir (vterm--get-directory path)))
-    (when dir (setq default-directory dir))))
+    (when (and dir (not (equal dir default-directory)))
+      (setq default-directory dir))))
 
 (defun vterm--get-directory (path)
   "Get normalized directory to PATH.
@@ -2113,6 +2375,46 @@ Uses a cache to avoid repeated filesystem checks on all platforms."
             (push (cons path directory) vterm--directory-cache))
           directory))))
 
+(defun vterm--lines-from-end (pos)
+  "Return the number of lines from POS, a line start, to the end.
+Counted from the line `vterm--fontify-region' saw last when the
+buffer text is unchanged since, so fontifying chunk after chunk
+while scrolling costs the distance between them rather than that to
+the end of the buffer."
+  (let* ((tick (buffer-chars-modified-tick))
+         (anchor (and (eq (car vterm--fontify-anchor) tick)
+                      (cdr vterm--fontify-anchor)))
+         (from-end (cond
+                    ((null anchor) (count-lines pos (point-max)))
+                    ((<= pos (car anchor))
+                     (+ (cdr anchor) (count-lines pos (car anchor))))
+                    (t (- (cdr anchor) (count-lines (car anchor) pos))))))
+    (setq vterm--fontify-anchor (cons tick (cons pos from-end)))
+    from-end))
+
+(defun vterm--fontify-region (start end)
+  "Apply the terminal faces to the lines between START and END.
+Registered with `jit-lock' when `vterm-lazy-faces' is non-nil."
+  (when vterm--term
+    (save-excursion
+      (goto-char start)
+      (forward-line 0)
+      (setq start (point))
+      (let ((runs (vterm--face-runs vterm--term
+                                    (vterm--lines-from-end start)
+                                    (max 1 (count-lines start end)))))
+        (dolist (line runs)
+          (let ((bol (point))
+                (limit (1+ (line-end-position))))
+            (while line
+              (let ((beg (+ bol (pop line)))
+                    (end (+ bol (pop line)))
+                    (face (pop line)))
+                (when (< beg limit)
+                  (put-text-property beg (min end limit (point-max))
+                                     'face face))))
+            (forward-line 1)))))))
+
 (defun vterm--get-pwd (&optional linenum)
   "Get working directory at LINENUM."
   (when vterm--term
@@ -2122,6 +2424,169 @@ Uses a cache to avoid repeated filesystem checks on all platforms."
       (when raw-pwd
         (vterm--get-directory raw-pwd)))))
 
+;;;###autoload
+(defun vterm-memory-stats (&optional buffer)
+  "Return memory accounting statistics of the vterm in BUFFER.
+
+BUFFER defaults to the current buffer.  The result is a plist with
+one entry per subsystem (`:scrollback', `:strings', `:libvterm',
+`:metadata', `:tokens', `:lines'),
+each a list (LIVE-BYTES LIVE-OBJECTS PEAK-BYTES TOTAL-ALLOCS); the
+arenas `:persistent-arena' and `:temp-arena', each a list (USED
+RESERVED PEAK-USED BLOCKS); with `vterm-scrollback-huge-pages',
+`:scrollback-pool', a list (USED RESERVED RESIDENT HUGE) in bytes;
+and `:total', a list (LIVE-BYTES PEAK-BYTES) over all heap
+allocations.
+
+When called interactively, show a one-line summary instead."
+  (interactive)
+  (let ((term (buffer-local-value 'vterm--term
+                                  (get-buffer (or buffer (current-buffer))))))
+    (unless term
+      (user-error "Not a vterm buffer"))
+    (let ((stats (vterm--memory-stats term)))
+      (when (called-interactively-p 'interactive)
+        (message "vterm: heap %s (peak %s), scrollback %s, arena %s"
+                 (file-size-human-readable (car (plist-get stats :total)))
+                 (file-size-human-readable (cadr (plist-get stats :total)))
+                 (file-size-human-readable
+                  (car (or (plist-get stats :scrollback-pool)
+                           (plist-get stats :scrollback))))
+                 (file-size-human-readable
+                  (cadr (plist-get stats :persistent-arena)))))
+      stats)))
+
+(defun vterm-export-scrollback (file &optional ansi buffer)
+  "Write the scrollback and screen of the vterm in BUFFER to FILE.
+
+Lines are written as the program printed them: rows that wrapped
+are joined and trailing blanks are dropped.  With ANSI non-nil
+\(interactively, with a prefix argument), colors and attributes are
+kept as ANSI escape sequences.  BUFFER defaults to the current
+buffer.  The text is written by the module and never copied into
+Lisp strings.  Return the number of lines written."
+  (interactive
+   (list (read-file-name "Export scrollback to file: ") current-prefix-arg))
+  (let* ((buffer (or buffer (current-buffer)))
+         (term (buffer-local-value 'vterm--term buffer))
+         (file (expand-file-name file))
+         lines)
+    (unless term
+      (user-error "Not a vterm buffer"))
+    (setq lines (vterm--export-scrollback term file (and ansi 'ansi)))
+    (unless lines
+      (signal 'file-error (list "Writing scrollback" file)))
+    (when (called-interactively-p 'interactive)
+      (message "Wrote %d lines to %s" lines file))
+    lines))
+
+(defun vterm-expect (string callback &optional buffer)
+  "Call CALLBACK once STRING appears in the output of the vterm in BUFFER.
+
+BUFFER defaults to the current buffer.  STRING is matched literally
+against the screen and then against the text written to the
+terminal from now on, escape sequences excluded, as the output
+arrives; CALLBACK is called once with no argument, in the vterm
+buffer, at the next redraw if STRING is on the screen already.
+Return an id for `vterm-expect-cancel'."
+  (with-current-buffer (or buffer (current-buffer))
+    (unless vterm--term
+      (user-error "Not a vterm buffer"))
+    (let ((waiter (vterm--expect vterm--term string)))
+      (unless waiter
+        (error "Cannot wait for %S" string))
+      (push (cons (car waiter) callback) vterm--expect-callbacks)
+      (when (cadr waiter)
+        (vterm--invalidate))
+      (car waiter))))
+
+(defun vterm-expect-cancel (id &optional buffer)
+  "Stop waiting for the `vterm-expect' waiter ID in BUFFER.
+Return non-nil if it had not matched yet."
+  (with-current-buffer (or buffer (current-buffer))
+    (setq vterm--expect-callbacks (assq-delete-all id vterm--expect-callbacks))
+    (and vterm--term (vterm--expect-cancel vterm--term id))))
+
+(defun vterm-expect-wait (string &optional timeout buffer)
+  "Wait until STRING appears in the output of the vterm in BUFFER.
+Give up after TIMEOUT seconds if non-nil.  Return non-nil if STRING
+appeared.  See `vterm-expect'."
+  (let* ((buffer (or buffer (current-buffer)))
+         (matched nil)
+         (id (vterm-expect string (lambda () (setq matched t)) buffer))
+         (deadline (and timeout (+ (float-time) timeout)))
+         (proc (get-buffer-process buffer)))
+    (while (and (not matched)
+                (buffer-live-p buffer)
+                (if deadline
+                    (< (float-time) deadline)
+                  (process-live-p proc)))
+      ;; not PROC, which may be locked to `vterm--schedule-thread'
+      (accept-process-output nil 0.05))
+    (unless matched
+      (when (buffer-live-p buffer)
+        (vterm-expect-cancel id buffer)))
+    matched))
+
+;;; Line subscriptions
+
+(defun vterm-subscribe-lines (callback &optional faces buffer)
+  "Call CALLBACK with the lines completed in the vterm in BUFFER.
+
+BUFFER defaults to the current buffer.  A line is complete once the
+cursor has moved below it or it has scrolled off the screen; rows
+joined by line wrapping make one line.  After each redraw that
+completed some, CALLBACK is called in the vterm buffer with two
+arguments: a list of (ID TEXT RUNS), oldest first, and the number
+of lines dropped since the previous call for exceeding
+`vterm-line-batch-max'.  ID is the line id of the first row (see
+`vterm-line-id'), TEXT the plain text without trailing blanks.  If
+FACES is non-nil, RUNS is a list of START END FACE triples, offsets
+into TEXT, else nil.
+
+Only lines printed from now on are delivered, and not those of the
+alternate screen of full-screen programs.  When a program moves the
+cursor back up, as `clear' does, the lines below it are delivered
+again as it leaves them, with the same ids.  An error in CALLBACK
+is reported but does not stop the redraw.  Return an id for
+`vterm-unsubscribe-lines'."
+  (with-current-buffer (or buffer (current-buffer))
+    (unless vterm--term
+      (user-error "Not a vterm buffer"))
+    (let ((id (cl-incf vterm--line-subscriber-id)))
+      (push (cons id (cons callback faces)) vterm--line-subscribers)
+      (vterm--update-line-feed)
+      id)))
+
+(defun vterm-unsubscribe-lines (id &optional buffer)
+  "Remove the `vterm-subscribe-lines' subscription ID in BUFFER."
+  (with-current-buffer (or buffer (current-buffer))
+    (setq vterm--line-subscribers
+          (assq-delete-all id vterm--line-subscribers))
+    (vterm--update-line-feed)))
+
+(defun vterm--update-line-feed ()
+  "Tell the module what the line subscribers need."
+  (when vterm--term
+    (vterm--feed-lines vterm--term
+                       (and vterm--line-subscribers vterm-line-batch-max)
+                       (cl-some #'cddr vterm--line-subscribers))))
+
+(defun vterm--deliver-lines (dropped lines)
+  "Pass LINES and the count of DROPPED lines to the line subscribers.
+LINES are (ID TEXT RUNS) lists; subscribers that did not ask for
+faces get them with RUNS nil."
+  (let ((plain (if (cl-some #'cddr vterm--line-subscribers)
+                   (mapcar (lambda (line) (list (car line) (cadr line) nil))
+                           lines)
+                 lines)))
+    (dolist (subscriber (reverse vterm--line-subscribers))
+      (condition-case-unless-debug err
+          (funcall (cadr subscriber)
+                   (if (cddr subscriber) lines plain)
+                   dropped)
+        (error (message "vterm: error in line subscriber: %S" err))))))
+
 (defun vterm--get-color (index &rest args)
   "Get color by INDEX from `vterm-color-palette'.
 
@@ -2153,14 +2618,30 @@ instead of background."
 
 All passed in arguments are strings and forwarded as string to
 the called functions."
-  (let* ((parts (split-string-and-unquote str))
-         (command (car parts))
-         (args (cdr parts))
-         (f (assoc command vterm-eval-cmds)))
+  (vterm--eval-command (split-string-and-unquote str)))
+
+(defun vterm--eval-command (command)
+  "Execute COMMAND, a list (NAME ARGS...), if NAME is in `vterm-eval-cmds'.
+The module splits 51;E payloads into such lists itself, and sends
+only the NAME of commands missing from its copy of `vterm-eval-cmds'."
+  (let ((f (assoc (car command) vterm-eval-cmds)))
     (if f
-        (apply (cadr f) args)
+        (apply (cadr f) (cdr command))
       (message "Failed to find command: %s.  To execute a command,
-                add it to the `vterm-eval-cmd' list" command))))
+                add it to the `vterm-eval-cmd' list" (car command)))))
+
+(defun vterm--sync-eval-cmds ()
+  "Send the command names of `vterm-eval-cmds' to the module if it changed.
+Only a new list is noticed, as made by `add-to-list' or `setq';
+the module copy only lets commands through early, the check that
+counts is made again by `vterm--eval-command'."
+  (unless (eq vterm--eval-cmds-synced vterm-eval-cmds)
+    (vterm--set-eval-cmds vterm--term
+                          (delq nil (mapcar (lambda (entry)
+                                              (and (stringp (car-safe entry))
+                                                   (car entry)))
+                                            vterm-eval-cmds)))
+    (setq vterm--eval-cmds-synced vterm-eval-cmds)))
 
 ;; TODO: Improve doc string, it should not point to the readme but it should
 ;;       be self-contained.